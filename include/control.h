@@ -0,0 +1,23 @@
+#pragma once
+
+struct display;
+struct gsthelper;
+
+/*
+ * Line based control socket for changing a running session:
+ *   bitrate <kbps>       encoder target bitrate
+ *   gop <frames>         distance between keyframes
+ *   fps <n>              target frame rate of the stream
+ *   keyframe             force a keyframe now
+ *   pause | resume       pipeline state
+ *   preview on|off       open or close the Wayland preview
+ *   replay <s> <file>    write the last s seconds to an .mp4/.mkv, see replay.h
+ *   snapshot             "snapshot <mime> <size>" and the image, see snapshot.h
+ *   stats                current metrics, see metrics.h
+ *   text <utf-8>         type the rest of the line on the keyboard
+ *   gamepad <axis>=<n>.. one gamepad frame, buttons=<mask> for the buttons
+ * Every command is answered by "ok" or "error <reason>" on its own line,
+ * replay only once the file is written.
+ */
+int control_start(const char *path, struct display *display, struct gsthelper *gsthelper);
+void control_stop(void);
@@ -1,10 +1,30 @@
 #pragma once
 
+#include <atomic>
+#include <stdint.h>
+
 #define DISPLAY_WIDTH 1920
 #define DISPLAY_HEIGHT 1080
 #define DISPLAY_REFRESH_RATE 60
 
 #define DISPLAY_SOCKET_PATH "/tmp/playdroid_socket"
+#define DISPLAY_MAX_OUTPUTS 8
+
+/*
+ * A secondary display of the producer (virtual display, cast target),
+ * multiplexed over the same connection by MessageData.display_id. It has its
+ * own pipeline and input FIFOs, so touches land in its coordinate space. The
+ * preview, snapshots, replay, watchdog and demand-driven rendering only
+ * follow the primary display, which keeps using the fields of struct display.
+ */
+struct display_output {
+    uint32_t id;
+    int width;
+    int height;
+    int refresh_rate;
+    struct gsthelper *gsthelper;
+    struct input *input;
+};
 
 struct display {
     const char *socket_path;
@@ -13,9 +33,43 @@ struct display {
     int height;
     int refresh_rate;
 
+    struct display_output outputs[DISPLAY_MAX_OUTPUTS];
+    int output_count;
+
     struct window_state *wayland_state;
     bool open_wayland_window;
+    bool stream_with_preview; // stream and open the wayland window
+
+    // The listening socket, pipeline and window live across producer
+    // connections, a restarted producer resumes on them
+    int listen_sock;
+    int producer_sock; // -1 while no producer is connected
+    uint64_t producer_connections;
+
+    bool io_uring;            // --io=uring, see uring.h
+    struct uring_recv *uring; // NULL while poll() and recvmsg() are used
+
+    // Demand-driven rendering, only for producers that announced support
+    bool producer_can_pause;
+    bool rendering_paused;
+    uint64_t demand_checked_ms;
+
+    // Requests from other threads, applied by run_display() after wake_fd
+    int wake_fd;
+    std::atomic<int> requested_refresh_rate; // 0 when nothing is requested
+    std::atomic<int> requested_preview;      // PREVIEW_REQUEST_*
+    std::atomic<int> requested_handoff;      // successor connection, see handoff.h
+};
+
+enum {
+    PREVIEW_REQUEST_NONE,
+    PREVIEW_REQUEST_ON,
+    PREVIEW_REQUEST_OFF,
 };
 
 void init_display(struct display *display);
 void run_display(struct display *display, struct gsthelper *gsthelper);
+void display_wake(struct display *display);
+/* `spec` is "<id>:<width>x<height>[@<fps>][:<pipeline>]", without a pipeline
+ * the default one is built for it. The spec must outlive the display. */
+int display_add_output(struct display *display, char *spec);
@@ -0,0 +1,19 @@
+#pragma once
+
+#include <atomic>
+#include <stdint.h>
+
+/*
+ * A received dmabuf fd shared by every consumer of a frame. Each consumer
+ * takes its own reference and the fd is closed when the last one is dropped,
+ * so the GStreamer and Wayland paths can use one import without copies.
+ */
+struct dmabuf_ref {
+    int fd;
+    uint64_t id; // frame number, ties trace spans and buffers together
+    std::atomic<int> refcount;
+};
+
+struct dmabuf_ref *dmabuf_ref_new(int fd);
+struct dmabuf_ref *dmabuf_ref_get(struct dmabuf_ref *ref);
+void dmabuf_ref_put(struct dmabuf_ref *ref);
@@ -1,20 +1,79 @@
 #pragma once
 
+#include <atomic>
 #include <gst/allocators/gstdmabuf.h>
 #include <gst/app/gstappsrc.h>
 #include <gst/gst.h>
 #include <gst/video/gstvideometa.h>
 
+#define GST_TRACE_PENDING 64
+// appsrc full for this long means frames are produced faster than consumed
+#define GST_BACKPRESSURE_PAUSE_MS 500
+// Failed pushes in a row before the pipeline counts as stalled
+#define GST_STALL_PUSH_FAILURES 10
+
+// Frames inside the encoder, matched by PTS when they come out
+struct gst_trace_pending {
+    GstClockTime pts;
+    guint64 id;
+    guint64 in_ns;
+};
+
 struct gsthelper {
     GstAllocator *allocator;
     char *gst_pipeline;
+    const char *codec; // for the built pipeline, NULL for any
+    bool built;        // gst_pipeline came from pipeline_build()
+    uint32_t display_id; // see struct display_output, 0 for the primary display
+    struct input *input;
+    // Held by other threads using pipeline, encoder or sink, and while the
+    // display thread swaps them. g_rec_mutex_init() where this is allocated.
+    GRecMutex lock;
     GstElement *pipeline;
     GstAppSrc *appsrc;
     GstBus *bus;
 
+    // What appsrc currently announces, from the producer's frames
+    int width;
+    int height;
+    int refresh_rate;
+    uint32_t drm_format;
+    uint64_t modifier;
+    bool dmabuf_caps; // downstream accepted memory:DMABuf
+
     bool want_data;
+    bool paused;
+    std::atomic<gint64> enough_data_since; // g_get_monotonic_time(), 0 while data is wanted
+
+    // The sink viewers connect to, if it reports them
+    GstElement *sink;
+    std::atomic<int> consumers;
+
+    // Health, see watchdog.h. Times are g_get_monotonic_time()
+    std::atomic<gint64> last_push_us;   // last frame into appsrc
+    std::atomic<gint64> last_output_us; // last buffer out of the encoder
+    std::atomic<int> push_failures;     // in a row
+    std::atomic<bool> failed;           // an error was posted
+
+    GstElement *encoder;
+    GMutex trace_lock;
+    struct gst_trace_pending trace_pending[GST_TRACE_PENDING];
+    guint trace_next;
 };
 
 int gst_pipeline_init(struct gsthelper *gsthelper, int width, int height, int refresh_rate, struct input *input);
 void gst_pipeline_deinit(struct gsthelper *gsthelper);
-void gst_output_frame(struct gsthelper *gsthelper, int dmabuf_fd, int width, int height, int refresh_rate, gsize offset, gint stride);
+void gst_pipeline_drain(struct gsthelper *gsthelper, int timeout_ms);
+int gst_pipeline_set_framerate(struct gsthelper *gsthelper, int width, int height, int refresh_rate);
+int gst_pipeline_set_bitrate(struct gsthelper *gsthelper, guint kbps);
+int gst_pipeline_set_gop(struct gsthelper *gsthelper, guint frames);
+int gst_pipeline_force_keyframe(struct gsthelper *gsthelper);
+int gst_pipeline_set_paused(struct gsthelper *gsthelper, bool paused);
+int gst_pipeline_send_input(struct gsthelper *gsthelper, GstStructure *structure);
+int gst_pipeline_viewers(struct gsthelper *gsthelper);
+bool gst_pipeline_wants_frames(struct gsthelper *gsthelper);
+const char *gst_pipeline_stalled(struct gsthelper *gsthelper, int stall_ms);
+int gst_pipeline_restart(struct gsthelper *gsthelper);
+int gst_pipeline_rebuild(struct gsthelper *gsthelper);
+void gst_output_frame(struct gsthelper *gsthelper, struct dmabuf_ref *frame, int width, int height, int refresh_rate,
+                      uint32_t format, uint64_t modifier, gsize offset, gint stride);
@@ -0,0 +1,27 @@
+#pragma once
+
+struct display;
+struct gsthelper;
+struct input;
+
+/*
+ * Binary upgrades without dropping the producer. The running streamer
+ * listens on a handoff socket (`--handoff=<path>`), a new one started with
+ * `--takeover=<path>` connects to it and receives over SCM_RIGHTS:
+ *   - the producer listening socket and the connected producer, if any
+ *   - the open input FIFOs
+ * together with the resolution, touch slots, held keys and gamepad state.
+ * The old streamer then drains its pipeline, releases its control and
+ * metrics endpoints and exits, after which the new one builds its pipeline.
+ * Sink sockets are not handed over, viewers reconnect to the new pipeline.
+ * Sessions with secondary displays (--virtual-display) cannot be handed off.
+ */
+
+// Old side, accepts successors until one took over, asking the display thread to hand off
+int handoff_start(const char *path, struct display *display, struct input *input);
+void handoff_stop(void);
+// Called by the display thread once requested_handoff is set, 0 when handed off
+int handoff_transfer(struct display *display, struct gsthelper *gsthelper);
+
+// New side, blocks until the old streamer has released everything. -1 means a cold start
+int handoff_takeover(const char *path, struct display *display, struct input *input);
@@ -0,0 +1,45 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdio.h>
+
+struct input_event;
+
+#define INPUT_RECORD_MAGIC "PDINPUT1"
+#define INPUT_RECORD_VERSION 1
+#define INPUT_RECORD_MAX_EVENTS 255
+
+/*
+ * Recording layout: one file header, then a sequence of batches. A batch is
+ * one write() to a device FIFO: a batch header followed by `count` events.
+ * Event timestamps are not stored per event since every event of a batch
+ * shares the CLOCK_MONOTONIC time taken by the handler that emitted it.
+ */
+struct input_record_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t reserved;
+};
+
+struct input_record_batch {
+    uint64_t time_us; // CLOCK_MONOTONIC of the emitting handler
+    uint8_t device;   // INPUT_TOUCH, INPUT_KEYBOARD, ...
+    uint8_t count;
+    uint16_t reserved;
+    uint32_t reserved2;
+};
+
+struct input_record_event {
+    uint16_t type;
+    uint16_t code;
+    int32_t value;
+};
+
+struct input_recorder;
+
+struct input_recorder *input_recorder_open(const char *path);
+void input_recorder_write(struct input_recorder *recorder, int device, const struct input_event *events, unsigned int count);
+void input_recorder_close(struct input_recorder *recorder);
+
+FILE *input_record_open(const char *path);
+int input_record_read(FILE *file, struct input_record_batch *batch, struct input_record_event *events);
@@ -1,30 +1,87 @@
 #pragma once
 
+#include <pthread.h>
 #include <stdint.h>
 #include <array>
 
 #define MAX_TOUCHPOINTS 10
+#define GAMEPAD_AXIS_COUNT 0x40   // ABS_CNT
+#define GAMEPAD_BUTTON_COUNT 15   // BTN_SOUTH .. BTN_THUMBR
+#define INPUT_PIPE_NAME_MAX 64
 
 enum {
     INPUT_TOUCH,
     INPUT_KEYBOARD,
     INPUT_POINTER,
+    INPUT_GAMEPAD,
     INPUT_TOTAL
 };
 
+struct input_stats {
+    uint64_t writes;
+    uint64_t events;
+    uint64_t failed;
+    uint64_t latency_us_total; // handler entry to completed write
+    uint64_t latency_us_max;
+};
+
+struct input_pipe_state {
+    uint64_t retry_at_ms;
+    uint32_t backoff_ms;
+    bool write_blocked;
+};
+
+struct touch_point {
+    int x;
+    int y;
+    int pressure;
+};
+
+struct gamepad_state {
+    int32_t axis[GAMEPAD_AXIS_COUNT];
+    int32_t axis_sent[GAMEPAD_AXIS_COUNT];
+    uint64_t axis_dirty;
+    uint32_t buttons;      // bit i is BTN_GAMEPAD + i
+    uint32_t buttons_sent;
+};
+
 struct input {
+    // Held by whoever delivers events, across the handlers and the
+    // input_flush() after them: the sink's threads and the control socket
+    pthread_mutex_t lock;
+    // Each display has its own FIFOs and so its own touch coordinate space,
+    // set before init_input()
+    uint32_t display_id;
+    char pipe_name[INPUT_TOTAL][INPUT_PIPE_NAME_MAX];
     int input_fd[INPUT_TOTAL];
+    struct input_stats stats[INPUT_TOTAL];
+    struct input_pipe_state pipe_state[INPUT_TOTAL];
+    const char *record_path;
+    struct input_recorder *recorder;
+    // Writes are queued until input_flush() with --io=uring, set before init_input()
+    bool io_uring;
+    struct uring_writer *writer;
     int ptrPrvX;
     int ptrPrvY;
     double wheelAccumulatorX;
     double wheelAccumulatorY;
     bool reverseScroll;
     int touch_id[MAX_TOUCHPOINTS];
+    struct touch_point touch_state[MAX_TOUCHPOINTS];
     std::array<uint8_t, 239> keysDown;
+    struct gamepad_state gamepad;
 };
 
 void init_input(struct input *input);
+void deinit_input(struct input *input);
+// Once a navigation event was handled, a no-op unless writes are queued
+void input_flush(struct input *input);
+const char *input_pipe_name(int input_type); // of display 0
+uint32_t qwerty_lookup_keysym(uint32_t keycode);
+uint32_t mouse_lookup_button(uint32_t keycode);
+int gamepad_lookup_axis(const char *name);
 void keyboard_handle_key(struct input* input, uint32_t key, uint32_t state);
+void keyboard_handle_text(struct input* input, const char *text);
 void touch_handle_down(struct input* input, int32_t id, double x_w, double y_w, double pressure);
 void touch_handle_up(struct input* input, int32_t id);
 void touch_handle_motion(struct input* input, int32_t id, double x_w, double y_w, double pressure);
@@ -32,4 +89,7 @@ void touch_handle_cancel(struct input* input);
 void pointer_handle_motion(struct input* input, double sx, double sy);
 void pointer_handle_button(struct input* input, uint32_t button, uint32_t state);
 void pointer_handle_axis(struct input* input, uint32_t axis, double value);
+void gamepad_handle_axis(struct input* input, uint32_t axis, int32_t value);
+void gamepad_handle_button(struct input* input, uint32_t button, uint32_t state);
+void gamepad_handle_frame(struct input* input);
 
@@ -0,0 +1,85 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdio.h>
+
+/*
+ * Process wide counters, gauges and histograms, exposed in the Prometheus
+ * text format. Counters and histograms are sharded per thread: the hot path
+ * only touches the calling thread's shard and never takes a lock, a scrape
+ * sums all shards. Gauges are plain atomics since they hold a value rather
+ * than accumulate one.
+ */
+
+enum metric_counter {
+    METRIC_FRAMES_RECEIVED,
+    METRIC_FRAMES_PUSHED,
+    METRIC_FRAMES_DROPPED_NOT_WANTED,
+    METRIC_FRAMES_DROPPED_INVALID_FD,
+    METRIC_FRAMES_DROPPED_NO_PIPELINE,
+    METRIC_FRAMES_DROPPED_UNKNOWN_DISPLAY,
+    METRIC_FRAMES_PREVIEWED,
+    METRIC_PUSH_FAILURES,
+    METRIC_WANT_DATA_ON,  // need-data after enough-data
+    METRIC_WANT_DATA_OFF, // enough-data after need-data
+    METRIC_PIPELINE_ERRORS,
+    METRIC_PIPELINE_WARNINGS,
+    METRIC_PIPELINE_RESTARTS, // watchdog recoveries, see watchdog.h
+    METRIC_PIPELINE_REBUILDS,
+    METRIC_PRODUCER_DISCONNECTS,
+    METRIC_PRODUCER_RECONNECTS,
+    METRIC_REPLAY_FRAMES_DROPPED, // encoded frames the replay ring left out
+    METRIC_SNAPSHOTS,
+    METRIC_INPUT_TEXT_DROPPED, // characters of injected text the keyboard FIFO had no room for
+    // One per input device, in INPUT_TOUCH.. order
+    METRIC_INPUT_EVENTS_TOUCH,
+    METRIC_INPUT_EVENTS_KEYBOARD,
+    METRIC_INPUT_EVENTS_POINTER,
+    METRIC_INPUT_EVENTS_GAMEPAD,
+    METRIC_INPUT_FAILED_TOUCH,
+    METRIC_INPUT_FAILED_KEYBOARD,
+    METRIC_INPUT_FAILED_POINTER,
+    METRIC_INPUT_FAILED_GAMEPAD,
+    METRIC_COUNTER_TOTAL
+};
+
+enum metric_gauge {
+    METRIC_WANT_DATA,
+    METRIC_PIPELINE_STATE, // GstState, 0 when there is no pipeline
+    METRIC_DMABUFS_IN_FLIGHT,
+    METRIC_RENDERING_PAUSED, // 1 while the producer was told to stop rendering
+    METRIC_VIEWERS,          // -1 when the sink cannot tell
+    METRIC_PIPELINE_STALLED, // 1 from stall detection until the encoder produces again
+    // Run queue wait per timeslice over the last report, in SCHED_STAGE_* order, see thread-sched.h
+    METRIC_SCHED_WAIT_DISPLAY,
+    METRIC_SCHED_WAIT_INPUT,
+    METRIC_SCHED_WAIT_STREAMING,
+    METRIC_SCHED_WAIT_ENCODER,
+    METRIC_SCHED_WORST_WAIT_DISPLAY, // of the stage's worst thread
+    METRIC_SCHED_WORST_WAIT_INPUT,
+    METRIC_SCHED_WORST_WAIT_STREAMING,
+    METRIC_SCHED_WORST_WAIT_ENCODER,
+    METRIC_GAUGE_TOTAL
+};
+
+enum metric_histogram {
+    METRIC_FRAME_INTERVAL,
+    METRIC_PUSH_DURATION,
+    METRIC_INPUT_WRITE_LATENCY,
+    METRIC_RECOVERY_DURATION,
+    METRIC_HISTOGRAM_TOTAL
+};
+
+void metrics_inc(enum metric_counter counter);
+void metrics_add(enum metric_counter counter, uint64_t value);
+void metrics_gauge_set(enum metric_gauge gauge, int64_t value);
+void metrics_gauge_add(enum metric_gauge gauge, int64_t delta);
+void metrics_observe_us(enum metric_histogram histogram, uint64_t value_us);
+
+void metrics_write(FILE *out);
+
+/* Serves metrics_write() on `endpoint`, either a Unix socket path or
+ * "tcp:<port>" for 127.0.0.1. HTTP GET requests get an HTTP response,
+ * anything else the bare text. */
+int metrics_start(const char *endpoint);
+void metrics_stop(void);
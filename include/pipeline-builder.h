@@ -0,0 +1,16 @@
+#pragma once
+
+/*
+ * Default pipeline when none is given with -l. Encoders known to the
+ * registry are tried in order of expected latency and throughput, hardware
+ * before software, each with its low-latency properties (only those the
+ * installed version has). The first one that encodes a few test frames at
+ * the session resolution is used. The test frames are linear dmabufs like a
+ * producer's (udmabuf, system memory without it), with plain caps when the
+ * converter refuses dmabuf caps, and results are kept per
+ * encoder, size and rate, so further displays of that size reuse them.
+ *
+ * `codec` limits the choice to h264, h265, vp8, vp9 or av1, NULL for any.
+ * Returns a pipeline string to free(), or NULL when nothing works.
+ */
+char *pipeline_build(const char *codec, int width, int height, int refresh_rate);
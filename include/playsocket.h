@@ -1,4 +1,5 @@
 #include <cstdint>
+#include <errno.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <vector>
@@ -8,8 +9,9 @@
 
 #include "socket-protocol.h"
 
-int create_socket(const char *path) {
-    int sock = socket(AF_UNIX, SOCK_STREAM, 0);
+// Bound and listening for the process lifetime, producers reconnect to it
+int listen_socket(const char *path) {
+    int sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
 
     struct sockaddr_un addr;
     memset(&addr, 0, sizeof(addr));
@@ -19,9 +21,19 @@ int create_socket(const char *path) {
     if (bind(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
         exit(-1);
     }
-    listen(sock, 1);
+    listen(sock, 4);
+
+    return sock;
+}
 
-    return accept(sock, NULL, NULL);
+int accept_socket(int listen_sock) {
+    int sock;
+
+    do {
+        sock = accept4(listen_sock, NULL, NULL, SOCK_CLOEXEC);
+    } while (sock < 0 && errno == EINTR);
+
+    return sock;
 }
 
 int connect_socket(const char *path) {
@@ -40,11 +52,9 @@ int send_message(int sock, int fd, MessageType type, MessageData *payload) {
     struct msghdr msg;
     memset(&msg, 0, sizeof(msg));
 
-    size_t payload_len = payload ? sizeof(MessageData) : 0;
-    if (payload && payload_len > sizeof(MessageData)) {
-        fprintf(stderr, "Payload length exceeds maximum size\n");
-        return -1;
-    }
+    size_t payload_len = 0;
+    if (payload)
+        payload_len = payload->display_id ? sizeof(MessageData) : MESSAGE_DATA_BASE_SIZE;
 
     // Construct message header
     MessageHeader header = {(uint32_t)type, (uint32_t)payload_len};
@@ -84,23 +94,22 @@ int send_message(int sock, int fd, MessageType type, MessageData *payload) {
     return 0;
 }
 
+/* Reads the header first and then exactly the payload it announces, so
+ * payloads of either size (see MESSAGE_DATA_BASE_SIZE) can follow each other
+ * on the stream. Whatever the payload leaves out reads as 0. */
 int recv_message(int sock, int *fd_out, MessageData *buffer, MessageType *out_type) {
     struct msghdr msg;
     struct iovec io;
     char control_buf[256] = {0};
+    MessageHeader header;
 
     size_t buffer_size = buffer ? sizeof(MessageData) : 0;
-    if (buffer && buffer_size > sizeof(MessageData)) {
-        fprintf(stderr, "Payload length exceeds maximum size\n");
-        return -1;
-    }
 
     memset(&msg, 0, sizeof(msg));
 
-    // Expecting header + payload
-    std::vector<char> recv_buf(sizeof(MessageHeader) + buffer_size);
-    io.iov_base = recv_buf.data();
-    io.iov_len = recv_buf.size();
+    // Any fd comes with the first byte of its message, that is the header
+    io.iov_base = &header;
+    io.iov_len = sizeof(header);
 
     msg.msg_iov = &io;
     msg.msg_iovlen = 1;
@@ -108,7 +117,7 @@ int recv_message(int sock, int *fd_out, MessageData *buffer, MessageType *out_ty
     msg.msg_control = control_buf;
     msg.msg_controllen = sizeof(control_buf);
 
-    ssize_t n = recvmsg(sock, &msg, 0);
+    ssize_t n = recvmsg(sock, &msg, MSG_WAITALL);
     if (n == 0) {
         *out_type = MSG_FAILED;
         return 0; // Connection closed
@@ -125,16 +134,27 @@ int recv_message(int sock, int *fd_out, MessageData *buffer, MessageType *out_ty
         return -1;
     }
 
-    MessageHeader header;
-    memcpy(&header, recv_buf.data(), sizeof(header));
-    if (header.length > buffer_size) {
+    if (header.length > sizeof(MessageData) || (header.length > 0 && !buffer)) {
         fprintf(stderr, "recvmsg received data larger than buffer size\n");
         *out_type = MSG_FAILED;
         return -1;
     }
 
-    if (header.length > 0 && buffer) {
-        memcpy(buffer, recv_buf.data() + sizeof(header), header.length);
+    if (buffer) {
+        memset(buffer, 0, buffer_size);
+        if (header.length > 0) {
+            ssize_t got;
+
+            do {
+                got = recv(sock, buffer, header.length, MSG_WAITALL);
+            } while (got < 0 && errno == EINTR);
+            if (got != (ssize_t)header.length) {
+                fprintf(stderr, "recv received less than the payload\n");
+                *out_type = MSG_FAILED;
+                return -1;
+            }
+            n += got;
+        }
     }
 
     if (header.type == MSG_TYPE_FD && fd_out) {
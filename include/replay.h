@@ -0,0 +1,44 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Instant replay of the encoded stream. Encoder output is copied into a
+ * fixed ring of memory-mapped segment files, next to an index of frame
+ * timestamps, offsets and keyframes. Nothing grows while it runs: the
+ * segment files are sized up front and the index has REPLAY_INDEX_SIZE slots,
+ * the oldest segment and entries are reused once the ring is full.
+ *
+ * The live branch only ever copies into the ring. When a dump holds the
+ * index for that moment, or a frame does not fit, the frame is left out and
+ * the ring picks up again at the next keyframe.
+ */
+
+#define REPLAY_SEGMENTS 8
+#define REPLAY_INDEX_SIZE 16384      // frames, several minutes at 60 fps
+#define REPLAY_DEFAULT_SIZE_MB 64
+
+enum {
+    REPLAY_FRAME_KEYFRAME = 1 << 0,
+    REPLAY_FRAME_HEADER = 1 << 1, // codec headers, also kept aside for every dump
+};
+
+/* `spec` is "<dir>[:<MB>]", the ring takes REPLAY_SEGMENTS files of
+ * MB / REPLAY_SEGMENTS each in dir, removed again by replay_stop(). */
+int replay_start(const char *spec);
+void replay_stop(void);
+bool replay_enabled(void);
+
+// From the encoder's streaming thread, never blocks
+void replay_set_caps(const char *caps);
+void replay_write(const void *data, size_t size, uint64_t pts_ns, uint64_t dts_ns, uint32_t flags);
+
+/* Remuxes the last `seconds` (from the keyframe before) into `path`, MP4 for
+ * .mp4/.mov and Matroska for .mkv/.webm, without re-encoding. Blocks the
+ * caller until the file is written, for up to half a minute, so it belongs
+ * on a thread of its own. Returns the number of frames or -1. */
+int replay_dump(unsigned int seconds, const char *path);
+
+// For shutting down: a running dump fails within a tenth of a second, later ones right away
+void replay_cancel(void);
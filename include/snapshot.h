@@ -0,0 +1,41 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+struct dmabuf_ref;
+
+/*
+ * Small still images of the session for dashboards, taken from the frames
+ * the producer sends rather than by decoding the stream. The display thread
+ * only hands a reference to the next frame over while an image is wanted.
+ * A worker maps it, box-filters it down to the configured width and encodes
+ * it to JPEG or WebP.
+ *
+ * Requests are rate limited: an image younger than SNAPSHOT_MIN_INTERVAL_MS
+ * is served as is. Linear 32 bit RGB formats only.
+ */
+
+#define SNAPSHOT_DEFAULT_WIDTH 320
+#define SNAPSHOT_MIN_INTERVAL_MS 1000
+#define SNAPSHOT_WAIT_MS 500 // for a frame when the cached image is stale
+
+/* `spec` is "<width>[:<seconds>][:jpeg|webp]", with seconds the image is
+ * also refreshed periodically rather than only on request. */
+int snapshot_start(const char *spec);
+void snapshot_stop(void);
+bool snapshot_enabled(void);
+
+// From the display thread for every received frame, cheap unless wanted
+void snapshot_offer(struct dmabuf_ref *frame, int width, int height, uint32_t format, uint64_t modifier,
+                    uint32_t offset, int stride);
+
+/* Wants the next frame when the latest image is older than the rate limit.
+ * True while a frame is wanted, which counts as demand for the producer. */
+bool snapshot_request(void);
+bool snapshot_wanted(void);
+
+/* The latest image, refreshed first when it is older than the rate limit.
+ * Returns its size and a copy to free() in *data, or -1 when there is none. */
+ssize_t snapshot_get(uint8_t **data, const char **mime);
@@ -1,5 +1,6 @@
 #pragma once
 
+#include <cstddef>
 #include <cstdint>
 #include <stdlib.h>
 #include <unistd.h>
@@ -21,7 +22,14 @@ enum DataType {
     MSG_HELLO,
     MSG_ASK_FOR_RESOLUTION,
     MSG_HAVE_RESOLUTION,
-    MSG_HAVE_BUFFER
+    MSG_HAVE_BUFFER,
+    MSG_ASK_FOR_FORMATS, // replied with MSG_HAVE_FORMAT messages
+    MSG_HAVE_FORMAT,     // one format/modifier pair, format 0 ends the list
+    // Demand-driven rendering. A producer that sends MSG_CAN_PAUSE_RENDERING
+    // may receive the other two at any time, unprompted.
+    MSG_CAN_PAUSE_RENDERING,
+    MSG_PAUSE_RENDERING,  // no frame would reach a viewer, stop rendering
+    MSG_RESUME_RENDERING  // render again at refresh_rate, as in MSG_HAVE_RESOLUTION
 };
 
 struct MessageData {
@@ -34,4 +42,14 @@ struct MessageData {
     uint64_t modifiers;
     int32_t stride;
     int32_t offset;
+
+    // Which of the producer's displays a request, reply or frame is about,
+    // 0 for the primary one. Replies echo it.
+    uint32_t display_id;
 };
+
+/* Messages for display 0 leave display_id off the wire and keep the 40 byte
+ * payload from before it, so peers built against the old header still work
+ * with a single display. A payload of this size reads as display 0. */
+#define MESSAGE_DATA_BASE_SIZE offsetof(MessageData, display_id)
+static_assert(MESSAGE_DATA_BASE_SIZE == 40, "the base payload is part of the wire format");
@@ -0,0 +1,27 @@
+#pragma once
+
+/*
+ * CPU affinity and scheduling policy per pipeline stage. A stage is
+ * configured with `-S <stage>:<setting>[:<setting>...]`, settings being
+ * cpus=<list> (like 2-3,6), fifo=<prio>, rr=<prio> or nice=<n>, e.g.
+ *   -S display:cpus=2:fifo=50 -S encoder:cpus=3-5:rr=40
+ * Threads join a stage by calling sched_apply() themselves, streaming and
+ * encoder threads never move to the input stage. Their wait time
+ * in the run queue is read from /proc/self/task/<tid>/schedstat, logged
+ * and exported as metrics per stage.
+ */
+
+enum sched_stage {
+    SCHED_STAGE_DISPLAY,   // producer socket and preview
+    SCHED_STAGE_INPUT,     // threads delivering navigation events
+    SCHED_STAGE_STREAMING, // GStreamer streaming threads
+    SCHED_STAGE_ENCODER,   // the streaming thread running the encoder
+    SCHED_STAGE_TOTAL
+};
+
+int sched_parse(const char *spec);
+bool sched_configured(enum sched_stage stage);
+void sched_apply(enum sched_stage stage);
+
+int sched_start(void);
+void sched_stop(void);
@@ -0,0 +1,34 @@
+#pragma once
+
+#include <atomic>
+#include <stdint.h>
+
+/*
+ * Opt-in timeline of the frame lifecycle. Spans go into a ring buffer owned
+ * by the recording thread and are dumped as Chrome trace JSON (loadable in
+ * chrome://tracing and ui.perfetto.dev) on SIGUSR1, on trace_dump() and at
+ * exit. While tracing is off every call is a single relaxed load.
+ */
+
+#define TRACE_RING_SIZE 16384 // spans kept per thread, power of two
+
+extern std::atomic<bool> trace_enabled;
+
+uint64_t trace_now_ns(void);
+void trace_record(const char *name, uint64_t start_ns, uint64_t end_ns, uint64_t id);
+
+// Returns the start time to pass to trace_end(), 0 while tracing is off
+static inline uint64_t trace_begin(void) {
+    return trace_enabled.load(std::memory_order_relaxed) ? trace_now_ns() : 0;
+}
+
+// `name` must be a string literal or otherwise outlive the trace
+static inline void trace_end(const char *name, uint64_t start_ns, uint64_t id) {
+    if (start_ns)
+        trace_record(name, start_ns, trace_now_ns(), id);
+}
+
+/* Starts recording. Dumps go to `path`; SIGUSR1 triggers one at any time. */
+int trace_start(const char *path);
+int trace_dump(const char *path);
+void trace_stop(void);
@@ -0,0 +1,63 @@
+#pragma once
+
+#include <poll.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include <socket-protocol.h>
+
+/*
+ * io_uring backend for the two per-event syscall paths, selected with
+ * --io=uring on builds with liburing (HAVE_LIBURING). Without it, or on
+ * kernels that lack multishot receives, the poll() and write() paths are used.
+ *
+ * The display thread keeps one multishot recvmsg posted on the producer
+ * socket. The kernel fills buffers from a provided ring without a syscall
+ * per message, and a single io_uring_enter() reaps everything that arrived.
+ * The other fds the display thread waits on (listening socket, wake fd,
+ * compositor) become one-shot polls on the same ring, and the poll timeout
+ * becomes the wait timeout, so the thread still blocks in one place.
+ *
+ * Input handlers queue their FIFO writes and submit them together when the
+ * navigation event is done, e.g. both axes of a scroll or a typed string.
+ */
+
+#define URING_ENTRIES 32
+#define URING_POLL_SLOTS 4
+#define URING_RECV_BUFFERS 64
+#define URING_RECV_BUFFER_SIZE 4096
+#define URING_RECV_MAX_FDS 4 // per receive, more are closed
+#define URING_WRITE_SLOTS 16
+#define URING_WRITE_SLOT_SIZE 4096 // PIPE_BUF, writes up to it are atomic
+
+// NULL when io_uring is not built in or not usable
+struct uring_recv *uring_recv_new(void);
+void uring_recv_free(struct uring_recv *recv);
+
+/* Replaces poll(). fds[i].fd == recv_sock is reported readable once a
+ * message (or the end of the connection) was received on it. Fails with
+ * EOPNOTSUPP when the kernel cannot receive this way, nothing was taken off
+ * the socket then and poll() can take over. */
+int uring_recv_poll(struct uring_recv *recv, struct pollfd *fds, nfds_t nfds, int recv_sock, int timeout_ms);
+// A message or the end of the connection is waiting for uring_recv_message()
+bool uring_recv_pending(struct uring_recv *recv);
+// Same results as recv_message(), only call while uring_recv_pending()
+int uring_recv_message(struct uring_recv *recv, int *fd_out, MessageData *buffer, MessageType *out_type);
+/* Stops receiving, before the socket is handed to another process. A
+ * message received in part is completed from the socket, so what is left
+ * there starts at a message boundary. Received messages stay pending. */
+int uring_recv_detach(struct uring_recv *recv);
+
+// NULL when io_uring is not built in or not usable
+struct uring_writer *uring_writer_new(void);
+void uring_writer_free(struct uring_writer *writer);
+/* Copies a write for the next flush. Returns -1 when it is larger than a
+ * slot, all slots are taken or the fd refused RWF_NOWAIT before: flush and
+ * retry, or write() it directly. */
+int uring_writer_queue(struct uring_writer *writer, int fd, const void *data, size_t len, uint64_t tag);
+/* Submits the queued writes in order with one syscall and reports each,
+ * res being the write() result or -errno. Writes never wait for room, a
+ * full pipe fails them with -EAGAIN. */
+typedef void (*uring_write_done)(void *data, uint64_t tag, const void *buf, size_t len, ssize_t res);
+int uring_writer_flush(struct uring_writer *writer, uring_write_done done, void *data);
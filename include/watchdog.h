@@ -0,0 +1,22 @@
+#pragma once
+
+struct gsthelper;
+
+/*
+ * Recovers a wedged pipeline without touching the producer connection. The
+ * display thread checks gst_pipeline_stalled() between messages. The first
+ * stall restarts the pipeline in place (READY and back to PLAYING); if it is
+ * still stalled within WATCHDOG_ESCALATE_STALLS stall periods, the pipeline
+ * is rebuilt from its description. Either way the encoder is asked for a
+ * keyframe, and the time until the encoder produces output again is recorded
+ * as the recovery time.
+ */
+
+#define WATCHDOG_ESCALATE_STALLS 3
+#define WATCHDOG_CHECKS_PER_STALL 4
+
+int watchdog_start(int stall_ms);
+void watchdog_stop(void);
+// Poll timeout for the display thread, -1 while the watchdog is off
+int watchdog_timeout_ms(void);
+void watchdog_check(struct gsthelper *gsthelper);
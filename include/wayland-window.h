@@ -1,5 +1,40 @@
 #pragma once
 
+#include <stdint.h>
+#include <time.h>
+#include <sys/types.h>
+
+#define WINDOW_BUFFER_CACHE_SIZE 8
+#define WINDOW_FORMAT_TABLE_SIZE 128 // power of two, open addressing
+
+// Modifiers the compositor can import for one DRM format
+struct window_format {
+    uint32_t format; // 0 marks an empty slot
+    int modifiers_count;
+    int modifiers_capacity;
+    uint64_t *modifiers;
+};
+
+// One wl_buffer per producer dmabuf, reused for every frame of that dmabuf
+struct window_buffer {
+    struct window_state *app_state;
+    struct wl_buffer *buffer;
+
+    // Identity of the imported dmabuf and the layout it was imported with
+    dev_t dev;
+    ino_t ino;
+    int width;
+    int height;
+    uint32_t format;
+    uint32_t stride;
+    uint32_t offset;
+    uint64_t modifier;
+
+    bool busy;   // attached, not yet released by the compositor
+    bool queued; // waiting in the mailbox for the next frame callback
+    uint64_t last_used;
+};
+
 // Struct to hold the application's window_state
 struct window_state {
     struct wl_display *display;
@@ -10,15 +45,39 @@ struct window_state {
     struct xdg_surface *xdg_surface;
     struct xdg_toplevel *xdg_toplevel;
     struct zwp_linux_dmabuf_v1 *linux_dmabuf;
-    struct wl_buffer *buffer;
+    struct window_buffer buffers[WINDOW_BUFFER_CACHE_SIZE];
+    struct window_buffer *current;
+    uint64_t frame_count;
+    uint64_t import_count;
+
+    // Frames are committed on frame callbacks, the newest one waits in pending
+    struct wl_callback *frame_callback;
+    struct window_buffer *pending;
+    uint64_t committed_count;
+    uint64_t dropped_count;
+    uint64_t last_report_ms;
+
+    // Optional wp_presentation feedback for the real display latency
+    struct wp_presentation *presentation;
+    clockid_t presentation_clock;
+    uint64_t presented_count;
+    uint64_t discarded_count;
+    uint64_t presentation_latency_ns_total;
+    uint64_t presentation_latency_ns_max;
+
     int width;
     int height;
     int running;
-    uint32_t *formats;
+    struct window_format formats[WINDOW_FORMAT_TABLE_SIZE];
     int formats_count;
+    bool warned_format;
 };
 
 struct window_state *setup_wayland_window();
 void setup_window(struct window_state *app_state);
 int draw_window(struct window_state *app_state, struct MessageData *message, int dmabuf_fd);
+struct window_format *window_find_format(struct window_state *app_state, uint32_t format);
+bool window_supports(struct window_state *app_state, uint32_t format, uint64_t modifier);
+int window_get_fd(struct window_state *app_state);
+void window_dispatch(struct window_state *app_state);
 int destroy_window(struct window_state *app_state);
@@ -0,0 +1,438 @@
+#include <atomic>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <thread>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include <control.h>
+#include <display.h>
+#include <gsthelper.h>
+#include <input.h>
+#include <metrics.h>
+#include <replay.h>
+#include <snapshot.h>
+
+#define CONTROL_MAX_CLIENTS 8
+#define CONTROL_LINE_MAX 512
+
+struct control_client {
+    int fd;
+    size_t used;
+    char line[CONTROL_LINE_MAX];
+};
+
+struct control {
+    const char *path;
+    int listen_fd;
+    int wake_fds[2];
+    std::thread thread;
+
+    struct display *display;
+    struct gsthelper *gsthelper;
+    struct control_client clients[CONTROL_MAX_CLIENTS];
+
+    // One replay dump at a time, answered from its own thread when done
+    std::thread dump;
+    std::atomic<bool> dumping;
+};
+
+static struct control *control;
+
+static void reply_bytes(int fd, const void *data, size_t len) {
+    const char *bytes = (const char *)data;
+
+    while (len > 0) {
+        ssize_t res = send(fd, bytes, len, MSG_NOSIGNAL);
+        if (res < 0) {
+            if (errno == EINTR)
+                continue;
+            return;
+        }
+        bytes += res;
+        len -= res;
+    }
+}
+
+static void reply(int fd, const char *text) {
+    reply_bytes(fd, text, strlen(text));
+}
+
+// "snapshot <mime> <size>", the image itself and then "ok"
+static void reply_snapshot(int fd) {
+    const char *mime;
+    uint8_t *image;
+    ssize_t size;
+    char text[128];
+
+    if (!snapshot_enabled()) {
+        reply(fd, "error snapshots are not enabled\n");
+        return;
+    }
+    // A paused producer is resumed for the frame, see update_demand()
+    if (snapshot_request())
+        display_wake(control->display);
+    size = snapshot_get(&image, &mime);
+    if (size < 0) {
+        reply(fd, "error no frame to take a snapshot of\n");
+        return;
+    }
+
+    snprintf(text, sizeof(text), "snapshot %s %zd\n", mime, size);
+    reply(fd, text);
+    reply_bytes(fd, image, size);
+    reply(fd, "ok\n");
+    free(image);
+}
+
+static void reply_result(int fd, int res, const char *what) {
+    char text[128];
+
+    if (res == 0)
+        snprintf(text, sizeof(text), "ok\n");
+    else
+        snprintf(text, sizeof(text), "error %s\n", what);
+    reply(fd, text);
+}
+
+// Typed through the keyboard FIFO like a sink's text-input event
+static void reply_text(int fd, char *text) {
+    size_t len = strlen(text);
+
+    if (len > 0 && text[len - 1] == '\r')
+        text[len - 1] = '\0';
+    if (!*text) {
+        reply(fd, "error usage: text <utf-8>\n");
+        return;
+    }
+    reply_result(fd, gst_pipeline_send_input(control->gsthelper, gst_structure_new("playdroid-input",
+                 "event", G_TYPE_STRING, "text-input", "text", G_TYPE_STRING, text, NULL)), "no pipeline");
+}
+
+/* "gamepad x=-1200 ry=300 buttons=0x3", axis names from gamepad_lookup_axis()
+ * and a bitmask of pressed buttons, one frame like a sink's gamepad event */
+static void reply_gamepad(int fd, char *arg, char **save) {
+    GstStructure *structure = gst_structure_new("playdroid-input", "event", G_TYPE_STRING, "gamepad", NULL);
+
+    for (; arg; arg = strtok_r(NULL, " \t\r", save)) {
+        char *value = strchr(arg, '=');
+        char *end = NULL;
+        long number = 0;
+
+        if (value) {
+            *value++ = '\0';
+            errno = 0;
+            number = strtol(value, &end, 0);
+        }
+        if (!value || errno || end == value || *end != '\0' ||
+            (strcmp(arg, "buttons") != 0 && gamepad_lookup_axis(arg) < 0)) {
+            gst_structure_free(structure);
+            reply(fd, "error usage: gamepad [<axis>=<value>...] [buttons=<mask>]\n");
+            return;
+        }
+        if (strcmp(arg, "buttons") == 0)
+            gst_structure_set(structure, arg, G_TYPE_UINT, (guint)number, NULL);
+        else
+            gst_structure_set(structure, arg, G_TYPE_INT, (gint)number, NULL);
+    }
+    reply_result(fd, gst_pipeline_send_input(control->gsthelper, structure), "no pipeline");
+}
+
+static void reply_stats(int fd) {
+    char *text = NULL;
+    size_t len = 0;
+    FILE *out;
+
+    out = open_memstream(&text, &len);
+    if (!out) {
+        reply(fd, "error out of memory\n");
+        return;
+    }
+    fprintf(out, "width %d\nheight %d\nrefresh_rate %d\npreview %d\n",
+            control->display->width, control->display->height,
+            control->display->refresh_rate, control->display->open_wayland_window);
+    metrics_write(out);
+    fprintf(out, "ok\n");
+    fclose(out);
+
+    reply(fd, text);
+    free(text);
+}
+
+static void run_dump(int fd, unsigned int seconds, char *path) {
+    reply_result(fd, replay_dump(seconds, path) < 0 ? -1 : 0, "replay dump failed");
+    close(fd);
+    free(path);
+    control->dumping = false;
+}
+
+/* Writing the file takes up to half a minute, the other clients
+ * keep being served meanwhile. The dump answers on its own copy of the fd,
+ * the client may be gone by then. */
+static void start_dump(int fd, unsigned int seconds, const char *path) {
+    char *copy;
+    int dump_fd;
+
+    if (control->dumping) {
+        reply(fd, "error a replay dump is already running\n");
+        return;
+    }
+    if (control->dump.joinable())
+        control->dump.join();
+
+    copy = strdup(path);
+    dump_fd = fcntl(fd, F_DUPFD_CLOEXEC, 0);
+    if (!copy || dump_fd < 0) {
+        free(copy);
+        if (dump_fd >= 0)
+            close(dump_fd);
+        reply(fd, "error replay dump failed\n");
+        return;
+    }
+    control->dumping = true;
+    control->dump = std::thread(run_dump, dump_fd, seconds, copy);
+}
+
+static bool parse_uint(const char *arg, unsigned int *value) {
+    char *end;
+
+    if (!arg)
+        return false;
+    errno = 0;
+    *value = strtoul(arg, &end, 10);
+    return errno == 0 && end != arg && *end == '\0' && *value > 0;
+}
+
+static void handle_command(int fd, char *line) {
+    struct gsthelper *gsthelper = control->gsthelper;
+    struct display *display = control->display;
+    char *save = NULL;
+    char *command, *arg;
+    unsigned int value;
+
+    // The text is the rest of the line, spaces included
+    if (strncmp(line, "text ", 5) == 0) {
+        reply_text(fd, line + 5);
+        return;
+    }
+
+    command = strtok_r(line, " \t\r", &save);
+    arg = strtok_r(NULL, " \t\r", &save);
+    if (!command)
+        return;
+
+    if (strcmp(command, "text") == 0) {
+        reply(fd, "error usage: text <utf-8>\n");
+    } else if (strcmp(command, "bitrate") == 0) {
+        if (!parse_uint(arg, &value)) {
+            reply(fd, "error usage: bitrate <kbps>\n");
+            return;
+        }
+        reply_result(fd, gst_pipeline_set_bitrate(gsthelper, value), "encoder has no bitrate property");
+    } else if (strcmp(command, "gop") == 0) {
+        if (!parse_uint(arg, &value)) {
+            reply(fd, "error usage: gop <frames>\n");
+            return;
+        }
+        reply_result(fd, gst_pipeline_set_gop(gsthelper, value), "encoder has no keyframe interval property");
+    } else if (strcmp(command, "fps") == 0) {
+        if (!parse_uint(arg, &value) || value > 1000) {
+            reply(fd, "error usage: fps <1-1000>\n");
+            return;
+        }
+        // The display thread owns the frame timing, it applies the change
+        display->requested_refresh_rate = value;
+        display_wake(display);
+        reply(fd, "ok\n");
+    } else if (strcmp(command, "keyframe") == 0) {
+        reply_result(fd, gst_pipeline_force_keyframe(gsthelper), "no encoder found");
+    } else if (strcmp(command, "pause") == 0 || strcmp(command, "resume") == 0) {
+        reply_result(fd, gst_pipeline_set_paused(gsthelper, command[0] == 'p'), "state change failed");
+    } else if (strcmp(command, "preview") == 0) {
+        if (!arg || (strcmp(arg, "on") != 0 && strcmp(arg, "off") != 0)) {
+            reply(fd, "error usage: preview on|off\n");
+            return;
+        }
+        display->requested_preview = strcmp(arg, "on") == 0 ? PREVIEW_REQUEST_ON : PREVIEW_REQUEST_OFF;
+        display_wake(display);
+        reply(fd, "ok\n");
+    } else if (strcmp(command, "replay") == 0) {
+        char *path = strtok_r(NULL, " \t\r", &save);
+
+        if (!parse_uint(arg, &value) || !path) {
+            reply(fd, "error usage: replay <seconds> <file.mp4|file.mkv>\n");
+            return;
+        }
+        if (!replay_enabled()) {
+            reply(fd, "error replay is not enabled\n");
+            return;
+        }
+        start_dump(fd, value, path);
+    } else if (strcmp(command, "gamepad") == 0) {
+        reply_gamepad(fd, arg, &save);
+    } else if (strcmp(command, "snapshot") == 0) {
+        reply_snapshot(fd);
+    } else if (strcmp(command, "stats") == 0) {
+        reply_stats(fd);
+    } else {
+        reply(fd, "error unknown command\n");
+    }
+}
+
+// Returns false when the client is gone
+static bool read_client(struct control_client *client) {
+    ssize_t res = recv(client->fd, client->line + client->used, sizeof(client->line) - 1 - client->used, 0);
+    char *start, *end;
+
+    if (res <= 0)
+        return res < 0 && (errno == EINTR || errno == EAGAIN);
+    client->used += res;
+    client->line[client->used] = '\0';
+
+    start = client->line;
+    while ((end = strchr(start, '\n'))) {
+        *end = '\0';
+        handle_command(client->fd, start);
+        start = end + 1;
+    }
+    client->used -= start - client->line;
+    memmove(client->line, start, client->used);
+
+    if (client->used == sizeof(client->line) - 1) {
+        reply(client->fd, "error line too long\n");
+        return false;
+    }
+    return true;
+}
+
+static void run_control(struct control *control) {
+    struct pollfd fds[2 + CONTROL_MAX_CLIENTS];
+
+    while (true) {
+        nfds_t nfds = 2;
+
+        fds[0].fd = control->listen_fd;
+        fds[0].events = POLLIN;
+        fds[1].fd = control->wake_fds[0];
+        fds[1].events = POLLIN;
+        for (int i = 0; i < CONTROL_MAX_CLIENTS; i++) {
+            fds[nfds].fd = control->clients[i].fd;
+            fds[nfds].events = POLLIN;
+            fds[nfds].revents = 0;
+            nfds++;
+        }
+
+        if (poll(fds, nfds, -1) < 0) {
+            if (errno == EINTR)
+                continue;
+            fprintf(stderr, "Control poll failed: %s\n", strerror(errno));
+            return;
+        }
+        if (fds[1].revents)
+            return;
+
+        for (int i = 0; i < CONTROL_MAX_CLIENTS; i++) {
+            struct control_client *client = &control->clients[i];
+
+            if (client->fd < 0 || !fds[2 + i].revents)
+                continue;
+            if (!read_client(client)) {
+                close(client->fd);
+                client->fd = -1;
+            }
+        }
+
+        if (fds[0].revents) {
+            int fd = accept4(control->listen_fd, NULL, NULL, SOCK_CLOEXEC);
+            int slot = -1;
+
+            if (fd < 0)
+                continue;
+            for (int i = 0; i < CONTROL_MAX_CLIENTS && slot < 0; i++)
+                if (control->clients[i].fd < 0)
+                    slot = i;
+            if (slot < 0) {
+                reply(fd, "error too many clients\n");
+                close(fd);
+                continue;
+            }
+            control->clients[slot].fd = fd;
+            control->clients[slot].used = 0;
+        }
+    }
+}
+
+int control_start(const char *path, struct display *display, struct gsthelper *gsthelper) {
+    struct sockaddr_un addr;
+    int fd;
+
+    if (control)
+        return 0;
+
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "Control socket path too long: %s\n", path);
+        return -1;
+    }
+
+    fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0)
+        return -1;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+    unlink(path);
+
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(fd, 4) < 0) {
+        fprintf(stderr, "Failed to create control socket %s: %s\n", path, strerror(errno));
+        close(fd);
+        return -1;
+    }
+
+    control = new struct control();
+    control->path = path;
+    control->listen_fd = fd;
+    control->display = display;
+    control->gsthelper = gsthelper;
+    for (int i = 0; i < CONTROL_MAX_CLIENTS; i++)
+        control->clients[i].fd = -1;
+    if (pipe2(control->wake_fds, O_CLOEXEC) < 0) {
+        close(fd);
+        delete control;
+        control = NULL;
+        return -1;
+    }
+    control->thread = std::thread(run_control, control);
+
+    fprintf(stderr, "Control socket on %s\n", path);
+    return 0;
+}
+
+void control_stop(void) {
+    if (!control)
+        return;
+
+    if (write(control->wake_fds[1], "q", 1) == 1)
+        control->thread.join();
+    else
+        control->thread.detach();
+    // The dump's client gets its error, then the ring can go
+    replay_cancel();
+    if (control->dump.joinable())
+        control->dump.join();
+
+    for (int i = 0; i < CONTROL_MAX_CLIENTS; i++)
+        if (control->clients[i].fd >= 0)
+            close(control->clients[i].fd);
+    close(control->wake_fds[0]);
+    close(control->wake_fds[1]);
+    close(control->listen_fd);
+    unlink(control->path);
+    delete control;
+    control = NULL;
+}
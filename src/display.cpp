@@ -1,34 +1,177 @@
 #include <cstring>
 #include <cstdio>
 #include <cstdlib>
+#include <errno.h>
+#include <poll.h>
+#include <time.h>
 #include <unistd.h>
+#include <sys/eventfd.h>
+
+#include <drm_fourcc.h>
 
 #include <display.h>
+#include <dmabuf-ref.h>
+#include <handoff.h>
+#include <input.h>
+#include <metrics.h>
+#include <snapshot.h>
+#include <trace.h>
+#include <uring.h>
+#include <watchdog.h>
 #include <playsocket.h>
 #include <wayland-window.h>
 #include <gsthelper.h>
 
+#define DEMAND_CHECK_MS 250
+
+/* Lets producers allocate buffers the preview can import as is, possibly
+ * tiled. Without a preview window the list is empty, meaning no constraint. */
+static void send_formats(struct display *display, int sock, uint32_t display_id) {
+    struct window_state *wayland_state = display->wayland_state;
+    struct MessageData reply;
+
+    memset(&reply, 0, sizeof(reply));
+    reply.type = MSG_HAVE_FORMAT;
+    reply.display_id = display_id;
+
+    for (int i = 0; wayland_state && i < WINDOW_FORMAT_TABLE_SIZE; i++) {
+        struct window_format *entry = &wayland_state->formats[i];
+
+        if (entry->format == 0)
+            continue;
+
+        reply.format = entry->format;
+        if (entry->modifiers_count == 0) {
+            reply.modifiers = DRM_FORMAT_MOD_INVALID;
+            send_message(sock, -1, MSG_TYPE_DATA_REPLY, &reply);
+        }
+        for (int j = 0; j < entry->modifiers_count; j++) {
+            reply.modifiers = entry->modifiers[j];
+            send_message(sock, -1, MSG_TYPE_DATA_REPLY, &reply);
+        }
+    }
+
+    reply.format = 0;
+    reply.modifiers = 0;
+    send_message(sock, -1, MSG_TYPE_DATA_REPLY, &reply);
+}
+
+static uint64_t monotonic_ms(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static void send_demand(struct display *display, bool render) {
+    struct MessageData message;
+
+    memset(&message, 0, sizeof(message));
+    message.type = render ? MSG_RESUME_RENDERING : MSG_PAUSE_RENDERING;
+    message.refresh_rate = display->refresh_rate * 1000;
+    send_message(display->producer_sock, -1, MSG_TYPE_DATA, &message);
+
+    display->rendering_paused = !render;
+    metrics_gauge_set(METRIC_RENDERING_PAUSED, !render);
+}
+
+/*
+ * Frames are only worth rendering while the preview shows them, a snapshot
+ * waits for one or the pipeline has someone to send them to. Re-checked
+ * every DEMAND_CHECK_MS rather than on each signal, so a viewer flapping or
+ * appsrc briefly full does not turn into a pause/resume per frame.
+ */
+static void update_demand(struct display *display, struct gsthelper *gsthelper) {
+    uint64_t now = monotonic_ms();
+    bool wanted;
+
+    if (display->producer_sock < 0 || !display->producer_can_pause)
+        return;
+    // A snapshot waiting on a paused producer does not wait for the next check
+    if (now < display->demand_checked_ms + DEMAND_CHECK_MS && !(display->rendering_paused && snapshot_wanted()))
+        return;
+    display->demand_checked_ms = now;
+
+    metrics_gauge_set(METRIC_VIEWERS, gst_pipeline_viewers(gsthelper));
+    wanted = display->open_wayland_window || snapshot_wanted() || gst_pipeline_wants_frames(gsthelper);
+    if (wanted != display->rendering_paused)
+        return;
+
+    fprintf(stderr, "%s producer rendering\n", wanted ? "Resuming" : "Pausing");
+    send_demand(display, wanted);
+    // Viewers that joined meanwhile get a picture right away
+    if (wanted)
+        gst_pipeline_force_keyframe(gsthelper);
+}
+
+static void observe_frame_interval(void) {
+    static uint64_t last_us;
+    struct timespec ts;
+    uint64_t now_us;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    now_us = (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+    if (last_us)
+        metrics_observe_us(METRIC_FRAME_INTERVAL, now_us - last_us);
+    last_us = now_us;
+}
+
+static struct display_output *find_output(struct display *display, uint32_t id) {
+    for (int i = 0; i < display->output_count; i++) {
+        if (display->outputs[i].id == id)
+            return &display->outputs[i];
+    }
+    return NULL;
+}
+
+// Unknown displays get 0x0, the producer should not create them
+static void send_resolution(struct display *display, int sock, uint32_t display_id) {
+    struct display_output *output = NULL;
+    struct MessageData reply;
+
+    memset(&reply, 0, sizeof(reply));
+    reply.type = MSG_HAVE_RESOLUTION;
+    reply.display_id = display_id;
+    if (display_id == 0) {
+        reply.width = display->width;
+        reply.height = display->height;
+        reply.refresh_rate = display->refresh_rate * 1000; // Convert to ms
+    } else if ((output = find_output(display, display_id))) {
+        reply.width = output->width;
+        reply.height = output->height;
+        reply.refresh_rate = output->refresh_rate * 1000;
+    } else {
+        fprintf(stderr, "Producer asked for unknown display %u\n", display_id);
+    }
+    send_message(sock, -1, MSG_TYPE_DATA_REPLY, &reply);
+}
 
 void handle_message(struct display *display, int sock, MessageType type, MessageData *message, int dmabuf_fd, struct gsthelper *gsthelper) {
+    static uint64_t frame_count;
+    struct dmabuf_ref *frame = NULL;
+    uint64_t trace_start_ns = trace_begin();
+
     switch (type) {
         case MSG_TYPE_DATA:
+            // Session-wide, a hello or pause support per display adds nothing
+            if (message->display_id != 0)
+                break;
             if (message->type == MSG_HELLO) {
                 printf("Got hello message\n");
                 if (display->open_wayland_window) {
                     setup_window(display->wayland_state);
                 }
+            } else if (message->type == MSG_CAN_PAUSE_RENDERING) {
+                display->producer_can_pause = true;
             }
             break;
         case MSG_TYPE_DATA_NEEDS_REPLY:
             if (message->type == MSG_ASK_FOR_RESOLUTION) {
                 printf("Got ask for resolution message\n");
-                // Respond with resolution
-                struct MessageData reply;
-                reply.type = MSG_HAVE_RESOLUTION;
-                reply.width = display->width;
-                reply.height = display->height;
-                reply.refresh_rate = display->refresh_rate * 1000; // Convert to ms
-                send_message(sock, -1, MSG_TYPE_DATA_REPLY, &reply);
+                send_resolution(display, sock, message->display_id);
+            } else if (message->type == MSG_ASK_FOR_FORMATS) {
+                printf("Got ask for formats message\n");
+                send_formats(display, sock, message->display_id);
             }
             break;
         case MSG_TYPE_FD:
@@ -40,21 +183,57 @@ void handle_message(struct display *display, int sock, MessageType type, Message
 
             if (dmabuf_fd < 0) {
                 fprintf(stderr, "Invalid dmabuf_fd: %d\n", dmabuf_fd);
+                metrics_inc(METRIC_FRAMES_DROPPED_INVALID_FD);
                 break;
             }
+            metrics_inc(METRIC_FRAMES_RECEIVED);
+
+            // Secondary displays only stream
+            if (message->display_id != 0) {
+                struct display_output *output = find_output(display, message->display_id);
+
+                if (!output) {
+                    close(dmabuf_fd);
+                    metrics_inc(METRIC_FRAMES_DROPPED_UNKNOWN_DISPLAY);
+                    break;
+                }
+                frame = dmabuf_ref_new(dmabuf_fd);
+                frame->id = ++frame_count;
+                gst_output_frame(output->gsthelper, dmabuf_ref_get(frame), output->width, output->height,
+                                 output->refresh_rate, message->format, message->modifiers, message->offset,
+                                 message->stride);
+                trace_end("handle_message", trace_start_ns, frame->id);
+                dmabuf_ref_put(frame);
+                return;
+            }
+            observe_frame_interval();
 
+            frame = dmabuf_ref_new(dmabuf_fd);
+            frame->id = ++frame_count;
+            snapshot_offer(frame, display->width, display->height, message->format, message->modifiers,
+                           message->offset, message->stride);
+
+            // Each path holds its own reference, the fd closes after both are done
+            if (!display->open_wayland_window || display->stream_with_preview) {
+                gst_output_frame(gsthelper, dmabuf_ref_get(frame), display->width, display->height, display->refresh_rate,
+                                 message->format, message->modifiers, message->offset, message->stride);
+            }
             if (display->open_wayland_window) {
-                draw_window(display->wayland_state, message, dmabuf_fd);
-                close(dmabuf_fd); 
-            } else {
-                gst_output_frame(gsthelper, dmabuf_fd, display->width, display->height, display->refresh_rate, message->offset, message->stride);
+                uint64_t draw_start_ns = trace_begin();
+                draw_window(display->wayland_state, message, frame->fd);
+                trace_end("draw_window", draw_start_ns, frame->id);
+                metrics_inc(METRIC_FRAMES_PREVIEWED);
             }
 
-            break;
+            trace_end("handle_message", trace_start_ns, frame->id);
+            dmabuf_ref_put(frame);
+            return;
         default:
             printf("Unknown message type\n");
             break;
     }
+
+    trace_end("handle_message", trace_start_ns, 0);
 }
 
 void init_display(struct display *display) {
@@ -63,29 +242,279 @@ void init_display(struct display *display) {
     display->height = DISPLAY_HEIGHT;
     display->refresh_rate = DISPLAY_REFRESH_RATE;
     display->open_wayland_window = false;
+    display->stream_with_preview = false;
     display->wayland_state = nullptr;
+    display->wake_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    display->requested_refresh_rate = 0;
+    display->requested_preview = PREVIEW_REQUEST_NONE;
+    display->requested_handoff = -1;
+    display->listen_sock = -1;
+    display->producer_sock = -1;
+    display->producer_connections = 0;
+    display->producer_can_pause = false;
+    display->rendering_paused = false;
+    display->demand_checked_ms = 0;
+    display->output_count = 0;
+    display->io_uring = false;
+    display->uring = NULL;
+}
+
+int display_add_output(struct display *display, char *spec) {
+    struct display_output *output;
+    char *end;
+    unsigned long id;
+
+    if (display->output_count >= DISPLAY_MAX_OUTPUTS) {
+        fprintf(stderr, "At most %d secondary displays\n", DISPLAY_MAX_OUTPUTS);
+        return -1;
+    }
+    output = &display->outputs[display->output_count];
+    memset(output, 0, sizeof(*output));
+
+    id = strtoul(spec, &end, 10);
+    if (end == spec || *end != ':' || id == 0 || id > UINT32_MAX || find_output(display, id)) {
+        fprintf(stderr, "Invalid or duplicate display id: %s\n", spec);
+        return -1;
+    }
+    output->id = id;
+    output->width = strtol(end + 1, &end, 10);
+    if (*end == 'x')
+        output->height = strtol(end + 1, &end, 10);
+    output->refresh_rate = display->refresh_rate;
+    if (*end == '@')
+        output->refresh_rate = strtol(end + 1, &end, 10);
+    if (output->width <= 0 || output->height <= 0 || output->refresh_rate <= 0 || (*end && *end != ':')) {
+        fprintf(stderr, "Invalid display geometry: %s\n", spec);
+        return -1;
+    }
+
+    output->gsthelper = (struct gsthelper *)calloc(1, sizeof(*output->gsthelper));
+    output->input = (struct input *)calloc(1, sizeof(*output->input));
+    if (!output->gsthelper || !output->input) {
+        fprintf(stderr, "out of memory\n");
+        free(output->gsthelper);
+        free(output->input);
+        return -1;
+    }
+    g_rec_mutex_init(&output->gsthelper->lock);
+    // The rest may hold colons of its own
+    if (*end == ':' && end[1])
+        output->gsthelper->gst_pipeline = end + 1;
+    output->gsthelper->display_id = id;
+    output->input->display_id = id;
+
+    display->output_count++;
+    return 0;
+}
+
+void display_wake(struct display *display) {
+    uint64_t one = 1;
+
+    if (write(display->wake_fd, &one, sizeof(one)) < 0) {
+        // Already signalled, the counter only has to be non-zero
+    }
+}
+
+static int wait_events(struct display *display, struct pollfd *fds, nfds_t nfds, int timeout) {
+    if (display->uring) {
+        int ret = uring_recv_poll(display->uring, fds, nfds, display->producer_sock, timeout);
+
+        if (ret >= 0 || errno != EOPNOTSUPP)
+            return ret;
+        fprintf(stderr, "io_uring cannot receive on the producer socket, using poll\n");
+        uring_recv_free(display->uring);
+        display->uring = NULL;
+    }
+    return poll(fds, nfds, timeout);
+}
+
+static int receive(struct display *display, int sock, int *dmabuf_fd, MessageData *message, MessageType *type) {
+    int received;
+
+    // Only the payload length the header announces is filled in
+    memset(message, 0, sizeof(*message));
+    uint64_t recv_start_ns = trace_begin();
+    if (display->uring)
+        received = uring_recv_message(display->uring, dmabuf_fd, message, type);
+    else
+        received = recv_message(sock, dmabuf_fd, message, type);
+    trace_end("recv_message", recv_start_ns, 0);
+    return received;
+}
+
+static void producer_gone(struct display *display) {
+    fprintf(stderr, "recv_message closed\n");
+    metrics_inc(METRIC_PRODUCER_DISCONNECTS);
+    close(display->producer_sock);
+    display->producer_sock = -1;
+}
+
+/* io_uring reads ahead of the messages handled so far. Those are handled
+ * before the socket goes to a successor, which then starts at a message. */
+static void drain_producer(struct display *display, struct gsthelper *gsthelper) {
+    MessageType type;
+    MessageData message;
+    int dmabuf_fd;
+
+    if (!display->uring || display->producer_sock < 0)
+        return;
+
+    uring_recv_detach(display->uring);
+    while (uring_recv_pending(display->uring)) {
+        if (receive(display, display->producer_sock, &dmabuf_fd, &message, &type) <= 0) {
+            producer_gone(display);
+            return;
+        }
+        handle_message(display, display->producer_sock, type, &message, dmabuf_fd, gsthelper);
+    }
+}
+
+// Returns true once the session was handed to a successor
+static bool apply_requests(struct display *display, struct gsthelper *gsthelper) {
+    uint64_t count;
+    int refresh_rate, preview;
+
+    if (read(display->wake_fd, &count, sizeof(count)) < 0)
+        return false;
+
+    if (display->requested_handoff >= 0) {
+        drain_producer(display, gsthelper);
+        if (handoff_transfer(display, gsthelper) == 0)
+            return true;
+    }
+
+    refresh_rate = display->requested_refresh_rate.exchange(0);
+    if (refresh_rate > 0) {
+        display->refresh_rate = refresh_rate;
+        gst_pipeline_set_framerate(gsthelper, display->width, display->height, refresh_rate);
+        fprintf(stderr, "Refresh rate set to %d\n", refresh_rate);
+        // The resume message doubles as the frame rate hint
+        if (display->producer_sock >= 0 && display->producer_can_pause && !display->rendering_paused)
+            send_demand(display, true);
+    }
+
+    preview = display->requested_preview.exchange(PREVIEW_REQUEST_NONE);
+    if (preview == PREVIEW_REQUEST_ON && !display->open_wayland_window) {
+        display->wayland_state = setup_wayland_window();
+        if (display->wayland_state->display) {
+            setup_window(display->wayland_state);
+            display->open_wayland_window = true;
+            display->stream_with_preview = gsthelper->pipeline != NULL;
+        } else {
+            free(display->wayland_state);
+            display->wayland_state = nullptr;
+        }
+    } else if (preview == PREVIEW_REQUEST_OFF && display->open_wayland_window) {
+        destroy_window(display->wayland_state);
+        free(display->wayland_state);
+        display->wayland_state = nullptr;
+        display->open_wayland_window = false;
+        display->stream_with_preview = false;
+    }
+    return false;
+}
+
+static int accept_producer(struct display *display, int listen_sock, struct gsthelper *gsthelper) {
+    int sock = accept_socket(listen_sock);
+
+    if (sock < 0) {
+        fprintf(stderr, "accept failed: %s\n", strerror(errno));
+        return -1;
+    }
+
+    display->producer_can_pause = false;
+    display->rendering_paused = false;
+    metrics_gauge_set(METRIC_RENDERING_PAUSED, 0);
+
+    // The pipeline and the window's buffer cache outlived the old connection,
+    // only the encoder needs a fresh keyframe to resume from
+    if (display->producer_connections++ > 0) {
+        metrics_inc(METRIC_PRODUCER_RECONNECTS);
+        gst_pipeline_force_keyframe(gsthelper);
+        fprintf(stderr, "Producer reconnected\n");
+    }
+    return sock;
 }
 
 void run_display(struct display *display, struct gsthelper *gsthelper) {
-    if (display->open_wayland_window)
+    struct pollfd fds[3];
+
+    if (display->open_wayland_window) {
         display->wayland_state = setup_wayland_window();
+        // A producer taken over from a predecessor already said hello
+        if (display->producer_sock >= 0)
+            setup_window(display->wayland_state);
+    }
 
-    int sock = create_socket(display->socket_path);
+    if (display->listen_sock < 0)
+        display->listen_sock = listen_socket(display->socket_path);
+    // On this thread, the ring is only ever entered from here
+    if (display->io_uring && !display->uring && !(display->uring = uring_recv_new()))
+        fprintf(stderr, "Receiving with poll and recvmsg\n");
 
     while (true) {
         MessageType type;
         MessageData message;
         int dmabuf_fd;
+        int sock = display->producer_sock;
+        int timeout = display->producer_can_pause ? DEMAND_CHECK_MS : -1;
+        int watchdog_timeout = watchdog_timeout_ms();
+        nfds_t nfds = 2;
+
+        // Wait on the compositor too, so frame callbacks are handled between frames
+        fds[0].fd = sock >= 0 ? sock : display->listen_sock;
+        fds[0].events = POLLIN;
+        fds[1].fd = display->wake_fd;
+        fds[1].events = POLLIN;
+        fds[2].fd = window_get_fd(display->wayland_state);
+        fds[2].events = POLLIN;
+        if (fds[2].fd >= 0)
+            nfds = 3;
+        if (watchdog_timeout >= 0 && (timeout < 0 || watchdog_timeout < timeout))
+            timeout = watchdog_timeout;
 
-        if (recv_message(sock, &dmabuf_fd, &message, &type) == 0) {
-            fprintf(stderr, "recv_message closed\n");
-            close(sock);
-            sock = create_socket(display->socket_path);
+        if (wait_events(display, fds, nfds, timeout) < 0) {
+            if (errno != EINTR)
+                fprintf(stderr, "poll failed: %s\n", strerror(errno));
             continue;
         }
 
-        handle_message(display, sock, type, &message, dmabuf_fd, gsthelper);
+        if (fds[1].revents && apply_requests(display, gsthelper))
+            break;
+
+        update_demand(display, gsthelper);
+        // Only while the stream is on, the producer stays connected through a recovery
+        if (!display->open_wayland_window || display->stream_with_preview)
+            watchdog_check(gsthelper);
+
+        if (nfds > 2 && fds[2].revents)
+            window_dispatch(display->wayland_state);
+
+        if (!fds[0].revents)
+            continue;
+
+        if (sock < 0) {
+            display->producer_sock = accept_producer(display, display->listen_sock, gsthelper);
+            continue;
+        }
+
+        // io_uring may have taken several messages off the socket at once
+        do {
+            if (receive(display, sock, &dmabuf_fd, &message, &type) <= 0) {
+                // A reset connection is as gone as a closed one
+                producer_gone(display);
+                break;
+            }
+            handle_message(display, sock, type, &message, dmabuf_fd, gsthelper);
+        } while (display->uring && uring_recv_pending(display->uring));
     }
 
-    close(sock);
+    // After a handoff the successor holds its own copies of both
+    if (display->producer_sock >= 0)
+        close(display->producer_sock);
+    close(display->listen_sock);
+    display->producer_sock = -1;
+    display->listen_sock = -1;
+    uring_recv_free(display->uring);
+    display->uring = NULL;
 }
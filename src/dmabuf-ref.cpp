@@ -0,0 +1,28 @@
+#include <unistd.h>
+
+#include <dmabuf-ref.h>
+#include <metrics.h>
+
+struct dmabuf_ref *dmabuf_ref_new(int fd) {
+    struct dmabuf_ref *ref = new dmabuf_ref;
+
+    ref->fd = fd;
+    ref->id = 0;
+    ref->refcount = 1;
+    metrics_gauge_add(METRIC_DMABUFS_IN_FLIGHT, 1);
+    return ref;
+}
+
+struct dmabuf_ref *dmabuf_ref_get(struct dmabuf_ref *ref) {
+    ref->refcount.fetch_add(1, std::memory_order_relaxed);
+    return ref;
+}
+
+void dmabuf_ref_put(struct dmabuf_ref *ref) {
+    if (ref->refcount.fetch_sub(1, std::memory_order_acq_rel) != 1)
+        return;
+
+    close(ref->fd);
+    delete ref;
+    metrics_gauge_add(METRIC_DMABUFS_IN_FLIGHT, -1);
+}
@@ -3,9 +3,74 @@
 #include <cstdlib>
 #include <unistd.h>
 
+#include <drm_fourcc.h>
+
+#include <dmabuf-ref.h>
 #include <gsthelper.h>
+#include <gst/video/video.h>
 #include <input.h>
+#include <metrics.h>
+#include <pipeline-builder.h>
+#include <replay.h>
+#include <thread-sched.h>
+#include <trace.h>
 #include <xkbcommon/xkbcommon.h>
+#include <linux/input-event-codes.h>
+
+/*
+ * Input that has no GstNavigation equivalent. It arrives either as a
+ * navigation event carrying an unknown "event" name or as a custom upstream
+ * event, both with a structure like:
+ *   event=text-input, text="hello world"
+ *   event=gamepad, x=-1200, y=300, rz=255, buttons=(uint)0x3
+ * Gamepad fields are axis names from gamepad_lookup_axis() and a bitmask of
+ * pressed buttons where bit 0 is BTN_GAMEPAD. Called with input->lock held,
+ * so each structure stages and emits one whole gamepad frame.
+ */
+static gboolean gst_handle_gamepad(struct input *input, const GstStructure *structure) {
+    guint buttons;
+    gint value;
+
+    for (gint i = 0; i < gst_structure_n_fields(structure); i++) {
+        const gchar *field = gst_structure_nth_field_name(structure, i);
+        int axis = gamepad_lookup_axis(field);
+
+        if (axis >= 0 && gst_structure_get_int(structure, field, &value))
+            gamepad_handle_axis(input, axis, value);
+    }
+
+    if (gst_structure_get_uint(structure, "buttons", &buttons)) {
+        for (int i = 0; i < GAMEPAD_BUTTON_COUNT; i++)
+            gamepad_handle_button(input, BTN_GAMEPAD + i, buttons & (1u << i));
+    }
+
+    gamepad_handle_frame(input);
+    return TRUE;
+}
+
+static gboolean gst_handle_custom_input(struct input *input, const GstStructure *structure) {
+    const gchar *name, *text;
+
+    if (!structure)
+        return FALSE;
+
+    name = gst_structure_get_string(structure, "event");
+    if (!name)
+        name = gst_structure_get_name(structure);
+
+    if (g_strcmp0(name, "text-input") == 0) {
+        text = gst_structure_get_string(structure, "text");
+        if (!text)
+            return FALSE;
+        keyboard_handle_text(input, text);
+        return TRUE;
+    }
+
+    if (g_strcmp0(name, "gamepad") == 0)
+        return gst_handle_gamepad(input, structure);
+
+    return FALSE;
+}
 
 static gboolean gst_video_src_event(GstPad *pad, GstObject *parent, GstEvent *event) {
     gboolean ret = FALSE;
@@ -21,10 +86,21 @@ static gboolean gst_video_src_event(GstPad *pad, GstObject *parent, GstEvent *ev
         goto out;
     }
 
-    if (GST_EVENT_TYPE(event) != GST_EVENT_NAVIGATION) {
+    if (GST_EVENT_TYPE(event) != GST_EVENT_NAVIGATION && GST_EVENT_TYPE(event) != GST_EVENT_CUSTOM_UPSTREAM) {
         goto out;
     }
 
+    // QoS, latency and reconfigure events come from streaming threads, only
+    // input makes the caller an input thread
+    sched_apply(SCHED_STAGE_INPUT);
+
+    // The control socket sends its input from its own thread
+    pthread_mutex_lock(&input->lock);
+    if (GST_EVENT_TYPE(event) == GST_EVENT_CUSTOM_UPSTREAM) {
+        ret = gst_handle_custom_input(input, gst_event_get_structure(event));
+        goto flush;
+    }
+
     type = gst_navigation_event_get_type(event);
     switch (type) {
         case GST_NAVIGATION_EVENT_KEY_PRESS:
@@ -87,13 +163,20 @@ static gboolean gst_video_src_event(GstPad *pad, GstObject *parent, GstEvent *ev
             touch_handle_cancel(input);
             ret = TRUE;
             break;
+        case GST_NAVIGATION_EVENT_INVALID:
+            // Navigation events with an "event" name GstNavigation does not know.
+            ret = gst_handle_custom_input(input, gst_event_get_structure(event));
+            break;
         case GST_NAVIGATION_EVENT_TOUCH_FRAME:
         case GST_NAVIGATION_EVENT_COMMAND:
-        case GST_NAVIGATION_EVENT_INVALID:
         default:
             break;
     }
 
+flush:
+    // Whatever the event wrote goes out in one submission
+    input_flush(input);
+    pthread_mutex_unlock(&input->lock);
 out:
     if (!ret) {
         ret = gst_pad_event_default(pad, parent, event);
@@ -106,19 +189,362 @@ out:
 static void cb_need_data (GstElement *, guint , gpointer user_data) {
     struct gsthelper *gsthelper = (struct gsthelper *)user_data;
 
+    if (!gsthelper->want_data)
+        metrics_inc(METRIC_WANT_DATA_ON);
     gsthelper->want_data = true;
+    gsthelper->enough_data_since = 0;
+    metrics_gauge_set(METRIC_WANT_DATA, 1);
 }
 
 static void cb_enough_data (GstElement *, gpointer user_data) {
     struct gsthelper *gsthelper = (struct gsthelper *)user_data;
 
+    if (gsthelper->want_data) {
+        metrics_inc(METRIC_WANT_DATA_OFF);
+        gsthelper->enough_data_since = g_get_monotonic_time();
+    }
     gsthelper->want_data = false;
+    metrics_gauge_set(METRIC_WANT_DATA, 0);
+}
+
+// Runs on the posting thread, only records state for the metrics
+static GstBusSyncReply gst_bus_sync_handler(GstBus *, GstMessage *message, gpointer user_data) {
+    struct gsthelper *gsthelper = (struct gsthelper *)user_data;
+    GstState old_state, new_state;
+    GstStreamStatusType status;
+    GstElement *owner;
+
+    switch (GST_MESSAGE_TYPE(message)) {
+    case GST_MESSAGE_STATE_CHANGED:
+        if (GST_MESSAGE_SRC(message) == GST_OBJECT_CAST(gsthelper->pipeline)) {
+            gst_message_parse_state_changed(message, &old_state, &new_state, NULL);
+            metrics_gauge_set(METRIC_PIPELINE_STATE, new_state);
+        }
+        break;
+    case GST_MESSAGE_ERROR:
+    case GST_MESSAGE_WARNING: {
+        GError *err = NULL;
+        gchar *name = gst_object_get_name(GST_MESSAGE_SRC(message));
+        bool error = GST_MESSAGE_TYPE(message) == GST_MESSAGE_ERROR;
+
+        if (error)
+            gst_message_parse_error(message, &err, NULL);
+        else
+            gst_message_parse_warning(message, &err, NULL);
+        fprintf(stderr, "Pipeline %s from %s: %s\n", error ? "error" : "warning", name, err ? err->message : "unknown");
+        g_clear_error(&err);
+        g_free(name);
+
+        // The watchdog recovers from errors, warnings are only counted
+        metrics_inc(error ? METRIC_PIPELINE_ERRORS : METRIC_PIPELINE_WARNINGS);
+        if (error)
+            gsthelper->failed = true;
+        break;
+    }
+    case GST_MESSAGE_STREAM_STATUS:
+        // ENTER is posted from the new streaming thread itself
+        gst_message_parse_stream_status(message, &status, &owner);
+        if (status == GST_STREAM_STATUS_TYPE_ENTER)
+            sched_apply(SCHED_STAGE_STREAMING);
+        break;
+    default:
+        break;
+    }
+
+    return GST_BUS_PASS;
+}
+
+// The first element whose klass names it an encoder, with a reference
+static GstElement *find_encoder(GstElement *pipeline) {
+    GstIterator *it = gst_bin_iterate_recurse(GST_BIN(pipeline));
+    GValue item = G_VALUE_INIT;
+    GstElement *encoder = NULL;
+
+    while (!encoder && gst_iterator_next(it, &item) == GST_ITERATOR_OK) {
+        GstElement *element = GST_ELEMENT(g_value_get_object(&item));
+        GstElementFactory *factory = gst_element_get_factory(element);
+        const gchar *klass = factory ? gst_element_factory_get_metadata(factory, GST_ELEMENT_METADATA_KLASS) : NULL;
+
+        if (klass && strstr(klass, "Encoder"))
+            encoder = GST_ELEMENT(gst_object_ref(element));
+        g_value_reset(&item);
+    }
+    g_value_unset(&item);
+    gst_iterator_free(it);
+
+    return encoder;
+}
+
+/* Encoders keep PTS but not necessarily the offset, so frames entering the
+ * encoder are remembered by PTS and matched when the encoded buffer leaves. */
+static GstPadProbeReturn encoder_sink_probe(GstPad *, GstPadProbeInfo *info, gpointer user_data) {
+    struct gsthelper *gsthelper = (struct gsthelper *)user_data;
+    GstBuffer *buf = GST_PAD_PROBE_INFO_BUFFER(info);
+    struct gst_trace_pending *pending;
+
+    if (!trace_enabled.load(std::memory_order_relaxed))
+        return GST_PAD_PROBE_OK;
+
+    g_mutex_lock(&gsthelper->trace_lock);
+    pending = &gsthelper->trace_pending[gsthelper->trace_next++ % GST_TRACE_PENDING];
+    pending->pts = GST_BUFFER_PTS(buf);
+    pending->id = GST_BUFFER_OFFSET(buf);
+    pending->in_ns = trace_now_ns();
+    g_mutex_unlock(&gsthelper->trace_lock);
+
+    return GST_PAD_PROBE_OK;
+}
+
+static GstPadProbeReturn encoder_src_probe(GstPad *, GstPadProbeInfo *info, gpointer user_data) {
+    struct gsthelper *gsthelper = (struct gsthelper *)user_data;
+    GstBuffer *buf = GST_PAD_PROBE_INFO_BUFFER(info);
+
+    if (!trace_enabled.load(std::memory_order_relaxed) || !GST_BUFFER_PTS_IS_VALID(buf))
+        return GST_PAD_PROBE_OK;
+
+    g_mutex_lock(&gsthelper->trace_lock);
+    for (int i = 0; i < GST_TRACE_PENDING; i++) {
+        struct gst_trace_pending *pending = &gsthelper->trace_pending[i];
+
+        if (pending->in_ns && pending->pts == GST_BUFFER_PTS(buf)) {
+            trace_record("encode", pending->in_ns, trace_now_ns(), pending->id);
+            pending->in_ns = 0;
+            break;
+        }
+    }
+    g_mutex_unlock(&gsthelper->trace_lock);
+
+    return GST_PAD_PROBE_OK;
+}
+
+static void add_encoder_probes(struct gsthelper *gsthelper) {
+    GstPad *pad;
+
+    g_mutex_init(&gsthelper->trace_lock);
+    memset(gsthelper->trace_pending, 0, sizeof(gsthelper->trace_pending));
+
+    pad = gst_element_get_static_pad(gsthelper->encoder, "sink");
+    if (pad) {
+        gst_pad_add_probe(pad, GST_PAD_PROBE_TYPE_BUFFER, encoder_sink_probe, gsthelper, NULL);
+        gst_object_unref(pad);
+    }
+    pad = gst_element_get_static_pad(gsthelper->encoder, "src");
+    if (pad) {
+        gst_pad_add_probe(pad, GST_PAD_PROBE_TYPE_BUFFER, encoder_src_probe, gsthelper, NULL);
+        gst_object_unref(pad);
+    }
+}
+
+// Copies the encoder output into the replay ring, see replay.h
+static GstPadProbeReturn encoder_replay_probe(GstPad *, GstPadProbeInfo *info, gpointer) {
+    if (info->type & GST_PAD_PROBE_TYPE_EVENT_DOWNSTREAM) {
+        GstEvent *event = GST_PAD_PROBE_INFO_EVENT(info);
+        GstCaps *caps;
+
+        if (GST_EVENT_TYPE(event) == GST_EVENT_CAPS) {
+            gst_event_parse_caps(event, &caps);
+            gchar *description = gst_caps_to_string(caps);
+            replay_set_caps(description);
+            g_free(description);
+        }
+        return GST_PAD_PROBE_OK;
+    }
+
+    GstBuffer *buf = GST_PAD_PROBE_INFO_BUFFER(info);
+    uint32_t flags = 0;
+    GstMapInfo map;
+
+    if (!GST_BUFFER_PTS_IS_VALID(buf))
+        return GST_PAD_PROBE_OK;
+    if (!GST_BUFFER_FLAG_IS_SET(buf, GST_BUFFER_FLAG_DELTA_UNIT))
+        flags |= REPLAY_FRAME_KEYFRAME;
+    if (GST_BUFFER_FLAG_IS_SET(buf, GST_BUFFER_FLAG_HEADER))
+        flags |= REPLAY_FRAME_HEADER;
+    if (gst_buffer_map(buf, &map, GST_MAP_READ)) {
+        replay_write(map.data, map.size, GST_BUFFER_PTS(buf), GST_BUFFER_DTS(buf), flags);
+        gst_buffer_unmap(buf, &map);
+    }
+    return GST_PAD_PROBE_OK;
+}
+
+static GstPadProbeReturn encoder_output_probe(GstPad *, GstPadProbeInfo *, gpointer user_data) {
+    struct gsthelper *gsthelper = (struct gsthelper *)user_data;
+
+    gsthelper->last_output_us.store(g_get_monotonic_time(), std::memory_order_relaxed);
+    return GST_PAD_PROBE_OK;
+}
+
+/* Which streaming thread runs the encoder is only known once a buffer
+ * reaches it, that thread moves from the streaming to the encoder stage. */
+static GstPadProbeReturn encoder_sched_probe(GstPad *, GstPadProbeInfo *, gpointer) {
+    sched_apply(SCHED_STAGE_ENCODER);
+    return GST_PAD_PROBE_OK;
+}
+
+static void cb_consumer_added(GstElement *, gchar *, GstElement *, gpointer user_data) {
+    struct gsthelper *gsthelper = (struct gsthelper *)user_data;
+
+    gsthelper->consumers++;
 }
 
+static void cb_consumer_removed(GstElement *, gchar *, GstElement *, gpointer user_data) {
+    struct gsthelper *gsthelper = (struct gsthelper *)user_data;
+
+    gsthelper->consumers--;
+}
+
+/* A sink that knows its viewers: the multihandlesink family (tcpserversink,
+ * multifdsink, ...) has num-handles, webrtcsink signals its consumers. */
+static GstElement *find_viewer_sink(GstElement *pipeline) {
+    GstIterator *it = gst_bin_iterate_recurse(GST_BIN(pipeline));
+    GValue item = G_VALUE_INIT;
+    GstElement *sink = NULL;
+
+    while (!sink && gst_iterator_next(it, &item) == GST_ITERATOR_OK) {
+        GstElement *element = GST_ELEMENT(g_value_get_object(&item));
+
+        if (GST_OBJECT_FLAG_IS_SET(element, GST_ELEMENT_FLAG_SINK) &&
+            (g_object_class_find_property(G_OBJECT_GET_CLASS(element), "num-handles") ||
+             g_signal_lookup("consumer-added", G_OBJECT_TYPE(element))))
+            sink = GST_ELEMENT(gst_object_ref(element));
+        g_value_reset(&item);
+    }
+    g_value_unset(&item);
+    gst_iterator_free(it);
+
+    return sink;
+}
+
+// Producer DRM fourccs, further planes follow the first at stride * height
+struct drm_video_format {
+    uint32_t fourcc;
+    GstVideoFormat format;
+    guint planes;
+};
+
+static const struct drm_video_format DRM_VIDEO_FORMATS[] = {
+    {DRM_FORMAT_XBGR8888, GST_VIDEO_FORMAT_RGBx, 1},
+    {DRM_FORMAT_XRGB8888, GST_VIDEO_FORMAT_BGRx, 1},
+    {DRM_FORMAT_ABGR8888, GST_VIDEO_FORMAT_RGBA, 1},
+    {DRM_FORMAT_ARGB8888, GST_VIDEO_FORMAT_BGRA, 1},
+    {DRM_FORMAT_BGR888, GST_VIDEO_FORMAT_RGB, 1},
+    {DRM_FORMAT_RGB888, GST_VIDEO_FORMAT_BGR, 1},
+    {DRM_FORMAT_RGB565, GST_VIDEO_FORMAT_RGB16, 1},
+    {DRM_FORMAT_NV12, GST_VIDEO_FORMAT_NV12, 2},
+    {DRM_FORMAT_NV21, GST_VIDEO_FORMAT_NV21, 2},
+};
+
+// Unknown formats are taken as XBGR8888, what appsrc always announced before
+static const struct drm_video_format *find_drm_format(uint32_t fourcc) {
+    for (size_t i = 0; i < G_N_ELEMENTS(DRM_VIDEO_FORMATS); i++)
+        if (DRM_VIDEO_FORMATS[i].fourcc == fourcc)
+            return &DRM_VIDEO_FORMATS[i];
+    return &DRM_VIDEO_FORMATS[0];
+}
+
+/* video/x-raw(memory:DMABuf) with the exact fourcc:modifier where GStreamer
+ * can express it (1.24, explicit modifier), the plain format otherwise. */
+static GstCaps *gst_frame_caps(struct gsthelper *gsthelper, bool dmabuf) {
+    const struct drm_video_format *info = find_drm_format(gsthelper->drm_format);
+    GstCaps *caps = NULL;
+
+#if GST_CHECK_VERSION(1, 24, 0)
+    if (dmabuf && gsthelper->modifier != DRM_FORMAT_MOD_INVALID) {
+        gchar *drm_format = gst_video_dma_drm_fourcc_to_string(info->fourcc, gsthelper->modifier);
+
+        caps = gst_caps_new_simple("video/x-raw",
+                                   "format", G_TYPE_STRING, "DMA_DRM",
+                                   "drm-format", G_TYPE_STRING, drm_format,
+                                   NULL);
+        g_free(drm_format);
+    }
+#endif
+    if (!caps)
+        caps = gst_caps_new_simple("video/x-raw",
+                                   "format", G_TYPE_STRING, gst_video_format_to_string(info->format),
+                                   NULL);
+
+    gst_caps_set_simple(caps,
+                        "width", G_TYPE_INT, gsthelper->width,
+                        "height", G_TYPE_INT, gsthelper->height,
+                        "framerate", GST_TYPE_FRACTION, gsthelper->refresh_rate, 1,
+                        NULL);
+    if (dmabuf)
+        gst_caps_set_features(caps, 0, gst_caps_features_new(GST_CAPS_FEATURE_MEMORY_DMABUF, NULL));
+    return caps;
+}
+
+/* (Re)negotiates appsrc for the current layout. Dmabuf caps come first, a
+ * pipeline that refuses them gets system memory caps and maps the buffers,
+ * which is a copy and only correct for linear ones. */
+static void gst_update_caps(struct gsthelper *gsthelper) {
+    GstPad *pad = gst_element_get_static_pad(GST_ELEMENT(gsthelper->appsrc), "src");
+    GstCaps *caps = gst_frame_caps(gsthelper, true);
+    gchar *description;
+
+    gsthelper->dmabuf_caps = gst_pad_peer_query_accept_caps(pad, caps);
+    gst_object_unref(pad);
+    if (!gsthelper->dmabuf_caps) {
+        gst_caps_unref(caps);
+        caps = gst_frame_caps(gsthelper, false);
+        if (gsthelper->modifier != DRM_FORMAT_MOD_LINEAR && gsthelper->modifier != DRM_FORMAT_MOD_INVALID)
+            fprintf(stderr, "Downstream does not take dmabuf caps, tiled frames will be garbled\n");
+    }
+
+    description = gst_caps_to_string(caps);
+    fprintf(stderr, "appsrc caps: %s\n", description);
+    g_free(description);
+
+    g_object_set(G_OBJECT(gsthelper->appsrc), "caps", caps, NULL);
+    gst_caps_unref(caps);
+}
+
+// What a pipeline holds references on, taken out of gsthelper under the lock
+struct gst_elements {
+    GstElement *pipeline;
+    GstBus *bus;
+    GstElement *encoder;
+    GstElement *sink;
+};
+
+static void take_elements(struct gsthelper *gsthelper, struct gst_elements *elements) {
+    elements->pipeline = gsthelper->pipeline;
+    elements->bus = gsthelper->bus;
+    elements->encoder = gsthelper->encoder;
+    elements->sink = gsthelper->sink;
+    gsthelper->pipeline = NULL;
+    gsthelper->appsrc = NULL;
+    gsthelper->bus = NULL;
+    gsthelper->encoder = NULL;
+    gsthelper->sink = NULL;
+}
+
+// Stopping a pipeline waits for its streaming threads, never under the lock
+static void destroy_elements(struct gst_elements *elements) {
+    if (!elements->pipeline)
+        return;
+
+    gst_element_set_state(elements->pipeline, GST_STATE_NULL);
+    if (elements->bus)
+        gst_object_unref(GST_OBJECT(elements->bus));
+    if (elements->encoder)
+        gst_object_unref(GST_OBJECT(elements->encoder));
+    if (elements->sink)
+        gst_object_unref(GST_OBJECT(elements->sink));
+    gst_object_unref(GST_OBJECT(elements->pipeline));
+    metrics_gauge_set(METRIC_PIPELINE_STATE, 0);
+}
+
+/* Builds the pipeline without holding the lock and swaps it in under it, so
+ * other threads only wait for the swap. A pipeline already running is
+ * replaced and stopped before the new one plays, the sink may need its port
+ * or device back. */
 int gst_pipeline_init(struct gsthelper *gsthelper, int width, int height, int refresh_rate, struct input *input) {
-    GstCaps *caps;
+    struct gst_elements elements = {};
+    struct gst_elements old;
     GError *err = NULL;
     GstStateChangeReturn ret;
+    GstAppSrc *appsrc;
     GstPad *pad;
 
     if (!gst_init_check(NULL, NULL, &err)) {
@@ -129,119 +555,239 @@ int gst_pipeline_init(struct gsthelper *gsthelper, int width, int height, int re
     }
 
     fprintf(stderr, "GStreamer initialization\n");
-    gsthelper->allocator = gst_dmabuf_allocator_new();
+    if (!gsthelper->allocator)
+        gsthelper->allocator = gst_dmabuf_allocator_new();
+    gsthelper->input = input;
 
     if (!gsthelper->gst_pipeline) {
-        char pipeline_str[1024];
-        snprintf(pipeline_str, sizeof(pipeline_str),
-                 "appsrc name=src "
-                 " ! vaapipostproc ! vaapivp9enc ! webrtcsink signaller::uri=\"ws://localhost:8443\" enable-control-data-channel=true name=sink");
-        gsthelper->gst_pipeline = strdup(pipeline_str);
+        gsthelper->gst_pipeline = pipeline_build(gsthelper->codec, width, height, refresh_rate);
+        if (!gsthelper->gst_pipeline)
+            return -1;
+        gsthelper->built = true;
     }
     fprintf(stderr, "GST pipeline: %s\n", gsthelper->gst_pipeline);
 
-    gsthelper->pipeline = gst_parse_launch(gsthelper->gst_pipeline, &err);
-    if (!gsthelper->pipeline) {
+    elements.pipeline = gst_parse_launch(gsthelper->gst_pipeline, &err);
+    if (!elements.pipeline) {
         fprintf(stderr, "Could not create gstreamer pipeline. Error: %s\n",
                 err->message);
         g_error_free(err);
         return -1;
     }
 
-    gsthelper->appsrc = (GstAppSrc *)
-        gst_bin_get_by_name(GST_BIN(gsthelper->pipeline), "src");
-    if (!gsthelper->appsrc) {
+    appsrc = (GstAppSrc *)gst_bin_get_by_name(GST_BIN(elements.pipeline), "src");
+    if (!appsrc) {
         fprintf(stderr, "Could not get appsrc from gstreamer pipeline\n");
         goto err;
     }
 
-    caps = gst_caps_new_simple("video/x-raw",
-                               "format", G_TYPE_STRING,
-                               "RGBx",
-                               "width", G_TYPE_INT, width,
-                               "height", G_TYPE_INT, height,
-                               "framerate", GST_TYPE_FRACTION,
-                               refresh_rate, 1,
-                               NULL);
-    if (!caps) {
-        fprintf(stderr, "Could not create gstreamer caps.\n");
-        goto err;
-    }
-
-    g_object_set(G_OBJECT(gsthelper->appsrc),
-                 "caps", caps,
+    g_object_set(G_OBJECT(appsrc),
                  "stream-type", 0,
                  "format", GST_FORMAT_TIME,
                  "is-live", TRUE,
                  NULL);
-    gst_caps_unref(caps);
 
-    gsthelper->bus = gst_pipeline_get_bus(GST_PIPELINE(gsthelper->pipeline));
-    if (!gsthelper->bus) {
+    elements.bus = gst_pipeline_get_bus(GST_PIPELINE(elements.pipeline));
+    if (!elements.bus) {
         fprintf(stderr, "Could not get bus from gstreamer pipeline\n");
         goto err;
     }
-    /*gst_bus_set_sync_handler(gsthelper->bus, remoting_gst_bus_sync_handler,
-                             &gsthelper->gstpipe, NULL);*/
+    gst_bus_set_sync_handler(elements.bus, gst_bus_sync_handler, gsthelper, NULL);
 
-    g_signal_connect (gsthelper->appsrc, "need-data", G_CALLBACK (cb_need_data), gsthelper);
-    g_signal_connect (gsthelper->appsrc, "enough-data", G_CALLBACK (cb_enough_data), gsthelper);
+    g_signal_connect (appsrc, "need-data", G_CALLBACK (cb_need_data), gsthelper);
+    g_signal_connect (appsrc, "enough-data", G_CALLBACK (cb_enough_data), gsthelper);
 
-    pad = gst_element_get_static_pad (GST_ELEMENT_CAST(gst_bin_get_by_name(GST_BIN(gsthelper->pipeline), "src")), "src");
+    pad = gst_element_get_static_pad (GST_ELEMENT_CAST(appsrc), "src");
     gst_pad_set_element_private(pad, input);
     gst_pad_set_event_function_full(pad, gst_video_src_event, input, NULL);
 
-    ret = gst_element_set_state(gsthelper->pipeline, GST_STATE_PLAYING);
+    elements.encoder = find_encoder(elements.pipeline);
+    elements.sink = find_viewer_sink(elements.pipeline);
+    if (elements.sink && g_signal_lookup("consumer-added", G_OBJECT_TYPE(elements.sink))) {
+        g_signal_connect(elements.sink, "consumer-added", G_CALLBACK(cb_consumer_added), gsthelper);
+        g_signal_connect(elements.sink, "consumer-removed", G_CALLBACK(cb_consumer_removed), gsthelper);
+    }
+
+    g_rec_mutex_lock(&gsthelper->lock);
+    take_elements(gsthelper, &old);
+    gsthelper->pipeline = elements.pipeline;
+    gsthelper->appsrc = appsrc;
+    gsthelper->bus = elements.bus;
+    gsthelper->encoder = elements.encoder;
+    gsthelper->sink = elements.sink;
+
+    // Until the first frame says otherwise, a rebuilt pipeline keeps the producer's
+    gsthelper->width = width;
+    gsthelper->height = height;
+    gsthelper->refresh_rate = refresh_rate;
+    if (!gsthelper->drm_format) {
+        gsthelper->drm_format = DRM_FORMAT_XBGR8888;
+        gsthelper->modifier = DRM_FORMAT_MOD_LINEAR;
+    }
+    gst_update_caps(gsthelper);
+
+    gsthelper->consumers = 0;
+    gsthelper->enough_data_since = 0;
+    gsthelper->paused = false;
+    gsthelper->failed = false;
+    gsthelper->push_failures = 0;
+    gsthelper->last_push_us = 0;
+    gsthelper->last_output_us = g_get_monotonic_time();
+    g_rec_mutex_unlock(&gsthelper->lock);
+
+    destroy_elements(&old);
+
+    // A viewer joining a built pipeline waits at most two seconds for a keyframe
+    if (gsthelper->built)
+        gst_pipeline_set_gop(gsthelper, refresh_rate * 2);
+    if (elements.encoder && trace_enabled.load(std::memory_order_relaxed))
+        add_encoder_probes(gsthelper);
+    if (elements.encoder) {
+        GstPad *src = gst_element_get_static_pad(elements.encoder, "src");
+        if (src) {
+            gst_pad_add_probe(src, GST_PAD_PROBE_TYPE_BUFFER, encoder_output_probe, gsthelper, NULL);
+            gst_object_unref(src);
+        }
+    }
+    // The ring holds one stream, that of the primary display
+    if (elements.encoder && replay_enabled() && gsthelper->display_id == 0) {
+        GstPad *src = gst_element_get_static_pad(elements.encoder, "src");
+        if (src) {
+            gst_pad_add_probe(src, (GstPadProbeType)(GST_PAD_PROBE_TYPE_BUFFER | GST_PAD_PROBE_TYPE_EVENT_DOWNSTREAM),
+                              encoder_replay_probe, NULL, NULL);
+            gst_object_unref(src);
+        }
+    }
+    if (elements.encoder && sched_configured(SCHED_STAGE_ENCODER)) {
+        GstPad *sink = gst_element_get_static_pad(elements.encoder, "sink");
+        if (sink) {
+            gst_pad_add_probe(sink, GST_PAD_PROBE_TYPE_BUFFER, encoder_sched_probe, NULL, NULL);
+            gst_object_unref(sink);
+        }
+    }
+
+    ret = gst_element_set_state(elements.pipeline, GST_STATE_PLAYING);
     if (ret == GST_STATE_CHANGE_FAILURE) {
         fprintf(stderr, "Couldn't set GST_STATE_PLAYING to pipeline\n");
-        goto err;
+        g_rec_mutex_lock(&gsthelper->lock);
+        take_elements(gsthelper, &elements);
+        g_rec_mutex_unlock(&gsthelper->lock);
+        destroy_elements(&elements);
+        return -1;
     }
 
     return 0;
 
 err:
-    gst_object_unref(GST_OBJECT(gsthelper->pipeline));
-    gsthelper->pipeline = NULL;
+    gst_object_unref(GST_OBJECT(elements.pipeline));
     return -1;
 }
 
 void gst_pipeline_deinit(struct gsthelper *gsthelper) {
-    if (!gsthelper->pipeline)
+    struct gst_elements elements;
+
+    g_rec_mutex_lock(&gsthelper->lock);
+    take_elements(gsthelper, &elements);
+    g_rec_mutex_unlock(&gsthelper->lock);
+    destroy_elements(&elements);
+}
+
+// Lets the frames still queued reach the sink before the pipeline goes down
+void gst_pipeline_drain(struct gsthelper *gsthelper, int timeout_ms) {
+    GstMessage *message;
+
+    if (!gsthelper->pipeline || !gsthelper->bus)
         return;
 
-    gst_element_set_state(gsthelper->pipeline, GST_STATE_NULL);
-    if (gsthelper->bus)
-        gst_object_unref(GST_OBJECT(gsthelper->bus));
-    gst_object_unref(GST_OBJECT(gsthelper->pipeline));
-    gsthelper->pipeline = NULL;
+    gst_app_src_end_of_stream(gsthelper->appsrc);
+    message = gst_bus_timed_pop_filtered(gsthelper->bus, timeout_ms * GST_MSECOND,
+                                         (GstMessageType)(GST_MESSAGE_EOS | GST_MESSAGE_ERROR));
+    if (!message) {
+        fprintf(stderr, "Pipeline did not drain within %d ms\n", timeout_ms);
+        return;
+    }
+    gst_message_unref(message);
+}
+
+static GQuark dmabuf_ref_quark(void) {
+    static GQuark quark = g_quark_from_static_string("playdroid-dmabuf-ref");
+    return quark;
+}
+
+// The whole dmabuf, later planes and padding included
+static gsize dmabuf_size(int fd, const struct drm_video_format *info, gsize offset, gint stride, int height) {
+    off_t size = lseek(fd, 0, SEEK_END);
+
+    if (size > 0)
+        return size;
+    // Exporters without llseek support, assume the planes are packed
+    return offset + (gsize)stride * height * (info->planes > 1 ? 3 : 2) / 2;
 }
 
-void gst_output_frame(struct gsthelper *gsthelper, int dmabuf_fd, int width, int height, int refresh_rate, gsize offset, gint stride) {
+/* Takes over the caller's reference on frame, it is dropped once the
+ * pipeline is done with the memory (or right away when the frame is not
+ * wanted). */
+void gst_output_frame(struct gsthelper *gsthelper, struct dmabuf_ref *frame, int width, int height, int refresh_rate,
+                      uint32_t format, uint64_t modifier, gsize offset, gint stride) {
+    const struct drm_video_format *info;
+    GstVideoFormat meta_format;
     GstBuffer *buf;
     GstMemory *mem;
+    // The frame may be gone once pushed, keep its id for the spans
+    guint64 frame_id = frame->id;
+    uint64_t trace_start_ns = trace_begin();
+
+    if (!gsthelper->pipeline) {
+        metrics_inc(METRIC_FRAMES_DROPPED_NO_PIPELINE);
+        dmabuf_ref_put(frame);
+        return;
+    }
 
     if(!gsthelper->want_data) {
-        close(dmabuf_fd);
+        metrics_inc(METRIC_FRAMES_DROPPED_NOT_WANTED);
+        dmabuf_ref_put(frame);
+        trace_end("gst_output_frame dropped", trace_start_ns, frame_id);
         return;
     }
 
+    // A new format, modifier or size from the producer renegotiates before this frame
+    if (format != gsthelper->drm_format || modifier != gsthelper->modifier ||
+        width != gsthelper->width || height != gsthelper->height) {
+        gsthelper->drm_format = format;
+        gsthelper->modifier = modifier;
+        gsthelper->width = width;
+        gsthelper->height = height;
+        gst_update_caps(gsthelper);
+    }
+    info = find_drm_format(format);
+    meta_format = info->format;
+#if GST_CHECK_VERSION(1, 24, 0)
+    if (gsthelper->dmabuf_caps && modifier != DRM_FORMAT_MOD_INVALID)
+        meta_format = GST_VIDEO_FORMAT_DMA_DRM;
+#endif
+
     gsize offsets[GST_VIDEO_MAX_PLANES] = {
         offset,
+        offset + (gsize)stride * height,
     };
     gint strides[GST_VIDEO_MAX_PLANES] = {
         stride,
+        stride,
     };
 
     buf = gst_buffer_new();
-    mem = gst_dmabuf_allocator_alloc(gsthelper->allocator, dmabuf_fd,
-                                     stride * height);
+    mem = gst_dmabuf_allocator_alloc_with_flags(gsthelper->allocator, frame->fd,
+                                                dmabuf_size(frame->fd, info, offset, stride, height),
+                                                GST_FD_MEMORY_FLAG_DONT_CLOSE);
+    gst_mini_object_set_qdata(GST_MINI_OBJECT(mem), dmabuf_ref_quark(), frame,
+                              (GDestroyNotify)dmabuf_ref_put);
     gst_buffer_append_memory(buf, mem);
     gst_buffer_add_video_meta_full(buf,
                                    GST_VIDEO_FRAME_FLAG_NONE,
-                                   GST_VIDEO_FORMAT_RGBx,
+                                   meta_format,
                                    width,
                                    height,
-                                   1,
+                                   info->planes,
                                    offsets,
                                    strides);
 
@@ -253,10 +799,220 @@ void gst_output_frame(struct gsthelper *gsthelper, int dmabuf_fd, int width, int
 
     GST_BUFFER_PTS(buf) = running_time;
     GST_BUFFER_DURATION(buf) = gst_util_uint64_scale_int(1, GST_SECOND, refresh_rate);
+    GST_BUFFER_OFFSET(buf) = frame_id;
 
+    uint64_t push_start_ns = trace_begin();
+    gint64 push_start_us = g_get_monotonic_time();
     int ret = gst_app_src_push_buffer((GstAppSrc *)gsthelper->appsrc, buf);
+    metrics_observe_us(METRIC_PUSH_DURATION, g_get_monotonic_time() - push_start_us);
+    trace_end("appsrc_push", push_start_ns, frame_id);
     if (ret != GST_FLOW_OK) {
         /* something wrong, stop pushing */
         fprintf(stderr, "Error: gst_app_src_push_buffer failed: %d\n", ret);
+        metrics_inc(METRIC_PUSH_FAILURES);
+        gsthelper->push_failures++;
+    } else {
+        metrics_inc(METRIC_FRAMES_PUSHED);
+        gsthelper->push_failures = 0;
+        gsthelper->last_push_us.store(push_start_us, std::memory_order_relaxed);
     }
+    trace_end("gst_output_frame", trace_start_ns, frame_id);
+}
+
+/* Runtime reconfiguration, see control.cpp. Encoder properties differ
+ * between plugins, so each setter tries the names in use by the common
+ * encoders (x264, vaapi, va, vpx, nvcodec) and their units. */
+
+int gst_pipeline_set_framerate(struct gsthelper *gsthelper, int width, int height, int refresh_rate) {
+    if (!gsthelper->appsrc)
+        return -1;
+
+    gsthelper->width = width;
+    gsthelper->height = height;
+    gsthelper->refresh_rate = refresh_rate;
+    gst_update_caps(gsthelper);
+    return 0;
+}
+
+// Sets the first existing property of `names`, converting to its integer type
+static int set_first_property(GstElement *encoder, const char *const *names, const guint *scales, guint value) {
+    GObjectClass *klass = G_OBJECT_GET_CLASS(encoder);
+
+    for (int i = 0; names[i]; i++) {
+        GParamSpec *spec = g_object_class_find_property(klass, names[i]);
+        guint64 scaled = (guint64)value * scales[i];
+
+        if (!spec)
+            continue;
+
+        switch (G_PARAM_SPEC_VALUE_TYPE(spec)) {
+        case G_TYPE_UINT:
+            g_object_set(G_OBJECT(encoder), names[i], (guint)scaled, NULL);
+            return 0;
+        case G_TYPE_INT:
+            g_object_set(G_OBJECT(encoder), names[i], (gint)scaled, NULL);
+            return 0;
+        case G_TYPE_UINT64:
+            g_object_set(G_OBJECT(encoder), names[i], (guint64)scaled, NULL);
+            return 0;
+        case G_TYPE_INT64:
+            g_object_set(G_OBJECT(encoder), names[i], (gint64)scaled, NULL);
+            return 0;
+        default:
+            break;
+        }
+    }
+
+    return -1;
+}
+
+static int set_encoder_property(struct gsthelper *gsthelper, const char *const *names, const guint *scales, guint value) {
+    int ret = -1;
+
+    g_rec_mutex_lock(&gsthelper->lock);
+    if (gsthelper->encoder)
+        ret = set_first_property(gsthelper->encoder, names, scales, value);
+    g_rec_mutex_unlock(&gsthelper->lock);
+    return ret;
+}
+
+int gst_pipeline_set_bitrate(struct gsthelper *gsthelper, guint kbps) {
+    static const char *const names[] = {"bitrate", "target-bitrate", NULL};
+    static const guint scales[] = {1, 1000}; // kbit/s, bit/s
+
+    return set_encoder_property(gsthelper, names, scales, kbps);
+}
+
+int gst_pipeline_set_gop(struct gsthelper *gsthelper, guint frames) {
+    static const char *const names[] = {"key-int-max", "keyframe-period", "keyframe-max-dist", "gop-size", NULL};
+    static const guint scales[] = {1, 1, 1, 1};
+
+    return set_encoder_property(gsthelper, names, scales, frames);
+}
+
+int gst_pipeline_force_keyframe(struct gsthelper *gsthelper) {
+    GstPad *pad = NULL;
+    gboolean ret = FALSE;
+
+    // Upstream events sent to the src pad are handled by the encoder itself
+    g_rec_mutex_lock(&gsthelper->lock);
+    if (gsthelper->encoder)
+        pad = gst_element_get_static_pad(gsthelper->encoder, "src");
+    g_rec_mutex_unlock(&gsthelper->lock);
+    if (!pad)
+        return -1;
+    ret = gst_pad_send_event(pad, gst_video_event_new_upstream_force_key_unit(GST_CLOCK_TIME_NONE, TRUE, 0));
+    gst_object_unref(pad);
+
+    return ret ? 0 : -1;
+}
+
+/* Delivers a custom input structure like the ones described at the top of
+ * this file through appsrc's event handler, as a sink would. Takes it. */
+int gst_pipeline_send_input(struct gsthelper *gsthelper, GstStructure *structure) {
+    GstPad *pad = NULL;
+    gboolean ret = FALSE;
+
+    g_rec_mutex_lock(&gsthelper->lock);
+    if (gsthelper->appsrc)
+        pad = gst_element_get_static_pad(GST_ELEMENT(gsthelper->appsrc), "src");
+    g_rec_mutex_unlock(&gsthelper->lock);
+    if (!pad) {
+        gst_structure_free(structure);
+        return -1;
+    }
+    ret = gst_pad_send_event(pad, gst_event_new_custom(GST_EVENT_CUSTOM_UPSTREAM, structure));
+    gst_object_unref(pad);
+
+    return ret ? 0 : -1;
+}
+
+int gst_pipeline_set_paused(struct gsthelper *gsthelper, bool paused) {
+    GstStateChangeReturn ret = GST_STATE_CHANGE_FAILURE;
+
+    g_rec_mutex_lock(&gsthelper->lock);
+    if (gsthelper->pipeline)
+        ret = gst_element_set_state(gsthelper->pipeline, paused ? GST_STATE_PAUSED : GST_STATE_PLAYING);
+    if (ret != GST_STATE_CHANGE_FAILURE)
+        gsthelper->paused = paused;
+    g_rec_mutex_unlock(&gsthelper->lock);
+
+    return ret == GST_STATE_CHANGE_FAILURE ? -1 : 0;
+}
+
+// Clients of the sink, -1 when it does not report them
+int gst_pipeline_viewers(struct gsthelper *gsthelper) {
+    guint handles;
+    int viewers = -1;
+
+    g_rec_mutex_lock(&gsthelper->lock);
+    if (gsthelper->sink && !g_object_class_find_property(G_OBJECT_GET_CLASS(gsthelper->sink), "num-handles")) {
+        viewers = gsthelper->consumers;
+    } else if (gsthelper->sink) {
+        g_object_get(gsthelper->sink, "num-handles", &handles, NULL);
+        viewers = handles;
+    }
+    g_rec_mutex_unlock(&gsthelper->lock);
+    return viewers;
+}
+
+/* Whether a frame pushed now would reach anyone: the pipeline plays, the
+ * sink has viewers as far as it can tell, and appsrc has not been full for
+ * longer than a short encoder stall. */
+bool gst_pipeline_wants_frames(struct gsthelper *gsthelper) {
+    gint64 since = gsthelper->enough_data_since;
+
+    if (!gsthelper->pipeline || gsthelper->paused)
+        return false;
+    if (gst_pipeline_viewers(gsthelper) == 0)
+        return false;
+    return !since || g_get_monotonic_time() - since < GST_BACKPRESSURE_PAUSE_MS * 1000;
+}
+
+/* Why the pipeline looks stuck, NULL while it is healthy or deliberately
+ * paused. Frames going in for stall_ms with nothing coming out of the
+ * encoder, appsrc full for as long, failing pushes or a posted error. */
+const char *gst_pipeline_stalled(struct gsthelper *gsthelper, int stall_ms) {
+    gint64 now = g_get_monotonic_time();
+    gint64 limit = (gint64)stall_ms * 1000;
+    gint64 full_since = gsthelper->enough_data_since;
+
+    if (!gsthelper->pipeline)
+        return "no pipeline";
+    if (gsthelper->paused)
+        return NULL;
+    if (gsthelper->failed)
+        return "pipeline error";
+    if (gsthelper->push_failures >= GST_STALL_PUSH_FAILURES)
+        return "pushes failing";
+    if (full_since && now - full_since > limit)
+        return "appsrc full";
+    if (gsthelper->encoder && gsthelper->last_push_us - gsthelper->last_output_us > limit)
+        return "no encoder output";
+    return NULL;
+}
+
+/* Cycles the pipeline through READY: queued data and streaming threads are
+ * dropped, encoders and sinks reopen their devices and sockets, elements
+ * and their settings stay. */
+int gst_pipeline_restart(struct gsthelper *gsthelper) {
+    GstStateChangeReturn ret = GST_STATE_CHANGE_FAILURE;
+
+    g_rec_mutex_lock(&gsthelper->lock);
+    if (gsthelper->pipeline && gst_element_set_state(gsthelper->pipeline, GST_STATE_READY) != GST_STATE_CHANGE_FAILURE) {
+        gsthelper->failed = false;
+        gsthelper->push_failures = 0;
+        gsthelper->enough_data_since = 0;
+        gsthelper->want_data = true;
+        gsthelper->last_output_us = g_get_monotonic_time();
+        ret = gst_element_set_state(gsthelper->pipeline, GST_STATE_PLAYING);
+    }
+    g_rec_mutex_unlock(&gsthelper->lock);
+
+    return ret == GST_STATE_CHANGE_FAILURE ? -1 : 0;
+}
+
+// A new pipeline from the same description, for the current resolution and format
+int gst_pipeline_rebuild(struct gsthelper *gsthelper) {
+    return gst_pipeline_init(gsthelper, gsthelper->width, gsthelper->height, gsthelper->refresh_rate, gsthelper->input);
 }
@@ -0,0 +1,369 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <thread>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include <control.h>
+#include <display.h>
+#include <gsthelper.h>
+#include <handoff.h>
+#include <input.h>
+#include <metrics.h>
+#include <replay.h>
+
+#define HANDOFF_VERSION 2
+#define HANDOFF_DRAIN_TIMEOUT_MS 1000
+#define HANDOFF_DONE_TIMEOUT_MS 10000
+// The predecessor sends between two producer messages, a stalled one is given up on
+#define HANDOFF_STATE_TIMEOUT_MS 5000
+
+// Slots of the handed over fds, present ones are sent in this order
+enum {
+    HANDOFF_FD_LISTEN,
+    HANDOFF_FD_PRODUCER,
+    HANDOFF_FD_INPUT, // INPUT_TOTAL slots
+    HANDOFF_FD_TOTAL = HANDOFF_FD_INPUT + INPUT_TOTAL
+};
+
+// Both sides run a build of this tree, the layout only has to match itself
+struct handoff_state {
+    uint32_t version;
+    uint32_t size;
+    uint32_t fd_mask; // bit i set when slot i was sent
+
+    int32_t width;
+    int32_t height;
+    int32_t refresh_rate;
+    uint64_t producer_connections;
+    uint8_t producer_can_pause;
+    uint8_t rendering_paused;
+
+    int32_t pointer_x;
+    int32_t pointer_y;
+    int32_t touch_id[MAX_TOUCHPOINTS];
+    struct touch_point touch_state[MAX_TOUCHPOINTS];
+    decltype(input::keysDown) keys_down;
+    struct gamepad_state gamepad;
+};
+
+struct handoff {
+    const char *path;
+    int listen_fd;
+    int wake_fds[2];
+    std::thread thread;
+
+    struct display *display;
+    struct input *input;
+};
+
+static struct handoff *handoff;
+
+static void run_handoff(struct handoff *handoff) {
+    struct pollfd fds[2] = {
+        {handoff->listen_fd, POLLIN, 0},
+        {handoff->wake_fds[0], POLLIN, 0},
+    };
+
+    while (true) {
+        if (poll(fds, 2, -1) < 0) {
+            if (errno == EINTR)
+                continue;
+            fprintf(stderr, "Handoff poll failed: %s\n", strerror(errno));
+            return;
+        }
+        if (fds[1].revents)
+            return;
+
+        int fd = accept4(handoff->listen_fd, NULL, NULL, SOCK_CLOEXEC);
+        int expected = -1;
+        if (fd < 0)
+            continue;
+
+        // The display thread owns the sockets, it hands them over between
+        // messages. Until it succeeded, and after it failed, keep accepting.
+        if (!handoff->display->requested_handoff.compare_exchange_strong(expected, fd)) {
+            fprintf(stderr, "Successor connected on %s while another one is taking over\n", handoff->path);
+            close(fd);
+            continue;
+        }
+        fprintf(stderr, "Successor connected on %s\n", handoff->path);
+        display_wake(handoff->display);
+    }
+}
+
+int handoff_start(const char *path, struct display *display, struct input *input) {
+    struct sockaddr_un addr;
+    int fd;
+
+    if (handoff)
+        return 0;
+
+    // Only display 0's sockets, FIFOs and state are part of struct handoff_state
+    if (display->output_count > 0) {
+        fprintf(stderr, "Handoff does not support secondary displays, not listening on %s\n", path);
+        return -1;
+    }
+
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "Handoff socket path too long: %s\n", path);
+        return -1;
+    }
+
+    fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0)
+        return -1;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+    unlink(path);
+
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(fd, 1) < 0) {
+        fprintf(stderr, "Failed to create handoff socket %s: %s\n", path, strerror(errno));
+        close(fd);
+        return -1;
+    }
+
+    handoff = new struct handoff();
+    handoff->path = path;
+    handoff->listen_fd = fd;
+    handoff->display = display;
+    handoff->input = input;
+    if (pipe2(handoff->wake_fds, O_CLOEXEC) < 0) {
+        close(fd);
+        delete handoff;
+        handoff = NULL;
+        return -1;
+    }
+    handoff->thread = std::thread(run_handoff, handoff);
+
+    fprintf(stderr, "Handoff socket on %s\n", path);
+    return 0;
+}
+
+void handoff_stop(void) {
+    if (!handoff)
+        return;
+
+    if (write(handoff->wake_fds[1], "q", 1) == 1)
+        handoff->thread.join();
+    else
+        handoff->thread.detach();
+
+    close(handoff->wake_fds[0]);
+    close(handoff->wake_fds[1]);
+    close(handoff->listen_fd);
+    unlink(handoff->path);
+    delete handoff;
+    handoff = NULL;
+}
+
+static int send_state(int sock, struct handoff_state *state, int *fds, int count) {
+    char control[CMSG_SPACE(sizeof(int) * HANDOFF_FD_TOTAL)];
+    struct iovec io = {state, sizeof(*state)};
+    struct msghdr msg;
+
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &io;
+    msg.msg_iovlen = 1;
+
+    if (count > 0) {
+        memset(control, 0, sizeof(control));
+        msg.msg_control = control;
+        msg.msg_controllen = CMSG_SPACE(sizeof(int) * count);
+
+        struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(int) * count);
+        memcpy(CMSG_DATA(cmsg), fds, sizeof(int) * count);
+    }
+
+    return sendmsg(sock, &msg, MSG_NOSIGNAL) == (ssize_t)sizeof(*state) ? 0 : -1;
+}
+
+int handoff_transfer(struct display *display, struct gsthelper *gsthelper) {
+    int sock = display->requested_handoff.exchange(-1);
+    struct handoff_state state;
+    struct input *input;
+    int fds[HANDOFF_FD_TOTAL];
+    int count = 0;
+
+    if (sock < 0 || !handoff)
+        return -1;
+    input = handoff->input;
+
+    memset(&state, 0, sizeof(state));
+    state.version = HANDOFF_VERSION;
+    state.size = sizeof(state);
+    state.width = display->width;
+    state.height = display->height;
+    state.refresh_rate = display->refresh_rate;
+    state.producer_connections = display->producer_connections;
+    state.producer_can_pause = display->producer_can_pause;
+    state.rendering_paused = display->rendering_paused;
+    // Sink threads may be writing events right now
+    pthread_mutex_lock(&input->lock);
+    state.pointer_x = input->ptrPrvX;
+    state.pointer_y = input->ptrPrvY;
+    memcpy(state.touch_id, input->touch_id, sizeof(state.touch_id));
+    memcpy(state.touch_state, input->touch_state, sizeof(state.touch_state));
+    state.keys_down = input->keysDown;
+    state.gamepad = input->gamepad;
+    pthread_mutex_unlock(&input->lock);
+
+    int slots[HANDOFF_FD_TOTAL] = {display->listen_sock, display->producer_sock};
+    for (int i = 0; i < INPUT_TOTAL; i++)
+        slots[HANDOFF_FD_INPUT + i] = input->input_fd[i];
+    for (int i = 0; i < HANDOFF_FD_TOTAL; i++) {
+        if (slots[i] < 0)
+            continue;
+        state.fd_mask |= 1u << i;
+        fds[count++] = slots[i];
+    }
+
+    if (send_state(sock, &state, fds, count) < 0) {
+        fprintf(stderr, "Handoff failed, keeping the session: %s\n", strerror(errno));
+        close(sock);
+        return -1;
+    }
+    fprintf(stderr, "Handed off %d fds, draining\n", count);
+
+    // Everything the successor binds on its own has to be released first,
+    // the control thread goes before the pipeline it changes
+    control_stop();
+    gst_pipeline_drain(gsthelper, HANDOFF_DRAIN_TIMEOUT_MS);
+    gst_pipeline_deinit(gsthelper);
+    replay_stop();
+    metrics_stop();
+    handoff_stop();
+
+    if (write(sock, "d", 1) != 1)
+        fprintf(stderr, "Successor went away during the handoff\n");
+    close(sock);
+    return 0;
+}
+
+static int connect_handoff(const char *path) {
+    struct sockaddr_un addr;
+    int fd;
+
+    if (strlen(path) >= sizeof(addr.sun_path))
+        return -1;
+
+    fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0)
+        return -1;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+static int receive_state(int sock, struct handoff_state *state, int *fds, int *count) {
+    char control[CMSG_SPACE(sizeof(int) * HANDOFF_FD_TOTAL)];
+    struct iovec io = {state, sizeof(*state)};
+    struct msghdr msg;
+    ssize_t n;
+
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &io;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+
+    struct timeval timeout = {HANDOFF_STATE_TIMEOUT_MS / 1000, HANDOFF_STATE_TIMEOUT_MS % 1000 * 1000};
+    setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    do {
+        n = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC | MSG_WAITALL);
+    } while (n < 0 && errno == EINTR);
+    if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+        fprintf(stderr, "Predecessor sent no state within %d ms, starting cold\n", HANDOFF_STATE_TIMEOUT_MS);
+        return -1;
+    }
+
+    *count = 0;
+    for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+        if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS)
+            continue;
+        *count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+        memcpy(fds, CMSG_DATA(cmsg), sizeof(int) * *count);
+    }
+
+    if (n != (ssize_t)sizeof(*state) || state->version != HANDOFF_VERSION || state->size != sizeof(*state) ||
+        __builtin_popcount(state->fd_mask) != *count) {
+        fprintf(stderr, "Handoff state from an incompatible streamer\n");
+        for (int i = 0; i < *count; i++)
+            close(fds[i]);
+        return -1;
+    }
+    return 0;
+}
+
+int handoff_takeover(const char *path, struct display *display, struct input *input) {
+    struct handoff_state state;
+    int fds[HANDOFF_FD_TOTAL];
+    int slots[HANDOFF_FD_TOTAL];
+    int sock, count, next = 0;
+    struct pollfd pfd;
+    char done;
+
+    sock = connect_handoff(path);
+    if (sock < 0) {
+        fprintf(stderr, "Nothing to take over on %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+    if (receive_state(sock, &state, fds, &count) < 0) {
+        close(sock);
+        return -1;
+    }
+
+    for (int i = 0; i < HANDOFF_FD_TOTAL; i++)
+        slots[i] = state.fd_mask & (1u << i) ? fds[next++] : -1;
+
+    display->width = state.width;
+    display->height = state.height;
+    display->refresh_rate = state.refresh_rate;
+    display->producer_connections = state.producer_connections;
+    display->producer_can_pause = state.producer_can_pause;
+    display->rendering_paused = state.rendering_paused;
+    display->listen_sock = slots[HANDOFF_FD_LISTEN];
+    display->producer_sock = slots[HANDOFF_FD_PRODUCER];
+
+    input->ptrPrvX = state.pointer_x;
+    input->ptrPrvY = state.pointer_y;
+    memcpy(input->touch_id, state.touch_id, sizeof(state.touch_id));
+    memcpy(input->touch_state, state.touch_state, sizeof(state.touch_state));
+    input->keysDown = state.keys_down;
+    input->gamepad = state.gamepad;
+    for (int i = 0; i < INPUT_TOTAL; i++) {
+        if (slots[HANDOFF_FD_INPUT + i] < 0)
+            continue;
+        if (input->input_fd[i] >= 0)
+            close(input->input_fd[i]);
+        input->input_fd[i] = slots[HANDOFF_FD_INPUT + i];
+    }
+
+    // The old pipeline still holds the sink, wait until it let go
+    pfd.fd = sock;
+    pfd.events = POLLIN;
+    if (poll(&pfd, 1, HANDOFF_DONE_TIMEOUT_MS) <= 0 || read(sock, &done, 1) != 1)
+        fprintf(stderr, "Predecessor did not confirm the handoff, continuing\n");
+    close(sock);
+
+    fprintf(stderr, "Took over %d fds from %s, %dx%d@%d, producer %s\n", count, path,
+            display->width, display->height, display->refresh_rate,
+            display->producer_sock >= 0 ? "connected" : "not connected");
+    return 0;
+}
@@ -0,0 +1,144 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <mutex>
+#include <linux/input.h>
+
+#include <input-record.h>
+
+#define RECORDER_BUFFER_SIZE (64 * 1024)
+#define RECORDER_FLUSH_INTERVAL_US 250000
+
+struct input_recorder {
+    int fd;
+    std::mutex lock;
+    size_t used;
+    uint64_t last_flush_us;
+    char buffer[RECORDER_BUFFER_SIZE];
+};
+
+static uint64_t monotonic_us(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void recorder_flush(struct input_recorder *recorder) {
+    size_t done = 0;
+
+    while (done < recorder->used) {
+        ssize_t res = write(recorder->fd, recorder->buffer + done, recorder->used - done);
+        if (res < 0) {
+            if (errno == EINTR)
+                continue;
+            fprintf(stderr, "Failed to write input recording: %s\n", strerror(errno));
+            break;
+        }
+        done += res;
+    }
+    recorder->used = 0;
+    recorder->last_flush_us = monotonic_us();
+}
+
+struct input_recorder *input_recorder_open(const char *path) {
+    struct input_record_header header;
+    struct input_recorder *recorder;
+
+    recorder = new input_recorder();
+    recorder->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (recorder->fd < 0) {
+        fprintf(stderr, "Failed to open input recording %s: %s\n", path, strerror(errno));
+        delete recorder;
+        return NULL;
+    }
+
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, INPUT_RECORD_MAGIC, sizeof(header.magic));
+    header.version = INPUT_RECORD_VERSION;
+    memcpy(recorder->buffer, &header, sizeof(header));
+    recorder->used = sizeof(header);
+    recorder_flush(recorder);
+
+    fprintf(stderr, "Recording input events to %s\n", path);
+    return recorder;
+}
+
+void input_recorder_write(struct input_recorder *recorder, int device, const struct input_event *events, unsigned int count) {
+    struct input_record_batch batch;
+    size_t size;
+
+    if (count == 0 || count > INPUT_RECORD_MAX_EVENTS)
+        return;
+
+    memset(&batch, 0, sizeof(batch));
+    batch.time_us = (uint64_t)events[0].time.tv_sec * 1000000 + events[0].time.tv_usec;
+    batch.device = device;
+    batch.count = count;
+    size = sizeof(batch) + count * sizeof(struct input_record_event);
+
+    std::lock_guard<std::mutex> guard(recorder->lock);
+
+    if (recorder->used + size > sizeof(recorder->buffer))
+        recorder_flush(recorder);
+
+    memcpy(recorder->buffer + recorder->used, &batch, sizeof(batch));
+    recorder->used += sizeof(batch);
+    for (unsigned int i = 0; i < count; i++) {
+        struct input_record_event event = {events[i].type, events[i].code, events[i].value};
+
+        memcpy(recorder->buffer + recorder->used, &event, sizeof(event));
+        recorder->used += sizeof(event);
+    }
+
+    if (batch.time_us - recorder->last_flush_us > RECORDER_FLUSH_INTERVAL_US)
+        recorder_flush(recorder);
+}
+
+void input_recorder_close(struct input_recorder *recorder) {
+    if (!recorder)
+        return;
+
+    recorder_flush(recorder);
+    close(recorder->fd);
+    delete recorder;
+}
+
+FILE *input_record_open(const char *path) {
+    struct input_record_header header;
+    FILE *file;
+
+    file = fopen(path, "rb");
+    if (!file) {
+        fprintf(stderr, "Failed to open input recording %s: %s\n", path, strerror(errno));
+        return NULL;
+    }
+
+    if (fread(&header, sizeof(header), 1, file) != 1 ||
+        memcmp(header.magic, INPUT_RECORD_MAGIC, sizeof(header.magic)) != 0 ||
+        header.version != INPUT_RECORD_VERSION) {
+        fprintf(stderr, "%s is not an input recording\n", path);
+        fclose(file);
+        return NULL;
+    }
+
+    return file;
+}
+
+/* Returns 1 when a batch was read, 0 at end of file and -1 on a truncated or
+ * corrupted recording. `events` must hold INPUT_RECORD_MAX_EVENTS entries. */
+int input_record_read(FILE *file, struct input_record_batch *batch, struct input_record_event *events) {
+    if (fread(batch, sizeof(*batch), 1, file) != 1)
+        return feof(file) ? 0 : -1;
+
+    if (batch->count == 0 || fread(events, sizeof(*events), batch->count, file) != batch->count) {
+        fprintf(stderr, "Truncated input recording\n");
+        return -1;
+    }
+
+    return 1;
+}
@@ -6,12 +6,18 @@
 #include <time.h>
 #include <string.h>
 #include <math.h>
+#include <signal.h>
+#include <algorithm>
 #include <linux/input.h>
 #include <sys/stat.h>
 #include <xkbcommon/xkbcommon.h>
 #include <linux/input-event-codes.h>
 
 #include <input.h>
+#include <input-record.h>
+#include <metrics.h>
+#include <trace.h>
+#include <uring.h>
 
 
 struct keysym_keycode_map {
@@ -125,6 +131,54 @@ uint32_t qwerty_lookup_keycode(uint32_t keysym) {
     return 0; // 0 indicates not found
 }
 
+uint32_t qwerty_lookup_keysym(uint32_t keycode) {
+    for (size_t i = 0; i < QWERTY_MAP_SIZE; i++) {
+        if (qwerty_map[i].keycode == keycode)
+            return qwerty_map[i].keysym;
+    }
+    return 0; // 0 indicates not found
+}
+
+/* Symbols that need shift held on a US qwerty layout. Upper case letters are
+ * covered by qwerty_map already and detected by keysym range. */
+struct keysym_keycode_map qwerty_shift_map[] = {
+    { XKB_KEY_exclam, KEY_1 },
+    { XKB_KEY_at, KEY_2 },
+    { XKB_KEY_numbersign, KEY_3 },
+    { XKB_KEY_dollar, KEY_4 },
+    { XKB_KEY_percent, KEY_5 },
+    { XKB_KEY_asciicircum, KEY_6 },
+    { XKB_KEY_ampersand, KEY_7 },
+    { XKB_KEY_asterisk, KEY_8 },
+    { XKB_KEY_parenleft, KEY_9 },
+    { XKB_KEY_parenright, KEY_0 },
+    { XKB_KEY_underscore, KEY_MINUS },
+    { XKB_KEY_plus, KEY_EQUAL },
+    { XKB_KEY_braceleft, KEY_LEFTBRACE },
+    { XKB_KEY_braceright, KEY_RIGHTBRACE },
+    { XKB_KEY_bar, KEY_BACKSLASH },
+    { XKB_KEY_colon, KEY_SEMICOLON },
+    { XKB_KEY_quotedbl, KEY_APOSTROPHE },
+    { XKB_KEY_asciitilde, KEY_GRAVE },
+    { XKB_KEY_less, KEY_COMMA },
+    { XKB_KEY_greater, KEY_DOT },
+    { XKB_KEY_question, KEY_SLASH }
+};
+
+#define QWERTY_SHIFT_MAP_SIZE (sizeof(qwerty_shift_map) / sizeof(qwerty_shift_map[0]))
+
+static uint32_t qwerty_lookup_text_keycode(uint32_t keysym, bool *shift) {
+    *shift = false;
+    for (size_t i = 0; i < QWERTY_SHIFT_MAP_SIZE; i++) {
+        if (qwerty_shift_map[i].keysym == keysym) {
+            *shift = true;
+            return qwerty_shift_map[i].keycode;
+        }
+    }
+    *shift = keysym >= XKB_KEY_A && keysym <= XKB_KEY_Z;
+    return qwerty_lookup_keycode(keysym);
+}
+
 struct keysym_keycode_map mouse_map[] = {
     { 1,  BTN_LEFT },
     { 2,  BTN_MIDDLE },
@@ -143,12 +197,63 @@ uint32_t mouse_lookup_keycode(uint32_t keysym) {
     return 0; // 0 indicates not found
 }
 
+uint32_t mouse_lookup_button(uint32_t keycode) {
+    for (size_t i = 0; i < MOUSE_MAP_SIZE; i++) {
+        if (mouse_map[i].keycode == keycode)
+            return mouse_map[i].keysym;
+    }
+    return 0; // 0 indicates not found
+}
+
+struct gamepad_axis_name {
+    const char *name;
+    uint32_t axis;
+};
+
+struct gamepad_axis_name gamepad_axis_map[] = {
+    { "x", ABS_X },
+    { "y", ABS_Y },
+    { "z", ABS_Z },
+    { "rx", ABS_RX },
+    { "ry", ABS_RY },
+    { "rz", ABS_RZ },
+    { "gas", ABS_GAS },
+    { "brake", ABS_BRAKE },
+    { "hat0x", ABS_HAT0X },
+    { "hat0y", ABS_HAT0Y }
+};
+
+#define GAMEPAD_AXIS_MAP_SIZE (sizeof(gamepad_axis_map) / sizeof(gamepad_axis_map[0]))
+
+int gamepad_lookup_axis(const char *name) {
+    for (size_t i = 0; i < GAMEPAD_AXIS_MAP_SIZE; i++) {
+        if (strcmp(gamepad_axis_map[i].name, name) == 0)
+            return gamepad_axis_map[i].axis;
+    }
+    return -1; // -1 indicates not found
+}
+
 static const char *INPUT_PIPE_NAME[INPUT_TOTAL] = {
     "/tmp/pd_touch_events",
     "/tmp/pd_keyboard_events",
-    "/tmp/pd_pointer_events"
+    "/tmp/pd_pointer_events",
+    "/tmp/pd_gamepad_events"
 };
 
+const char *input_pipe_name(int input_type) {
+    return INPUT_PIPE_NAME[input_type];
+}
+
+#define INPUT_RECONNECT_MIN_MS 10u
+#define INPUT_RECONNECT_MAX_MS 2000u
+
+#ifndef ARRAY_SIZE
+#define ARRAY_SIZE(a) (sizeof(a) / sizeof((a)[0]))
+#endif
+
+/* Keep text batches within PIPE_BUF so each write() is atomic. */
+#define INPUT_TEXT_BATCH_EVENTS (4096 / sizeof(struct input_event))
+
 #define ADD_EVENT(type_, code_, value_)            \
     event[n].time.tv_sec = rt.tv_sec;              \
     event[n].time.tv_usec = rt.tv_nsec / 1000;     \
@@ -157,63 +262,289 @@ static const char *INPUT_PIPE_NAME[INPUT_TOTAL] = {
     event[n].value = value_;                       \
     n++;
 
+// Display 0 keeps the plain names, others get their id appended
+static void create_pipe(struct input *input, int input_type) {
+    char *name = input->pipe_name[input_type];
+
+    if (input->display_id == 0)
+        snprintf(name, INPUT_PIPE_NAME_MAX, "%s", INPUT_PIPE_NAME[input_type]);
+    else
+        snprintf(name, INPUT_PIPE_NAME_MAX, "%s_%u", INPUT_PIPE_NAME[input_type], input->display_id);
+
+    input->input_fd[input_type] = -1;
+    mkfifo(name, S_IRWXO | S_IRWXG | S_IRWXU);
+    chown(name, 1000, 1000);
+}
+
 void init_input(struct input *input) {
+    // A reader going away must surface as EPIPE, not kill the streamer.
+    signal(SIGPIPE, SIG_IGN);
+    pthread_mutex_init(&input->lock, NULL);
+
     // Pointer
-    input->input_fd[INPUT_POINTER] = -1;
+    create_pipe(input, INPUT_POINTER);
     input->ptrPrvX = 0;
     input->ptrPrvY = 0;
     input->reverseScroll = true;
-    mkfifo(INPUT_PIPE_NAME[INPUT_POINTER], S_IRWXO | S_IRWXG | S_IRWXU);
-    chown(INPUT_PIPE_NAME[INPUT_POINTER], 1000, 1000);
 
     // Keyboard
-    input->input_fd[INPUT_KEYBOARD] = -1;
-    mkfifo(INPUT_PIPE_NAME[INPUT_KEYBOARD], S_IRWXO | S_IRWXG | S_IRWXU);
-    chown(INPUT_PIPE_NAME[INPUT_KEYBOARD], 1000, 1000);
+    create_pipe(input, INPUT_KEYBOARD);
 
     // Touch
-    input->input_fd[INPUT_TOUCH] = -1;
-    mkfifo(INPUT_PIPE_NAME[INPUT_TOUCH], S_IRWXO | S_IRWXG | S_IRWXU);
-    chown(INPUT_PIPE_NAME[INPUT_TOUCH], 1000, 1000);
+    create_pipe(input, INPUT_TOUCH);
     for (int i = 0; i < MAX_TOUCHPOINTS; i++) {
         input->touch_id[i] = -1;
     }
+
+    // Gamepad
+    create_pipe(input, INPUT_GAMEPAD);
+
+    input->recorder = NULL;
+    if (input->record_path)
+        input->recorder = input_recorder_open(input->record_path);
+
+    input->writer = NULL;
+    if (input->io_uring && !(input->writer = uring_writer_new()))
+        fprintf(stderr, "Writing input events directly\n");
 }
 
-static int ensure_pipe(struct input* input, int input_type) {
+// After the pipeline is gone, nothing delivers events any more
+void deinit_input(struct input *input) {
+    input_flush(input);
+    uring_writer_free(input->writer);
+    input->writer = NULL;
+
+    for (int i = 0; i < INPUT_TOTAL; i++) {
+        if (input->input_fd[i] != -1) {
+            close(input->input_fd[i]);
+            input->input_fd[i] = -1;
+        }
+    }
+
+    input_recorder_close(input->recorder);
+    input->recorder = NULL;
+    pthread_mutex_destroy(&input->lock);
+}
+
+static uint64_t monotonic_ms(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static void pipe_disconnected(struct input* input, int input_type) {
+    close(input->input_fd[input_type]);
+    input->input_fd[input_type] = -1;
+    input->pipe_state[input_type].retry_at_ms = 0;
+    input->pipe_state[input_type].backoff_ms = 0;
+    fprintf(stderr, "InputFlinger closed %s\n", input->pipe_name[input_type]);
+}
+
+static void update_latency(struct input_stats *stats, const struct input_event *event) {
+    struct timespec now;
+    uint64_t latency_us;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    latency_us = ((uint64_t)now.tv_sec * 1000000 + now.tv_nsec / 1000) -
+                 ((uint64_t)event->time.tv_sec * 1000000 + event->time.tv_usec);
+    stats->latency_us_total += latency_us;
+    stats->latency_us_max = std::max(stats->latency_us_max, latency_us);
+    metrics_observe_us(METRIC_INPUT_WRITE_LATENCY, latency_us);
+}
+
+static_assert(METRIC_INPUT_EVENTS_GAMEPAD - METRIC_INPUT_EVENTS_TOUCH == INPUT_GAMEPAD &&
+              METRIC_INPUT_FAILED_GAMEPAD - METRIC_INPUT_FAILED_TOUCH == INPUT_GAMEPAD,
+              "per device metrics must follow the INPUT_* order");
+
+static const char *INPUT_TRACE_NAME[INPUT_TOTAL] = {
+    "input_write touch",
+    "input_write keyboard",
+    "input_write pointer",
+    "input_write gamepad",
+};
+
+// res is what write() returned, or -errno
+static void write_done(struct input* input, int input_type, const struct input_event *event, unsigned int n,
+                       ssize_t res) {
+    struct input_pipe_state *state = &input->pipe_state[input_type];
+
+    if (res < (ssize_t)(n * sizeof(*event))) {
+        input->stats[input_type].failed++;
+        metrics_inc((enum metric_counter)(METRIC_INPUT_FAILED_TOUCH + input_type));
+        // Queued writes behind the first one fail the same way
+        if (res == -EPIPE && input->input_fd[input_type] != -1) {
+            pipe_disconnected(input, input_type);
+        } else if (res != -EPIPE && !state->write_blocked) {
+            // Only report the first failure until a write succeeds again.
+            fprintf(stderr, "Failed to write event for InputFlinger: %s\n", res < 0 ? strerror(-res) : "short write");
+            state->write_blocked = true;
+        }
+        return;
+    }
+    state->write_blocked = false;
+    input->stats[input_type].writes++;
+    input->stats[input_type].events += n;
+    update_latency(&input->stats[input_type], event);
+    metrics_add((enum metric_counter)(METRIC_INPUT_EVENTS_TOUCH + input_type), n);
+}
+
+static void queued_write_done(void *data, uint64_t tag, const void *buf, size_t len, ssize_t res) {
+    write_done((struct input *)data, tag, (const struct input_event *)buf, len / sizeof(struct input_event), res);
+}
+
+void input_flush(struct input *input) {
+    uint64_t trace_start_ns;
+
+    if (!input->writer)
+        return;
+    trace_start_ns = trace_begin();
+    uring_writer_flush(input->writer, queued_write_done, input);
+    trace_end("input_flush", trace_start_ns, 0);
+}
+
+static void write_pipe(struct input* input, int input_type, struct input_event *event, unsigned int n) {
+    uint64_t trace_start_ns;
+    ssize_t res;
+
+    if (input->writer && input->input_fd[input_type] != -1 &&
+        uring_writer_queue(input->writer, input->input_fd[input_type], event, n * sizeof(*event), input_type) == 0)
+        return;
+    // Out of slots or too large for one, what was queued goes first
+    input_flush(input);
+
     if (input->input_fd[input_type] == -1) {
-        input->input_fd[input_type] = open(INPUT_PIPE_NAME[input_type], O_WRONLY | O_NONBLOCK);
-        if (input->input_fd[input_type] == -1) {
-            fprintf(stderr, "Failed to open pipe to InputFlinger: %s\n", strerror(errno));
-            return -1;
+        input->stats[input_type].failed++;
+        metrics_inc((enum metric_counter)(METRIC_INPUT_FAILED_TOUCH + input_type));
+        return;
+    }
+
+    trace_start_ns = trace_begin();
+    res = write(input->input_fd[input_type], event, n * sizeof(*event));
+    trace_end(INPUT_TRACE_NAME[input_type], trace_start_ns, n);
+    write_done(input, input_type, event, n, res < 0 ? -errno : res);
+}
+
+static void write_events(struct input* input, int input_type, struct input_event *event, unsigned int n) {
+    if (input->recorder)
+        input_recorder_write(input->recorder, input_type, event, n);
+
+    write_pipe(input, input_type, event, n);
+}
+
+/* A new reader starts from a blank device, replay whatever is still held
+ * down so nothing gets stuck or lost across the reconnect. */
+static void replay_pipe_state(struct input* input, int input_type) {
+    struct input_event event[64];
+    struct timespec rt;
+    unsigned int n = 0;
+
+    clock_gettime(CLOCK_MONOTONIC, &rt);
+
+    switch (input_type) {
+    case INPUT_KEYBOARD:
+        for (size_t key = 0; key < input->keysDown.size(); key++) {
+            if (!input->keysDown[key])
+                continue;
+            if (n == ARRAY_SIZE(event) - 1) {
+                ADD_EVENT(EV_SYN, SYN_REPORT, 0);
+                write_pipe(input, input_type, event, n);
+                n = 0;
+            }
+            ADD_EVENT(EV_KEY, key, 1);
+        }
+        break;
+    case INPUT_TOUCH:
+        for (int i = 0; i < MAX_TOUCHPOINTS; i++) {
+            if (input->touch_id[i] == -1)
+                continue;
+            ADD_EVENT(EV_ABS, ABS_MT_SLOT, i);
+            ADD_EVENT(EV_ABS, ABS_MT_TRACKING_ID, i);
+            ADD_EVENT(EV_ABS, ABS_MT_POSITION_X, input->touch_state[i].x);
+            ADD_EVENT(EV_ABS, ABS_MT_POSITION_Y, input->touch_state[i].y);
+            ADD_EVENT(EV_ABS, ABS_MT_PRESSURE, input->touch_state[i].pressure);
         }
+        break;
+    case INPUT_POINTER:
+        ADD_EVENT(EV_ABS, ABS_X, input->ptrPrvX);
+        ADD_EVENT(EV_ABS, ABS_Y, input->ptrPrvY);
+        break;
+    case INPUT_GAMEPAD:
+        // Only what was already sent, staged changes go out with the next frame.
+        for (int i = 0; i < GAMEPAD_BUTTON_COUNT; i++) {
+            if (input->gamepad.buttons_sent & (1u << i)) {
+                ADD_EVENT(EV_KEY, BTN_GAMEPAD + i, 1);
+            }
+        }
+        for (int i = 0; i < GAMEPAD_AXIS_COUNT && n < ARRAY_SIZE(event) - 1; i++) {
+            if (input->gamepad.axis_sent[i]) {
+                ADD_EVENT(EV_ABS, i, input->gamepad.axis_sent[i]);
+            }
+        }
+        break;
+    }
+
+    if (n == 0)
+        return;
+    ADD_EVENT(EV_SYN, SYN_REPORT, 0);
+    write_pipe(input, input_type, event, n);
+}
+
+/*
+ * Opens the FIFO when a reader is present. While it is absent, reopen
+ * attempts back off exponentially so an event storm does not turn into an
+ * open() and log storm. Handlers keep tracking their state even when this
+ * fails, the latest state is replayed once the reader comes back.
+ */
+static int ensure_pipe(struct input* input, int input_type) {
+    struct input_pipe_state *state = &input->pipe_state[input_type];
+    uint64_t now;
+
+    if (input->input_fd[input_type] != -1)
+        return 0;
+
+    now = monotonic_ms();
+    if (now < state->retry_at_ms)
+        return -1;
+
+    input->input_fd[input_type] = open(input->pipe_name[input_type], O_WRONLY | O_NONBLOCK | O_CLOEXEC);
+    if (input->input_fd[input_type] == -1) {
+        if (state->backoff_ms == 0)
+            fprintf(stderr, "Failed to open pipe to InputFlinger: %s, retrying in background\n", strerror(errno));
+        state->backoff_ms = state->backoff_ms ? std::min(state->backoff_ms * 2, INPUT_RECONNECT_MAX_MS) : INPUT_RECONNECT_MIN_MS;
+        state->retry_at_ms = now + state->backoff_ms;
+        return -1;
     }
+
+    if (state->backoff_ms)
+        fprintf(stderr, "InputFlinger opened %s\n", input->pipe_name[input_type]);
+    state->backoff_ms = 0;
+    state->retry_at_ms = 0;
+    state->write_blocked = false;
+    replay_pipe_state(input, input_type);
     return 0;
 }
 
 static void send_key_event(struct input* input, uint32_t key, uint32_t state) {
     struct input_event event[1];
     struct timespec rt;
-    unsigned int res, n = 0;
+    unsigned int n = 0;
 
     if (key >= input->keysDown.size()) {
         fprintf(stderr, "Invalid key: %u\n", key);
         return;
     }
 
-    if (ensure_pipe(input, INPUT_KEYBOARD))
-        return;
+    ensure_pipe(input, INPUT_KEYBOARD);
 
     if (clock_gettime(CLOCK_MONOTONIC, &rt) == -1) {
         fprintf(stderr, "%s:%d error in touch clock_gettime: %s",
               __FILE__, __LINE__, strerror(errno));
     }
     ADD_EVENT(EV_KEY, key, state);
-
-    res = write(input->input_fd[INPUT_KEYBOARD], &event, sizeof(event));
-    if (res < sizeof(event))
-        fprintf(stderr, "Failed to write event for InputFlinger: %s", strerror(errno));
     input->keysDown[(uint8_t)key] = state;
+
+    write_events(input, INPUT_KEYBOARD, event, n);
 }
 
 void keyboard_handle_key(struct input* input, uint32_t key, uint32_t state) {
@@ -225,6 +556,150 @@ void keyboard_handle_key(struct input* input, uint32_t key, uint32_t state) {
     send_key_event(input, keycode, state);
 }
 
+/* Decodes one UTF-8 sequence, returns its length or 0 when malformed. */
+static size_t utf8_decode(const unsigned char *text, uint32_t *codepoint) {
+    size_t len, i;
+
+    if (text[0] < 0x80) {
+        *codepoint = text[0];
+        return 1;
+    } else if ((text[0] & 0xe0) == 0xc0) {
+        *codepoint = text[0] & 0x1f;
+        len = 2;
+    } else if ((text[0] & 0xf0) == 0xe0) {
+        *codepoint = text[0] & 0x0f;
+        len = 3;
+    } else if ((text[0] & 0xf8) == 0xf0) {
+        *codepoint = text[0] & 0x07;
+        len = 4;
+    } else {
+        return 0;
+    }
+
+    for (i = 1; i < len; i++) {
+        if ((text[i] & 0xc0) != 0x80)
+            return 0;
+        *codepoint = (*codepoint << 6) | (text[i] & 0x3f);
+    }
+    return len;
+}
+
+// Returns false when the batch did not make it into the FIFO
+static bool flush_text_batch(struct input* input, struct input_event *event, unsigned int n) {
+    uint64_t failed = input->stats[INPUT_KEYBOARD].failed;
+
+    if (n == 0)
+        return true;
+
+    write_events(input, INPUT_KEYBOARD, event, n);
+    input_flush(input);
+    return input->stats[INPUT_KEYBOARD].failed == failed;
+}
+
+/*
+ * Types a UTF-8 string as press/release sequences through the qwerty keymap,
+ * pressing shift where the layout needs it. Each key transition is its own
+ * SYN frame, frames are batched into as few FIFO writes as possible.
+ * Characters without a key on the layout are skipped. The caller is a
+ * GStreamer thread, so a full FIFO is not waited on: the batch that did not
+ * fit and the rest of the text are dropped and counted.
+ */
+void keyboard_handle_text(struct input* input, const char *text) {
+    struct input_event event[INPUT_TEXT_BATCH_EVENTS];
+    const unsigned char *p = (const unsigned char *)text;
+    const unsigned char *batch_start = p;
+    struct timespec rt;
+    unsigned int n = 0;
+    bool held_left = input->keysDown[KEY_LEFTSHIFT], held_right = input->keysDown[KEY_RIGHTSHIFT];
+    // Shift as written into event[], and as the reader has it after the last batch
+    bool left = held_left, right = held_right;
+    bool left_sent = left, right_sent = right, sent = true;
+    size_t skipped = 0, dropped = 0;
+
+    ensure_pipe(input, INPUT_KEYBOARD);
+
+    if (clock_gettime(CLOCK_MONOTONIC, &rt) == -1) {
+        fprintf(stderr, "%s:%d error in text clock_gettime: %s",
+              __FILE__, __LINE__, strerror(errno));
+    }
+
+    // A shift the client holds would turn lowercase text uppercase, it is
+    // lifted while typing and pressed again afterwards.
+    if (right) {
+        ADD_EVENT(EV_KEY, KEY_RIGHTSHIFT, 0);
+        ADD_EVENT(EV_SYN, SYN_REPORT, 0);
+        right = false;
+    }
+
+    while (*p) {
+        const unsigned char *start = p;
+        uint32_t codepoint, keysym, keycode;
+        bool shift;
+        size_t len = utf8_decode(p, &codepoint);
+
+        if (len == 0) {
+            p++;
+            skipped++;
+            continue;
+        }
+        p += len;
+
+        if (codepoint == '\n' || codepoint == '\r')
+            keysym = XKB_KEY_Return;
+        else
+            keysym = xkb_utf32_to_keysym(codepoint);
+
+        keycode = qwerty_lookup_text_keycode(keysym, &shift);
+        if (keycode == 0) {
+            skipped++;
+            continue;
+        }
+
+        // Worst case per character: shift change, press, release, restoring both shifts.
+        if (n + 10 > INPUT_TEXT_BATCH_EVENTS) {
+            if (!flush_text_batch(input, event, n)) {
+                sent = false;
+                n = 0;
+                left = left_sent;
+                right = right_sent;
+                break;
+            }
+            n = 0;
+            left_sent = left;
+            right_sent = right;
+            batch_start = start;
+        }
+
+        if (shift != left) {
+            ADD_EVENT(EV_KEY, KEY_LEFTSHIFT, shift);
+            ADD_EVENT(EV_SYN, SYN_REPORT, 0);
+            left = shift;
+        }
+        ADD_EVENT(EV_KEY, keycode, 1);
+        ADD_EVENT(EV_SYN, SYN_REPORT, 0);
+        ADD_EVENT(EV_KEY, keycode, 0);
+        ADD_EVENT(EV_SYN, SYN_REPORT, 0);
+    }
+
+    // Even after a drop, the reader ends up with the shifts the client holds
+    if (left != held_left) {
+        ADD_EVENT(EV_KEY, KEY_LEFTSHIFT, held_left);
+        ADD_EVENT(EV_SYN, SYN_REPORT, 0);
+    }
+    if (right != held_right) {
+        ADD_EVENT(EV_KEY, KEY_RIGHTSHIFT, held_right);
+        ADD_EVENT(EV_SYN, SYN_REPORT, 0);
+    }
+    if (!flush_text_batch(input, event, n) || !sent) {
+        for (; *batch_start; batch_start++)
+            dropped += (*batch_start & 0xc0) != 0x80;
+        metrics_add(METRIC_INPUT_TEXT_DROPPED, dropped);
+        fprintf(stderr, "Dropped %zu characters of text, the keyboard FIFO is full\n", dropped);
+    }
+    if (skipped)
+        fprintf(stderr, "Skipped %zu characters without a key in the qwerty map\n", skipped);
+}
+
 static int get_touch_id(struct input *input, int id) {
     int i = 0;
     for (i = 0; i < MAX_TOUCHPOINTS; i++) {
@@ -254,11 +729,10 @@ void touch_handle_down(struct input* input,
           int32_t id, double x_w, double y_w, double pressure) {
     struct input_event event[6];
     struct timespec rt;
-    int x, y;
-    unsigned int res, n = 0;
+    int x, y, slot;
+    unsigned int n = 0;
 
-    if (ensure_pipe(input, INPUT_TOUCH))
-        return;
+    ensure_pipe(input, INPUT_TOUCH);
 
     if (clock_gettime(CLOCK_MONOTONIC, &rt) == -1) {
        fprintf(stderr, "%s:%d error in touch clock_gettime: %s",
@@ -266,26 +740,26 @@ void touch_handle_down(struct input* input,
     }
     x = (int)x_w;
     y = (int)y_w;
+    slot = get_touch_id(input, id);
+    if (slot >= 0)
+        input->touch_state[slot] = {x, y, (int)pressure};
 
-    ADD_EVENT(EV_ABS, ABS_MT_SLOT, get_touch_id(input, id));
-    ADD_EVENT(EV_ABS, ABS_MT_TRACKING_ID, get_touch_id(input, id));
+    ADD_EVENT(EV_ABS, ABS_MT_SLOT, slot);
+    ADD_EVENT(EV_ABS, ABS_MT_TRACKING_ID, slot);
     ADD_EVENT(EV_ABS, ABS_MT_POSITION_X, x);
     ADD_EVENT(EV_ABS, ABS_MT_POSITION_Y, y);
     ADD_EVENT(EV_ABS, ABS_MT_PRESSURE, (int)pressure);
     ADD_EVENT(EV_SYN, SYN_REPORT, 0);
 
-    res = write(input->input_fd[INPUT_TOUCH], &event, sizeof(event));
-    if (res < sizeof(event))
-        fprintf(stderr, "Failed to write event for InputFlinger: %s", strerror(errno));
+    write_events(input, INPUT_TOUCH, event, n);
 }
 
 void touch_handle_up(struct input* input, int32_t id) {
     struct input_event event[3];
     struct timespec rt;
-    unsigned int res, n = 0;
+    unsigned int n = 0;
 
-    if (ensure_pipe(input, INPUT_TOUCH))
-        return;
+    ensure_pipe(input, INPUT_TOUCH);
 
     if (clock_gettime(CLOCK_MONOTONIC, &rt) == -1) {
        fprintf(stderr, "%s:%d error in touch clock_gettime: %s",
@@ -296,19 +770,16 @@ void touch_handle_up(struct input* input, int32_t id) {
     ADD_EVENT(EV_ABS, ABS_MT_TRACKING_ID, -1);
     ADD_EVENT(EV_SYN, SYN_REPORT, 0);
 
-    res = write(input->input_fd[INPUT_TOUCH], &event, sizeof(event));
-    if (res < sizeof(event))
-        fprintf(stderr, "Failed to write event for InputFlinger: %s", strerror(errno));
+    write_events(input, INPUT_TOUCH, event, n);
 }
 
 void touch_handle_motion(struct input* input, int32_t id, double x_w, double y_w, double pressure) {
     struct input_event event[6];
     struct timespec rt;
-    int x, y;
-    unsigned int res, n = 0;
+    int x, y, slot;
+    unsigned int n = 0;
 
-    if (ensure_pipe(input, INPUT_TOUCH))
-        return;
+    ensure_pipe(input, INPUT_TOUCH);
 
     if (clock_gettime(CLOCK_MONOTONIC, &rt) == -1) {
        fprintf(stderr, "%s:%d error in touch clock_gettime: %s",
@@ -316,27 +787,27 @@ void touch_handle_motion(struct input* input, int32_t id, double x_w, double y_w
     }
     x = (int)x_w;
     y = (int)y_w;
+    slot = get_touch_id(input, id);
+    if (slot >= 0)
+        input->touch_state[slot] = {x, y, (int)pressure};
 
-    ADD_EVENT(EV_ABS, ABS_MT_SLOT, get_touch_id(input, id));
-    ADD_EVENT(EV_ABS, ABS_MT_TRACKING_ID, get_touch_id(input, id));
+    ADD_EVENT(EV_ABS, ABS_MT_SLOT, slot);
+    ADD_EVENT(EV_ABS, ABS_MT_TRACKING_ID, slot);
     ADD_EVENT(EV_ABS, ABS_MT_POSITION_X, x);
     ADD_EVENT(EV_ABS, ABS_MT_POSITION_Y, y);
     ADD_EVENT(EV_ABS, ABS_MT_PRESSURE, (int)pressure);
     ADD_EVENT(EV_SYN, SYN_REPORT, 0);
 
-    res = write(input->input_fd[INPUT_TOUCH], &event, sizeof(event));
-    if (res < sizeof(event))
-        fprintf(stderr, "Failed to write event for InputFlinger: %s", strerror(errno));
+    write_events(input, INPUT_TOUCH, event, n);
 }
 
 void touch_handle_cancel(struct input* input) {
     struct input_event event[6];
     struct timespec rt;
-    unsigned int res, n;
+    unsigned int n;
     int i;
 
-    if (ensure_pipe(input, INPUT_TOUCH))
-        return;
+    ensure_pipe(input, INPUT_TOUCH);
 
     if (clock_gettime(CLOCK_MONOTONIC, &rt) == -1) {
        fprintf(stderr, "%s:%d error in touch clock_gettime: %s",
@@ -358,9 +829,7 @@ void touch_handle_cancel(struct input* input) {
             ADD_EVENT(EV_ABS, ABS_MT_TRACKING_ID, -1);
             ADD_EVENT(EV_SYN, SYN_REPORT, 0);
 
-            res = write(input->input_fd[INPUT_TOUCH], &event, sizeof(event));
-            if (res < sizeof(event))
-                fprintf(stderr, "Failed to write event for InputFlinger: %s", strerror(errno));
+            write_events(input, INPUT_TOUCH, event, n);
         }
     }
 }
@@ -369,10 +838,9 @@ void pointer_handle_motion(struct input* input, double sx, double sy) {
     struct input_event event[5];
     struct timespec rt;
     int x, y;
-    unsigned int res, n = 0;
+    unsigned int n = 0;
 
-    if (ensure_pipe(input, INPUT_POINTER))
-        return;
+    ensure_pipe(input, INPUT_POINTER);
 
     if (clock_gettime(CLOCK_MONOTONIC, &rt) == -1) {
         fprintf(stderr, "%s:%d error in touch clock_gettime: %s",
@@ -389,18 +857,15 @@ void pointer_handle_motion(struct input* input, double sx, double sy) {
     input->ptrPrvX = x;
     input->ptrPrvY = y;
 
-    res = write(input->input_fd[INPUT_POINTER], &event, sizeof(event));
-    if (res < sizeof(event))
-        fprintf(stderr, "Failed to write event for InputFlinger: %s", strerror(errno));
+    write_events(input, INPUT_POINTER, event, n);
 }
 
 void pointer_handle_button(struct input* input, uint32_t button, uint32_t state) {
     struct input_event event[2];
     struct timespec rt;
-    unsigned int res, n = 0;
+    unsigned int n = 0;
 
-    if (ensure_pipe(input, INPUT_POINTER))
-        return;
+    ensure_pipe(input, INPUT_POINTER);
 
     if (clock_gettime(CLOCK_MONOTONIC, &rt) == -1) {
         fprintf(stderr, "%s:%d error in touch clock_gettime: %s",
@@ -409,20 +874,17 @@ void pointer_handle_button(struct input* input, uint32_t button, uint32_t state)
     ADD_EVENT(EV_KEY, mouse_lookup_keycode(button), state);
     ADD_EVENT(EV_SYN, SYN_REPORT, 0);
 
-    res = write(input->input_fd[INPUT_POINTER], &event, sizeof(event));
-    if (res < sizeof(event))
-        fprintf(stderr, "Failed to write event for InputFlinger: %s", strerror(errno));
+    write_events(input, INPUT_POINTER, event, n);
 }
 
 void pointer_handle_axis(struct input* input, uint32_t axis, double value) {
     struct input_event event[2];
     struct timespec rt;
-    unsigned int res, move, n = 0;
+    unsigned int move, n = 0;
     double fVal = value / 100.0f;
     double step = 1.0f;
 
-    if (ensure_pipe(input, INPUT_POINTER))
-        return;
+    ensure_pipe(input, INPUT_POINTER);
 
     if (!input->reverseScroll) {
         fVal = -fVal;
@@ -451,7 +913,77 @@ void pointer_handle_axis(struct input* input, uint32_t axis, double value) {
               ? REL_WHEEL : REL_HWHEEL, move);
     ADD_EVENT(EV_SYN, SYN_REPORT, 0);
 
-    res = write(input->input_fd[INPUT_POINTER], &event, sizeof(event));
-    if (res < sizeof(event))
-        fprintf(stderr, "Failed to write event for InputFlinger: %s", strerror(errno));
+    write_events(input, INPUT_POINTER, event, n);
+}
+
+void gamepad_handle_axis(struct input* input, uint32_t axis, int32_t value) {
+    struct gamepad_state *gamepad = &input->gamepad;
+
+    if (axis >= GAMEPAD_AXIS_COUNT) {
+        fprintf(stderr, "Invalid gamepad axis: %u\n", axis);
+        return;
+    }
+
+    gamepad->axis[axis] = value;
+    if (value != gamepad->axis_sent[axis])
+        gamepad->axis_dirty |= 1ull << axis;
+    else
+        gamepad->axis_dirty &= ~(1ull << axis);
+}
+
+void gamepad_handle_button(struct input* input, uint32_t button, uint32_t state) {
+    if (button < BTN_GAMEPAD || button >= BTN_GAMEPAD + GAMEPAD_BUTTON_COUNT) {
+        fprintf(stderr, "Invalid gamepad button: %u\n", button);
+        return;
+    }
+
+    if (state)
+        input->gamepad.buttons |= 1u << (button - BTN_GAMEPAD);
+    else
+        input->gamepad.buttons &= ~(1u << (button - BTN_GAMEPAD));
+}
+
+/*
+ * Emits everything staged by gamepad_handle_axis/button since the previous
+ * frame as one SYN frame. Axes and buttons that did not change are left out,
+ * and nothing is written when nothing changed, so clients can push their
+ * full pad state at polling rate without flooding the FIFO. The staging and
+ * this call belong under one hold of input->lock: the sink and the control
+ * socket share the pad, and a frame staged in part by one of them would go
+ * out with the other's values.
+ */
+void gamepad_handle_frame(struct input* input) {
+    struct gamepad_state *gamepad = &input->gamepad;
+    struct input_event event[GAMEPAD_AXIS_COUNT + GAMEPAD_BUTTON_COUNT + 1];
+    struct timespec rt;
+    uint32_t buttons_changed;
+    unsigned int n = 0;
+
+    buttons_changed = gamepad->buttons ^ gamepad->buttons_sent;
+    if (!gamepad->axis_dirty && !buttons_changed)
+        return;
+
+    ensure_pipe(input, INPUT_GAMEPAD);
+
+    if (clock_gettime(CLOCK_MONOTONIC, &rt) == -1) {
+        fprintf(stderr, "%s:%d error in gamepad clock_gettime: %s",
+              __FILE__, __LINE__, strerror(errno));
+    }
+
+    for (int i = 0; i < GAMEPAD_BUTTON_COUNT; i++) {
+        if (buttons_changed & (1u << i)) {
+            ADD_EVENT(EV_KEY, BTN_GAMEPAD + i, !!(gamepad->buttons & (1u << i)));
+        }
+    }
+    for (int i = 0; i < GAMEPAD_AXIS_COUNT; i++) {
+        if (gamepad->axis_dirty & (1ull << i)) {
+            ADD_EVENT(EV_ABS, i, gamepad->axis[i]);
+            gamepad->axis_sent[i] = gamepad->axis[i];
+        }
+    }
+    ADD_EVENT(EV_SYN, SYN_REPORT, 0);
+    gamepad->axis_dirty = 0;
+    gamepad->buttons_sent = gamepad->buttons;
+
+    write_events(input, INPUT_GAMEPAD, event, n);
 }
@@ -1,11 +1,20 @@
 #include <cstdio>
 #include <cstdlib>
+#include <cstring>
 #include <thread>
 #include <getopt.h>
 
+#include <control.h>
 #include <display.h>
 #include <gsthelper.h>
+#include <handoff.h>
 #include <input.h>
+#include <metrics.h>
+#include <replay.h>
+#include <snapshot.h>
+#include <thread-sched.h>
+#include <trace.h>
+#include <watchdog.h>
 
 #define QUOTE(str) #str
 #define EXPAND_AND_QUOTE(str) QUOTE(str)
@@ -15,6 +24,13 @@ struct playdroid {
     struct gsthelper *gsthelper;
     struct input *input;
 
+    const char *metrics_endpoint;
+    const char *trace_path;
+    const char *control_path;
+    const char *handoff_path;
+    const char *takeover_path;
+    const char *replay_spec;
+    const char *snapshot_spec;
 };
 
 static void print_usage_and_exit(void) {
@@ -29,9 +45,41 @@ static void print_usage_and_exit(void) {
            "\n\t\trefresh rate of display, default is %d\n"
            "\t'-l,--gst-pipeline=<>'"
            "\n\t\tCustom GST pipeline, default is wayland\n"
+           "\t'-C,--codec=<>'"
+           "\n\t\tCodec of the default pipeline: h264, h265, vp8, vp9 or av1, default is the fastest available\n"
            "\t'-a,--wayland-window'"
-           "\n\t\tOpen Real wayland window\n",
-           DISPLAY_SOCKET_PATH, DISPLAY_WIDTH, DISPLAY_HEIGHT, DISPLAY_REFRESH_RATE);
+           "\n\t\tOpen Real wayland window\n"
+           "\t'-p,--preview'"
+           "\n\t\tStream and open a wayland preview window\n"
+           "\t'-i,--input-record=<>'"
+           "\n\t\tRecord injected input events to file\n"
+           "\t'-m,--metrics=<>'"
+           "\n\t\tServe Prometheus metrics on a unix socket path or tcp:<port> on loopback\n"
+           "\t'-t,--trace=<>'"
+           "\n\t\tRecord a frame timeline, written as Chrome trace JSON to file on SIGUSR1 and exit\n"
+           "\t'-c,--control=<>'"
+           "\n\t\tControl socket path for runtime changes (bitrate, gop, fps, keyframe, pause, preview, stats)\n"
+           "\t'-S,--sched=<stage>:<setting>[:<setting>...]'"
+           "\n\t\tPin and prioritize the display, input, streaming or encoder threads,\n"
+           "\t\tsettings are cpus=<list>, fifo=<prio>, rr=<prio> or nice=<n>, repeatable\n"
+           "\t'-H,--handoff=<>'"
+           "\n\t\tSocket path a newer streamer connects to with --takeover to continue this session\n"
+           "\t'-T,--takeover=<>'"
+           "\n\t\tTake the producer, input and session state over from the streamer on this path\n"
+           "\t'-R,--replay=<dir>[:<MB>]'"
+           "\n\t\tKeep the encoded stream in a ring of segment files in dir, default %d MB,\n"
+           "\t\tdumped with the control socket's replay command\n"
+           "\t'-P,--snapshot=<width>[:<seconds>][:jpeg|webp]'"
+           "\n\t\tServe still images of the session on the control socket, default %d px wide,\n"
+           "\t\trefreshed every <seconds> or on request\n"
+           "\t'-W,--watchdog=<ms>'"
+           "\n\t\tRestart or rebuild the pipeline when it errors or stalls for this long\n"
+           "\t'-V,--virtual-display=<id>:<width>x<height>[@<fps>][:<pipeline>]'"
+           "\n\t\tStream the producer's display <id> too, with its own pipeline and input pipes, repeatable\n"
+           "\t'-U,--io=poll|uring'"
+           "\n\t\tReceive producer messages and write input events with io_uring, default is poll\n",
+           DISPLAY_SOCKET_PATH, DISPLAY_WIDTH, DISPLAY_HEIGHT, DISPLAY_REFRESH_RATE, REPLAY_DEFAULT_SIZE_MB,
+           SNAPSHOT_DEFAULT_WIDTH);
     exit(0);
 }
 
@@ -44,11 +92,25 @@ void parse_args(int argc, char **argv, struct playdroid *playdroid) {
         {"height", required_argument, 0, 'y'},
         {"refresh-rate", required_argument, 0, 'r'},
         {"gst-pipeline", required_argument, 0, 'l'},
+        {"codec", required_argument, 0, 'C'},
         {"wayland-window", no_argument, 0, 'a'},
+        {"preview", no_argument, 0, 'p'},
+        {"input-record", required_argument, 0, 'i'},
+        {"metrics", required_argument, 0, 'm'},
+        {"trace", required_argument, 0, 't'},
+        {"control", required_argument, 0, 'c'},
+        {"sched", required_argument, 0, 'S'},
+        {"handoff", required_argument, 0, 'H'},
+        {"takeover", required_argument, 0, 'T'},
+        {"replay", required_argument, 0, 'R'},
+        {"snapshot", required_argument, 0, 'P'},
+        {"watchdog", required_argument, 0, 'W'},
+        {"virtual-display", required_argument, 0, 'V'},
+        {"io", required_argument, 0, 'U'},
         {"help", no_argument, 0, 'h'},
         {0, 0, 0, 0}};
 
-    while ((c = getopt_long(argc, argv, "hs:w:y:r:l:a",
+    while ((c = getopt_long(argc, argv, "hs:w:y:r:l:C:api:m:t:c:S:H:T:R:P:W:V:U:",
                             long_options, &option_index)) != -1) {
         switch (c) {
         case 's':
@@ -70,9 +132,60 @@ void parse_args(int argc, char **argv, struct playdroid *playdroid) {
         case 'l':
             playdroid->gsthelper->gst_pipeline = optarg;
             break;
+        case 'C':
+            playdroid->gsthelper->codec = optarg;
+            break;
         case 'a':
             playdroid->display->open_wayland_window = true;
             break;
+        case 'p':
+            playdroid->display->open_wayland_window = true;
+            playdroid->display->stream_with_preview = true;
+            break;
+        case 'i':
+            playdroid->input->record_path = optarg;
+            break;
+        case 'm':
+            playdroid->metrics_endpoint = optarg;
+            break;
+        case 't':
+            playdroid->trace_path = optarg;
+            break;
+        case 'c':
+            playdroid->control_path = optarg;
+            break;
+        case 'S':
+            if (sched_parse(optarg) < 0)
+                exit(1);
+            break;
+        case 'H':
+            playdroid->handoff_path = optarg;
+            break;
+        case 'T':
+            playdroid->takeover_path = optarg;
+            break;
+        case 'R':
+            playdroid->replay_spec = optarg;
+            break;
+        case 'P':
+            playdroid->snapshot_spec = optarg;
+            break;
+        case 'W':
+            if (watchdog_start(strtol(optarg, NULL, 10)) < 0)
+                exit(1);
+            break;
+        case 'V':
+            if (display_add_output(playdroid->display, optarg) < 0)
+                exit(1);
+            break;
+        case 'U':
+            if (strcmp(optarg, "uring") && strcmp(optarg, "poll")) {
+                fprintf(stderr, "Unknown io backend %s\n", optarg);
+                exit(1);
+            }
+            playdroid->display->io_uring = !strcmp(optarg, "uring");
+            playdroid->input->io_uring = playdroid->display->io_uring;
+            break;
         default:
             print_usage_and_exit();
         }
@@ -95,6 +208,7 @@ int main(int argc, char **argv) {
     if (playdroid->gsthelper == NULL) {
         fprintf(stderr, "out of memory\n");
     }
+    g_rec_mutex_init(&playdroid->gsthelper->lock);
     playdroid->input = (struct input *)calloc(1, sizeof *playdroid->input);
     if (playdroid->input == NULL) {
         fprintf(stderr, "out of memory\n");
@@ -106,18 +220,66 @@ int main(int argc, char **argv) {
     // Set up the Input Event Handlers
     init_input(playdroid->input);
 
-    if (!playdroid->display->open_wayland_window) {
+    // Before anything binds, the predecessor still holds the endpoints
+    if (playdroid->takeover_path)
+        handoff_takeover(playdroid->takeover_path, playdroid->display, playdroid->input);
+
+    if (playdroid->metrics_endpoint)
+        metrics_start(playdroid->metrics_endpoint);
+    // Before the pipeline is built, encoder probes are only added when tracing or recording
+    if (playdroid->trace_path)
+        trace_start(playdroid->trace_path);
+    if (playdroid->replay_spec && replay_start(playdroid->replay_spec) < 0)
+        exit(1);
+    if (playdroid->snapshot_spec && snapshot_start(playdroid->snapshot_spec) < 0)
+        exit(1);
+    sched_start();
+
+    if (!playdroid->display->open_wayland_window || playdroid->display->stream_with_preview) {
         gst_pipeline_deinit(playdroid->gsthelper);
         gst_pipeline_init(playdroid->gsthelper, playdroid->display->width, playdroid->display->height, 
             playdroid->display->refresh_rate, playdroid->input);
     }
+    // Secondary displays have no preview, they always stream
+    for (int i = 0; i < playdroid->display->output_count; i++) {
+        struct display_output *output = &playdroid->display->outputs[i];
+
+        output->input->io_uring = playdroid->input->io_uring;
+        init_input(output->input);
+        output->gsthelper->codec = playdroid->gsthelper->codec;
+        gst_pipeline_init(output->gsthelper, output->width, output->height, output->refresh_rate, output->input);
+    }
+
+    if (playdroid->control_path)
+        control_start(playdroid->control_path, playdroid->display, playdroid->gsthelper);
+    if (playdroid->handoff_path)
+        handoff_start(playdroid->handoff_path, playdroid->display, playdroid->input);
 
     // Set up the display socket
     std::thread display_thread([&playdroid]() {
+        sched_apply(SCHED_STAGE_DISPLAY);
         run_display(playdroid->display, playdroid->gsthelper);
     });
 
     display_thread.join();
 
+    control_stop();
+    handoff_stop();
+    snapshot_stop();
+    watchdog_stop();
+
+    gst_pipeline_deinit(playdroid->gsthelper);
+    g_rec_mutex_clear(&playdroid->gsthelper->lock);
+    deinit_input(playdroid->input);
+    for (int i = 0; i < playdroid->display->output_count; i++) {
+        gst_pipeline_deinit(playdroid->display->outputs[i].gsthelper);
+        g_rec_mutex_clear(&playdroid->display->outputs[i].gsthelper->lock);
+        deinit_input(playdroid->display->outputs[i].input);
+    }
+    replay_stop();
+    metrics_stop();
+    trace_stop();
+    sched_stop();
+
     return 0;
 }
@@ -0,0 +1,403 @@
+#include <atomic>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <thread>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include <metrics.h>
+
+#define METRICS_BUCKETS 15
+#define METRICS_REQUEST_TIMEOUT_MS 100
+
+struct metric_desc {
+    const char *name;
+    const char *labels; // NULL or a label set without braces
+    const char *help;
+};
+
+// Entries sharing a name are consecutive, HELP/TYPE are printed once per name
+static const struct metric_desc COUNTERS[METRIC_COUNTER_TOTAL] = {
+    {"playdroid_frames_received_total", NULL, "Frames received from the producer"},
+    {"playdroid_frames_pushed_total", NULL, "Frames pushed into the GStreamer pipeline"},
+    {"playdroid_frames_dropped_total", "reason=\"not_wanted\"", "Frames not pushed"},
+    {"playdroid_frames_dropped_total", "reason=\"invalid_fd\"", NULL},
+    {"playdroid_frames_dropped_total", "reason=\"no_pipeline\"", NULL},
+    {"playdroid_frames_dropped_total", "reason=\"unknown_display\"", NULL},
+    {"playdroid_frames_previewed_total", NULL, "Frames handed to the Wayland preview"},
+    {"playdroid_push_failures_total", NULL, "gst_app_src_push_buffer() calls that failed"},
+    {"playdroid_want_data_transitions_total", "to=\"on\"", "appsrc need-data/enough-data state changes"},
+    {"playdroid_want_data_transitions_total", "to=\"off\"", NULL},
+    {"playdroid_pipeline_errors_total", NULL, "Error messages posted on the pipeline bus"},
+    {"playdroid_pipeline_warnings_total", NULL, "Warning messages posted on the pipeline bus"},
+    {"playdroid_pipeline_recoveries_total", "action=\"restart\"", "Stalled pipelines restarted or rebuilt"},
+    {"playdroid_pipeline_recoveries_total", "action=\"rebuild\"", NULL},
+    {"playdroid_producer_disconnects_total", NULL, "Producer connections that were closed"},
+    {"playdroid_producer_reconnects_total", NULL, "Producer connections accepted after an earlier one closed"},
+    {"playdroid_replay_frames_dropped_total", NULL, "Encoded frames not written to the replay ring"},
+    {"playdroid_snapshots_total", NULL, "Snapshot images encoded"},
+    {"playdroid_input_text_dropped_total", NULL, "Characters of injected text dropped on a full keyboard FIFO"},
+    {"playdroid_input_events_total", "device=\"touch\"", "Input events written to the FIFOs"},
+    {"playdroid_input_events_total", "device=\"keyboard\"", NULL},
+    {"playdroid_input_events_total", "device=\"pointer\"", NULL},
+    {"playdroid_input_events_total", "device=\"gamepad\"", NULL},
+    {"playdroid_input_failed_writes_total", "device=\"touch\"", "Input writes that failed or were dropped"},
+    {"playdroid_input_failed_writes_total", "device=\"keyboard\"", NULL},
+    {"playdroid_input_failed_writes_total", "device=\"pointer\"", NULL},
+    {"playdroid_input_failed_writes_total", "device=\"gamepad\"", NULL},
+};
+
+static const struct metric_desc GAUGES[METRIC_GAUGE_TOTAL] = {
+    {"playdroid_want_data", NULL, "1 while appsrc asks for data"},
+    {"playdroid_pipeline_state", NULL, "GstState of the pipeline, 0 without one"},
+    {"playdroid_dmabufs_in_flight", NULL, "Received dmabufs still referenced"},
+    {"playdroid_rendering_paused", NULL, "1 while the producer is asked not to render"},
+    {"playdroid_viewers", NULL, "Clients of the sink, -1 when it does not report them"},
+    {"playdroid_pipeline_stalled", NULL, "1 while a stalled pipeline is being recovered"},
+    {"playdroid_sched_wait_per_slice_microseconds", "stage=\"display\"", "Average run queue wait per timeslice of a stage"},
+    {"playdroid_sched_wait_per_slice_microseconds", "stage=\"input\"", NULL},
+    {"playdroid_sched_wait_per_slice_microseconds", "stage=\"streaming\"", NULL},
+    {"playdroid_sched_wait_per_slice_microseconds", "stage=\"encoder\"", NULL},
+    {"playdroid_sched_worst_wait_per_slice_microseconds", "stage=\"display\"", "Run queue wait per timeslice of a stage's worst thread"},
+    {"playdroid_sched_worst_wait_per_slice_microseconds", "stage=\"input\"", NULL},
+    {"playdroid_sched_worst_wait_per_slice_microseconds", "stage=\"streaming\"", NULL},
+    {"playdroid_sched_worst_wait_per_slice_microseconds", "stage=\"encoder\"", NULL},
+};
+
+static const struct metric_desc HISTOGRAMS[METRIC_HISTOGRAM_TOTAL] = {
+    {"playdroid_frame_interval_seconds", NULL, "Time between frames from the producer"},
+    {"playdroid_push_duration_seconds", NULL, "Time spent in gst_app_src_push_buffer()"},
+    {"playdroid_input_write_latency_seconds", NULL, "Time from input handler to FIFO write"},
+    {"playdroid_recovery_duration_seconds", NULL, "Time from stall detection to encoder output again"},
+};
+
+// Upper bounds in microseconds, the last bucket is +Inf
+static const uint64_t BUCKET_BOUNDS_US[METRICS_BUCKETS - 1] = {
+    50, 100, 250, 500, 1000, 2500, 5000, 10000, 25000, 50000, 100000, 250000, 1000000, 5000000,
+};
+
+/*
+ * Only the owning thread writes a shard, so updates are relaxed load/store
+ * pairs without a locked instruction. Shards are never freed: when a thread
+ * exits its shard is released for the next new thread, keeping the totals
+ * monotonic.
+ */
+struct metrics_shard {
+    std::atomic<uint64_t> counters[METRIC_COUNTER_TOTAL];
+    std::atomic<uint64_t> buckets[METRIC_HISTOGRAM_TOTAL][METRICS_BUCKETS];
+    std::atomic<uint64_t> sums_us[METRIC_HISTOGRAM_TOTAL];
+    std::atomic<bool> in_use;
+    struct metrics_shard *next;
+};
+
+static std::atomic<struct metrics_shard *> shards;
+static std::atomic<int64_t> gauges[METRIC_GAUGE_TOTAL];
+
+struct metrics_server {
+    int listen_fd;
+    int wake_fds[2];
+    std::thread thread;
+};
+
+static struct metrics_server *server;
+
+static struct metrics_shard *acquire_shard(void) {
+    struct metrics_shard *shard;
+
+    for (shard = shards.load(std::memory_order_acquire); shard; shard = shard->next) {
+        bool expected = false;
+        if (shard->in_use.compare_exchange_strong(expected, true))
+            return shard;
+    }
+
+    shard = new metrics_shard();
+    shard->in_use = true;
+    shard->next = shards.load(std::memory_order_relaxed);
+    while (!shards.compare_exchange_weak(shard->next, shard, std::memory_order_release))
+        ;
+    return shard;
+}
+
+struct shard_owner {
+    struct metrics_shard *shard = acquire_shard();
+
+    ~shard_owner() { shard->in_use.store(false, std::memory_order_release); }
+};
+
+static struct metrics_shard *local_shard(void) {
+    static thread_local shard_owner owner;
+    return owner.shard;
+}
+
+static inline void shard_add(std::atomic<uint64_t> *value, uint64_t delta) {
+    value->store(value->load(std::memory_order_relaxed) + delta, std::memory_order_relaxed);
+}
+
+void metrics_inc(enum metric_counter counter) {
+    shard_add(&local_shard()->counters[counter], 1);
+}
+
+void metrics_add(enum metric_counter counter, uint64_t value) {
+    shard_add(&local_shard()->counters[counter], value);
+}
+
+void metrics_gauge_set(enum metric_gauge gauge, int64_t value) {
+    gauges[gauge].store(value, std::memory_order_relaxed);
+}
+
+void metrics_gauge_add(enum metric_gauge gauge, int64_t delta) {
+    gauges[gauge].fetch_add(delta, std::memory_order_relaxed);
+}
+
+void metrics_observe_us(enum metric_histogram histogram, uint64_t value_us) {
+    struct metrics_shard *shard = local_shard();
+    int bucket = 0;
+
+    while (bucket < METRICS_BUCKETS - 1 && value_us > BUCKET_BOUNDS_US[bucket])
+        bucket++;
+    shard_add(&shard->buckets[histogram][bucket], 1);
+    shard_add(&shard->sums_us[histogram], value_us);
+}
+
+static void write_header(FILE *out, const struct metric_desc *desc, const struct metric_desc *prev, const char *type) {
+    if (prev && strcmp(prev->name, desc->name) == 0)
+        return;
+    fprintf(out, "# HELP %s %s\n# TYPE %s %s\n", desc->name, desc->help, desc->name, type);
+}
+
+static int count_open_fds(void) {
+    struct dirent *entry;
+    int count = 0;
+    DIR *dir;
+
+    dir = opendir("/proc/self/fd");
+    if (!dir)
+        return -1;
+    while ((entry = readdir(dir)))
+        if (entry->d_name[0] != '.')
+            count++;
+    closedir(dir);
+
+    // Minus the descriptor of the directory stream itself
+    return count - 1;
+}
+
+void metrics_write(FILE *out) {
+    uint64_t counters[METRIC_COUNTER_TOTAL] = {0};
+    uint64_t buckets[METRIC_HISTOGRAM_TOTAL][METRICS_BUCKETS] = {{0}};
+    uint64_t sums_us[METRIC_HISTOGRAM_TOTAL] = {0};
+
+    for (struct metrics_shard *shard = shards.load(std::memory_order_acquire); shard; shard = shard->next) {
+        for (int i = 0; i < METRIC_COUNTER_TOTAL; i++)
+            counters[i] += shard->counters[i].load(std::memory_order_relaxed);
+        for (int i = 0; i < METRIC_HISTOGRAM_TOTAL; i++) {
+            for (int j = 0; j < METRICS_BUCKETS; j++)
+                buckets[i][j] += shard->buckets[i][j].load(std::memory_order_relaxed);
+            sums_us[i] += shard->sums_us[i].load(std::memory_order_relaxed);
+        }
+    }
+
+    for (int i = 0; i < METRIC_COUNTER_TOTAL; i++) {
+        write_header(out, &COUNTERS[i], i ? &COUNTERS[i - 1] : NULL, "counter");
+        if (COUNTERS[i].labels)
+            fprintf(out, "%s{%s} %" PRIu64 "\n", COUNTERS[i].name, COUNTERS[i].labels, counters[i]);
+        else
+            fprintf(out, "%s %" PRIu64 "\n", COUNTERS[i].name, counters[i]);
+    }
+
+    for (int i = 0; i < METRIC_GAUGE_TOTAL; i++) {
+        write_header(out, &GAUGES[i], i ? &GAUGES[i - 1] : NULL, "gauge");
+        if (GAUGES[i].labels)
+            fprintf(out, "%s{%s} %" PRId64 "\n", GAUGES[i].name, GAUGES[i].labels,
+                    gauges[i].load(std::memory_order_relaxed));
+        else
+            fprintf(out, "%s %" PRId64 "\n", GAUGES[i].name, gauges[i].load(std::memory_order_relaxed));
+    }
+    fprintf(out, "# HELP playdroid_open_fds Open file descriptors\n# TYPE playdroid_open_fds gauge\n");
+    fprintf(out, "playdroid_open_fds %d\n", count_open_fds());
+
+    for (int i = 0; i < METRIC_HISTOGRAM_TOTAL; i++) {
+        uint64_t cumulative = 0;
+
+        write_header(out, &HISTOGRAMS[i], NULL, "histogram");
+        for (int j = 0; j < METRICS_BUCKETS; j++) {
+            cumulative += buckets[i][j];
+            if (j < METRICS_BUCKETS - 1)
+                fprintf(out, "%s_bucket{le=\"%g\"} %" PRIu64 "\n", HISTOGRAMS[i].name, BUCKET_BOUNDS_US[j] / 1e6,
+                        cumulative);
+            else
+                fprintf(out, "%s_bucket{le=\"+Inf\"} %" PRIu64 "\n", HISTOGRAMS[i].name, cumulative);
+        }
+        fprintf(out, "%s_sum %g\n", HISTOGRAMS[i].name, sums_us[i] / 1e6);
+        fprintf(out, "%s_count %" PRIu64 "\n", HISTOGRAMS[i].name, cumulative);
+    }
+}
+
+static void write_all(int fd, const char *data, size_t len) {
+    while (len > 0) {
+        ssize_t res = write(fd, data, len);
+        if (res < 0) {
+            if (errno == EINTR)
+                continue;
+            return;
+        }
+        data += res;
+        len -= res;
+    }
+}
+
+static void serve_client(int fd) {
+    char request[1024], header[128];
+    struct pollfd pfd = {fd, POLLIN, 0};
+    ssize_t len = 0;
+    char *body = NULL;
+    size_t body_len = 0;
+    FILE *out;
+
+    // A plain socket client may send nothing, wait briefly for a request line
+    if (poll(&pfd, 1, METRICS_REQUEST_TIMEOUT_MS) > 0)
+        len = recv(fd, request, sizeof(request) - 1, MSG_DONTWAIT);
+    request[len > 0 ? len : 0] = '\0';
+
+    out = open_memstream(&body, &body_len);
+    if (!out)
+        return;
+    metrics_write(out);
+    fclose(out);
+
+    if (strncmp(request, "GET ", 4) == 0) {
+        int header_len = snprintf(header, sizeof(header),
+                                  "HTTP/1.0 200 OK\r\n"
+                                  "Content-Type: text/plain; version=0.0.4\r\n"
+                                  "Content-Length: %zu\r\n\r\n",
+                                  body_len);
+        write_all(fd, header, header_len);
+    }
+    write_all(fd, body, body_len);
+    free(body);
+}
+
+static void run_server(struct metrics_server *server) {
+    struct pollfd fds[2];
+
+    fds[0].fd = server->listen_fd;
+    fds[0].events = POLLIN;
+    fds[1].fd = server->wake_fds[0];
+    fds[1].events = POLLIN;
+
+    while (true) {
+        if (poll(fds, 2, -1) < 0) {
+            if (errno == EINTR)
+                continue;
+            fprintf(stderr, "Metrics poll failed: %s\n", strerror(errno));
+            return;
+        }
+        if (fds[1].revents)
+            return;
+        if (!fds[0].revents)
+            continue;
+
+        int client = accept4(server->listen_fd, NULL, NULL, SOCK_CLOEXEC);
+        if (client < 0)
+            continue;
+        serve_client(client);
+        close(client);
+    }
+}
+
+static int listen_unix(const char *path) {
+    struct sockaddr_un addr;
+    int fd;
+
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "Metrics socket path too long: %s\n", path);
+        return -1;
+    }
+
+    fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0)
+        return -1;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+    unlink(path);
+
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(fd, 4) < 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+static int listen_tcp(int port) {
+    struct sockaddr_in addr;
+    int fd, one = 1;
+
+    fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0)
+        return -1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(fd, 4) < 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+int metrics_start(const char *endpoint) {
+    int fd;
+
+    if (server)
+        return 0;
+
+    if (strncmp(endpoint, "tcp:", 4) == 0)
+        fd = listen_tcp(strtol(endpoint + 4, NULL, 10));
+    else
+        fd = listen_unix(endpoint);
+    if (fd < 0) {
+        fprintf(stderr, "Failed to serve metrics on %s: %s\n", endpoint, strerror(errno));
+        return -1;
+    }
+
+    server = new metrics_server();
+    server->listen_fd = fd;
+    if (pipe2(server->wake_fds, O_CLOEXEC) < 0) {
+        close(fd);
+        delete server;
+        server = NULL;
+        return -1;
+    }
+    server->thread = std::thread(run_server, server);
+
+    fprintf(stderr, "Serving metrics on %s\n", endpoint);
+    return 0;
+}
+
+void metrics_stop(void) {
+    if (!server)
+        return;
+
+    write_all(server->wake_fds[1], "", 1);
+    server->thread.join();
+    close(server->wake_fds[0]);
+    close(server->wake_fds[1]);
+    close(server->listen_fd);
+    delete server;
+    server = NULL;
+}
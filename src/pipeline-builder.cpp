@@ -0,0 +1,347 @@
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <mutex>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <linux/udmabuf.h>
+
+#include <gst/allocators/gstdmabuf.h>
+#include <gst/app/gstappsrc.h>
+#include <gst/gst.h>
+#include <gst/video/video.h>
+
+#include <pipeline-builder.h>
+
+#define BUILDER_TEST_FRAMES 10
+#define BUILDER_TEST_TIMEOUT_MS 5000
+#define BUILDER_CACHE_SIZE 16
+#define BUILDER_SINK "webrtcsink signaller::uri=\"ws://localhost:8443\" enable-control-data-channel=true name=sink"
+
+// XBGR8888, what appsrc announces until the producer's first frame
+#if GST_CHECK_VERSION(1, 24, 0)
+#define BUILDER_TEST_FORMAT "DMA_DRM,drm-format=XB24"
+#define BUILDER_TEST_META_FORMAT GST_VIDEO_FORMAT_DMA_DRM
+#else
+#define BUILDER_TEST_FORMAT "RGBx"
+#define BUILDER_TEST_META_FORMAT GST_VIDEO_FORMAT_RGBx
+#endif
+// The same frame as plain caps, for converters that refuse dmabuf caps
+#define BUILDER_TEST_PLAIN_FORMAT "RGBx"
+#define BUILDER_TEST_PLAIN_META_FORMAT GST_VIDEO_FORMAT_RGBx
+
+struct encoder_candidate {
+    const char *factory;
+    const char *codec;
+    const char *convert;          // in front of the encoder, takes the dmabufs
+    const char *const *props;     // low-latency settings, "name=value"
+};
+
+static const char *const VA_PROPS[] = {"b-frames=0", "rate-control=cbr", "target-usage=7", NULL};
+static const char *const VAAPI_PROPS[] = {"rate-control=cbr", "tune=low-power", NULL};
+static const char *const NV_PROPS[] = {"preset=low-latency-hq", "zerolatency=true", "bframes=0", "rc-mode=cbr",
+                                       "tune=ultra-low-latency", NULL};
+static const char *const X264_PROPS[] = {"tune=zerolatency", "speed-preset=ultrafast", "bframes=0", NULL};
+static const char *const X265_PROPS[] = {"tune=zerolatency", "speed-preset=ultrafast", NULL};
+static const char *const OPENH264_PROPS[] = {"complexity=low", "usage-type=screen", "rate-control=bitrate", NULL};
+static const char *const VPX_PROPS[] = {"deadline=1", "lag-in-frames=0", "end-usage=cbr", "cpu-used=8", "row-mt=true",
+                                        NULL};
+static const char *const SVTAV1_PROPS[] = {"preset=12", NULL};
+static const char *const NO_PROPS[] = {NULL};
+
+// Tried in order: low-power VA, NVENC, VA, VA-API, V4L2, then software
+static const struct encoder_candidate CANDIDATES[] = {
+    {"vah264lpenc", "h264", "vapostproc", VA_PROPS},
+    {"vah265lpenc", "h265", "vapostproc", VA_PROPS},
+    {"nvautogpuh264enc", "h264", "videoconvert", NV_PROPS},
+    {"nvh264enc", "h264", "videoconvert", NV_PROPS},
+    {"nvautogpuh265enc", "h265", "videoconvert", NV_PROPS},
+    {"nvh265enc", "h265", "videoconvert", NV_PROPS},
+    {"vah264enc", "h264", "vapostproc", VA_PROPS},
+    {"vavp9enc", "vp9", "vapostproc", VA_PROPS},
+    {"vah265enc", "h265", "vapostproc", VA_PROPS},
+    {"vaav1enc", "av1", "vapostproc", VA_PROPS},
+    {"vavp8enc", "vp8", "vapostproc", VA_PROPS},
+    {"nvav1enc", "av1", "videoconvert", NV_PROPS},
+    {"vaapih264enc", "h264", "vaapipostproc", VAAPI_PROPS},
+    {"vaapivp9enc", "vp9", "vaapipostproc", VAAPI_PROPS},
+    {"vaapih265enc", "h265", "vaapipostproc", VAAPI_PROPS},
+    {"vaapivp8enc", "vp8", "vaapipostproc", VAAPI_PROPS},
+    {"v4l2h264enc", "h264", "videoconvert", NO_PROPS},
+    {"v4l2vp9enc", "vp9", "videoconvert", NO_PROPS},
+    {"v4l2h265enc", "h265", "videoconvert", NO_PROPS},
+    {"v4l2vp8enc", "vp8", "videoconvert", NO_PROPS},
+    {"x264enc", "h264", "videoconvert", X264_PROPS},
+    {"openh264enc", "h264", "videoconvert", OPENH264_PROPS},
+    {"vp8enc", "vp8", "videoconvert", VPX_PROPS},
+    {"vp9enc", "vp9", "videoconvert", VPX_PROPS},
+    {"x265enc", "h265", "videoconvert", X265_PROPS},
+    {"svtav1enc", "av1", "videoconvert", SVTAV1_PROPS},
+};
+
+static bool have_factory(const char *name) {
+    GstElementFactory *factory = gst_element_factory_find(name);
+
+    if (!factory)
+        return false;
+    gst_object_unref(factory);
+    return true;
+}
+
+/* The encoder with the properties this version of it understands, settings
+ * it does not know or whose value it would reject are left out. */
+static char *describe_encoder(const struct encoder_candidate *candidate) {
+    GstElement *element = gst_element_factory_make(candidate->factory, NULL);
+    GString *out;
+
+    if (!element)
+        return NULL;
+
+    out = g_string_new(candidate->factory);
+    for (int i = 0; candidate->props[i]; i++) {
+        gchar **pair = g_strsplit(candidate->props[i], "=", 2);
+        GParamSpec *pspec = g_object_class_find_property(G_OBJECT_GET_CLASS(element), pair[0]);
+        GValue value = G_VALUE_INIT;
+
+        if (pspec && (pspec->flags & G_PARAM_WRITABLE)) {
+            g_value_init(&value, pspec->value_type);
+            if (gst_value_deserialize(&value, pair[1]))
+                g_string_append_printf(out, " %s", candidate->props[i]);
+            g_value_unset(&value);
+        }
+        g_strfreev(pair);
+    }
+    gst_object_unref(element);
+
+    return g_string_free(out, FALSE);
+}
+
+static const char *parser_for(const char *codec) {
+    static char name[32];
+
+    snprintf(name, sizeof(name), "%sparse", codec);
+    return have_factory(name) ? name : NULL;
+}
+
+/* One black linear frame in BUILDER_TEST_FORMAT, a udmabuf over a memfd.
+ * Returns the dmabuf fd, or -1 without udmabuf. */
+static int create_test_dmabuf(int width, int height, int *stride, gsize *size) {
+    struct udmabuf_create create;
+    long page_size = sysconf(_SC_PAGESIZE);
+    int memfd, dev, fd = -1;
+
+    *stride = (width * 4 + 63) & ~63;
+    *size = ((gsize)*stride * height + page_size - 1) & ~(gsize)(page_size - 1);
+
+    memfd = memfd_create("playdroid-encoder-probe", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+    if (memfd < 0)
+        return -1;
+    // udmabuf requires the memfd to be sealed against shrinking
+    if (ftruncate(memfd, *size) == 0 && fcntl(memfd, F_ADD_SEALS, F_SEAL_SHRINK) == 0) {
+        dev = open("/dev/udmabuf", O_RDWR | O_CLOEXEC);
+        if (dev >= 0) {
+            memset(&create, 0, sizeof(create));
+            create.memfd = memfd;
+            create.flags = UDMABUF_FLAGS_CLOEXEC;
+            create.size = *size;
+            fd = ioctl(dev, UDMABUF_CREATE, &create);
+            close(dev);
+        }
+    }
+    close(memfd);
+    return fd;
+}
+
+static GstCaps *test_frame_caps(int width, int height, int refresh_rate, bool dmabuf) {
+    gchar *description = g_strdup_printf(dmabuf ? "video/x-raw(memory:DMABuf),format=" BUILDER_TEST_FORMAT
+                                                  ",width=%d,height=%d,framerate=%d/1"
+                                                : "video/x-raw,format=" BUILDER_TEST_PLAIN_FORMAT
+                                                  ",width=%d,height=%d,framerate=%d/1",
+                                         width, height, refresh_rate);
+    GstCaps *caps = gst_caps_from_string(description);
+
+    g_free(description);
+    return caps;
+}
+
+// The same frame BUILDER_TEST_FRAMES times, each buffer with its own fd
+static bool push_test_frames(GstAppSrc *appsrc, int fd, GstVideoFormat format, int width, int height, int stride,
+                             gsize size, int refresh_rate) {
+    GstAllocator *allocator = gst_dmabuf_allocator_new();
+    gsize offsets[GST_VIDEO_MAX_PLANES] = {0};
+    gint strides[GST_VIDEO_MAX_PLANES] = {stride};
+    bool ok = true;
+
+    for (int i = 0; i < BUILDER_TEST_FRAMES && ok; i++) {
+        int copy = fcntl(fd, F_DUPFD_CLOEXEC, 0);
+        GstBuffer *buf;
+
+        if (copy < 0) {
+            ok = false;
+            break;
+        }
+        buf = gst_buffer_new();
+        gst_buffer_append_memory(buf, gst_dmabuf_allocator_alloc(allocator, copy, size));
+        gst_buffer_add_video_meta_full(buf, GST_VIDEO_FRAME_FLAG_NONE, format, width, height, 1,
+                                       offsets, strides);
+        GST_BUFFER_PTS(buf) = gst_util_uint64_scale_int(i, GST_SECOND, refresh_rate);
+        GST_BUFFER_DURATION(buf) = gst_util_uint64_scale_int(1, GST_SECOND, refresh_rate);
+        ok = gst_app_src_push_buffer(appsrc, buf) == GST_FLOW_OK;
+    }
+    gst_app_src_end_of_stream(appsrc);
+    gst_object_unref(allocator);
+    return ok;
+}
+
+/* Encodes a few test frames, returns the time it took in ms or -1. They are
+ * dmabufs like the producer's, so a converter that cannot import them fails
+ * here rather than in the session. Like gst_update_caps(), the caps are
+ * plain when the converter refuses dmabuf caps, the udmabuf maps fine then.
+ * System memory only without udmabuf. */
+static double test_encode(const char *chain, int width, int height, int refresh_rate) {
+    GstElement *pipeline;
+    GstMessage *message;
+    GError *err = NULL;
+    gint64 start;
+    double elapsed = -1;
+    gchar *description;
+    int stride;
+    gsize size;
+    GstVideoFormat format = BUILDER_TEST_META_FORMAT;
+    int fd = create_test_dmabuf(width, height, &stride, &size);
+
+    if (fd >= 0)
+        description = g_strdup_printf("appsrc name=src format=time ! %s ! fakesink", chain);
+    else
+        description = g_strdup_printf("videotestsrc num-buffers=%d ! video/x-raw,width=%d,height=%d,framerate=%d/1 ! %s ! fakesink",
+                                      BUILDER_TEST_FRAMES, width, height, refresh_rate, chain);
+    pipeline = gst_parse_launch(description, &err);
+    g_free(description);
+    if (!pipeline) {
+        g_clear_error(&err);
+        if (fd >= 0)
+            close(fd);
+        return -1;
+    }
+
+    if (fd >= 0) {
+        GstElement *src = gst_bin_get_by_name(GST_BIN(pipeline), "src");
+        GstPad *pad = gst_element_get_static_pad(src, "src");
+        GstCaps *caps = test_frame_caps(width, height, refresh_rate, true);
+
+        if (!gst_pad_peer_query_accept_caps(pad, caps)) {
+            gst_caps_unref(caps);
+            caps = test_frame_caps(width, height, refresh_rate, false);
+            format = BUILDER_TEST_PLAIN_META_FORMAT;
+        }
+        gst_object_unref(pad);
+
+        g_object_set(G_OBJECT(src), "caps", caps, NULL);
+        gst_caps_unref(caps);
+        gst_object_unref(src);
+    }
+
+    start = g_get_monotonic_time();
+    if (gst_element_set_state(pipeline, GST_STATE_PLAYING) != GST_STATE_CHANGE_FAILURE) {
+        GstBus *bus = gst_element_get_bus(pipeline);
+        bool pushed = true;
+
+        if (fd >= 0) {
+            GstElement *src = gst_bin_get_by_name(GST_BIN(pipeline), "src");
+
+            pushed = push_test_frames(GST_APP_SRC(src), fd, format, width, height, stride, size, refresh_rate);
+            gst_object_unref(src);
+        }
+        message = pushed ? gst_bus_timed_pop_filtered(bus, BUILDER_TEST_TIMEOUT_MS * GST_MSECOND,
+                                                      (GstMessageType)(GST_MESSAGE_EOS | GST_MESSAGE_ERROR))
+                         : NULL;
+        if (message && GST_MESSAGE_TYPE(message) == GST_MESSAGE_EOS)
+            elapsed = (g_get_monotonic_time() - start) / 1000.0;
+        if (message)
+            gst_message_unref(message);
+        gst_object_unref(bus);
+    }
+
+    gst_element_set_state(pipeline, GST_STATE_NULL);
+    gst_object_unref(pipeline);
+    if (fd >= 0)
+        close(fd);
+    return elapsed;
+}
+
+// Displays of the same size and rate share the probes, see cached_test_encode()
+struct probe_result {
+    const struct encoder_candidate *candidate;
+    int width;
+    int height;
+    int refresh_rate;
+    double elapsed;
+};
+
+static std::mutex probe_lock;
+static struct probe_result probe_cache[BUILDER_CACHE_SIZE];
+static unsigned int probe_count;
+
+static double cached_test_encode(const struct encoder_candidate *candidate, const char *chain, int width, int height,
+                                 int refresh_rate) {
+    std::lock_guard<std::mutex> guard(probe_lock);
+    unsigned int cached = probe_count < BUILDER_CACHE_SIZE ? probe_count : BUILDER_CACHE_SIZE;
+    struct probe_result *result;
+
+    for (unsigned int i = 0; i < cached; i++) {
+        result = &probe_cache[i];
+        if (result->candidate == candidate && result->width == width && result->height == height &&
+            result->refresh_rate == refresh_rate)
+            return result->elapsed;
+    }
+
+    // The oldest entry makes room once the cache is full
+    result = &probe_cache[probe_count++ % BUILDER_CACHE_SIZE];
+    result->candidate = candidate;
+    result->width = width;
+    result->height = height;
+    result->refresh_rate = refresh_rate;
+    result->elapsed = test_encode(chain, width, height, refresh_rate);
+    return result->elapsed;
+}
+
+char *pipeline_build(const char *codec, int width, int height, int refresh_rate) {
+    for (size_t i = 0; i < sizeof(CANDIDATES) / sizeof(CANDIDATES[0]); i++) {
+        const struct encoder_candidate *candidate = &CANDIDATES[i];
+        char *encoder, *chain, *description, *pipeline;
+        const char *parser;
+        double elapsed;
+
+        if (codec && strcmp(codec, candidate->codec) != 0)
+            continue;
+        if (!have_factory(candidate->factory) || !have_factory(candidate->convert))
+            continue;
+
+        encoder = describe_encoder(candidate);
+        if (!encoder)
+            continue;
+        parser = parser_for(candidate->codec);
+        chain = g_strdup_printf("%s ! %s%s%s", candidate->convert, encoder, parser ? " ! " : "", parser ? parser : "");
+        g_free(encoder);
+
+        elapsed = cached_test_encode(candidate, chain, width, height, refresh_rate);
+        if (elapsed < 0) {
+            fprintf(stderr, "Encoder %s failed a test encode, trying the next one\n", candidate->factory);
+            g_free(chain);
+            continue;
+        }
+
+        fprintf(stderr, "Encoder %s (%s), %d test frames at %dx%d in %.1f ms\n", candidate->factory,
+                candidate->codec, BUILDER_TEST_FRAMES, width, height, elapsed);
+        description = g_strdup_printf("appsrc name=src ! %s ! " BUILDER_SINK, chain);
+        pipeline = strdup(description);
+        g_free(description);
+        g_free(chain);
+        return pipeline;
+    }
+
+    fprintf(stderr, "No working %s encoder found\n", codec ? codec : "video");
+    return NULL;
+}
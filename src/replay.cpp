@@ -0,0 +1,467 @@
+#include <atomic>
+#include <errno.h>
+#include <fcntl.h>
+#include <mutex>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include <gst/app/gstappsrc.h>
+#include <gst/gst.h>
+
+#include <metrics.h>
+#include <replay.h>
+
+#define REPLAY_CAPS_MAX 4096
+#define REPLAY_HEADER_MAX 4096
+#define REPLAY_DUMP_QUEUE_BYTES (4 * 1024 * 1024)
+#define REPLAY_DUMP_TIMEOUT_MS 30000
+#define REPLAY_DUMP_POLL_MS 100 // how soon a cancelled dump notices
+#define REPLAY_MAX_SIZE_MB 16384 // segment offsets are 32 bit
+
+struct replay_segment {
+    char *path;
+    int fd;
+    uint8_t *data;
+    // Bumped before the writer reuses the segment, stale index entries and
+    // dumps reading it meanwhile see the change
+    std::atomic<uint32_t> generation;
+};
+
+struct replay_frame {
+    uint64_t pts_ns;
+    uint64_t dts_ns;
+    uint32_t segment;
+    uint32_t generation;
+    uint32_t offset;
+    uint32_t size;
+    uint32_t flags;
+};
+
+struct replay {
+    size_t segment_size;
+    struct replay_segment segments[REPLAY_SEGMENTS];
+
+    // Writer only
+    uint32_t current;
+    size_t used;
+    bool need_keyframe;
+
+    // Index and stream description, dumps copy them out under the lock
+    std::mutex lock;
+    struct replay_frame index[REPLAY_INDEX_SIZE];
+    uint64_t index_first; // entries before belong to earlier caps
+    uint64_t index_next;
+    char caps[REPLAY_CAPS_MAX];
+    uint8_t header[REPLAY_HEADER_MAX];
+    size_t header_size;
+    bool header_done; // the next header buffer starts a new set
+
+    std::atomic<bool> cancel; // set once by replay_cancel(), running and later dumps fail
+};
+
+static struct replay *replay;
+
+static int create_segment(struct replay_segment *segment, const char *dir, int i, size_t size) {
+    if (asprintf(&segment->path, "%s/replay-%d.seg", dir, i) < 0) {
+        segment->path = NULL;
+        return -1;
+    }
+
+    segment->fd = open(segment->path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    if (segment->fd < 0 || ftruncate(segment->fd, size) < 0) {
+        fprintf(stderr, "Failed to create replay segment %s: %s\n", segment->path, strerror(errno));
+        return -1;
+    }
+
+    segment->data = (uint8_t *)mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, segment->fd, 0);
+    if (segment->data == MAP_FAILED) {
+        segment->data = NULL;
+        fprintf(stderr, "Failed to map replay segment %s: %s\n", segment->path, strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+static void destroy_replay(struct replay *replay) {
+    for (int i = 0; i < REPLAY_SEGMENTS; i++) {
+        struct replay_segment *segment = &replay->segments[i];
+
+        if (segment->data)
+            munmap(segment->data, replay->segment_size);
+        if (segment->fd >= 0)
+            close(segment->fd);
+        if (segment->path) {
+            unlink(segment->path);
+            free(segment->path);
+        }
+    }
+    delete replay;
+}
+
+int replay_start(const char *spec) {
+    const char *colon = strrchr(spec, ':');
+    unsigned long size_mb = REPLAY_DEFAULT_SIZE_MB;
+    char *dir, *end;
+
+    if (replay)
+        return 0;
+
+    if (colon) {
+        errno = 0;
+        size_mb = strtoul(colon + 1, &end, 10);
+        if (errno || end == colon + 1 || *end != '\0' || size_mb == 0 || size_mb > REPLAY_MAX_SIZE_MB) {
+            fprintf(stderr, "Invalid replay size: %s\n", spec);
+            return -1;
+        }
+        dir = strndup(spec, colon - spec);
+    } else {
+        dir = strdup(spec);
+    }
+    if (!dir)
+        return -1;
+
+    replay = new struct replay();
+    replay->segment_size = (size_mb << 20) / REPLAY_SEGMENTS;
+    for (int i = 0; i < REPLAY_SEGMENTS; i++)
+        replay->segments[i].fd = -1;
+    // Nothing is written before the first keyframe
+    replay->need_keyframe = true;
+
+    for (int i = 0; i < REPLAY_SEGMENTS; i++) {
+        if (create_segment(&replay->segments[i], dir, i, replay->segment_size) < 0) {
+            free(dir);
+            destroy_replay(replay);
+            replay = NULL;
+            return -1;
+        }
+    }
+
+    fprintf(stderr, "Replay ring of %lu MB in %s\n", size_mb, dir);
+    free(dir);
+    return 0;
+}
+
+void replay_stop(void) {
+    if (!replay)
+        return;
+
+    destroy_replay(replay);
+    replay = NULL;
+}
+
+bool replay_enabled(void) {
+    return replay != NULL;
+}
+
+void replay_cancel(void) {
+    if (replay)
+        replay->cancel = true;
+}
+
+// A different stream cannot be muxed together with the frames before it
+void replay_set_caps(const char *caps) {
+    if (!replay || strlen(caps) >= REPLAY_CAPS_MAX)
+        return;
+
+    std::lock_guard<std::mutex> guard(replay->lock);
+    if (strcmp(replay->caps, caps) == 0)
+        return;
+    strcpy(replay->caps, caps);
+    replay->index_first = replay->index_next;
+    replay->header_size = 0;
+    replay->need_keyframe = true;
+}
+
+static void drop_frame(struct replay *replay) {
+    replay->need_keyframe = true;
+    metrics_inc(METRIC_REPLAY_FRAMES_DROPPED);
+}
+
+void replay_write(const void *data, size_t size, uint64_t pts_ns, uint64_t dts_ns, uint32_t flags) {
+    struct replay_segment *segment;
+    struct replay_frame *frame;
+
+    if (!replay)
+        return;
+
+    // The live branch must not wait for a dump, the frame is skipped instead
+    std::unique_lock<std::mutex> guard(replay->lock, std::try_to_lock);
+    if (!guard.owns_lock()) {
+        drop_frame(replay);
+        return;
+    }
+
+    // Kept aside as well, the keyframe a dump starts at may not repeat them
+    if (flags & REPLAY_FRAME_HEADER) {
+        if (replay->header_done)
+            replay->header_size = 0;
+        replay->header_done = false;
+        if (replay->header_size + size <= REPLAY_HEADER_MAX) {
+            memcpy(replay->header + replay->header_size, data, size);
+            replay->header_size += size;
+        }
+    } else {
+        replay->header_done = true;
+    }
+
+    if (size > replay->segment_size) {
+        drop_frame(replay);
+        return;
+    }
+    if (replay->need_keyframe && !(flags & REPLAY_FRAME_KEYFRAME)) {
+        metrics_inc(METRIC_REPLAY_FRAMES_DROPPED);
+        return;
+    }
+    replay->need_keyframe = false;
+
+    if (replay->used + size > replay->segment_size) {
+        replay->current = (replay->current + 1) % REPLAY_SEGMENTS;
+        replay->used = 0;
+        segment = &replay->segments[replay->current];
+        segment->generation.store(segment->generation.load(std::memory_order_relaxed) + 1,
+                                  std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+    }
+    segment = &replay->segments[replay->current];
+    memcpy(segment->data + replay->used, data, size);
+
+    frame = &replay->index[replay->index_next++ % REPLAY_INDEX_SIZE];
+    frame->pts_ns = pts_ns;
+    frame->dts_ns = dts_ns;
+    frame->segment = replay->current;
+    frame->generation = segment->generation.load(std::memory_order_relaxed);
+    frame->offset = replay->used;
+    frame->size = size;
+    frame->flags = flags;
+    replay->used += size;
+}
+
+static bool frame_valid(const struct replay_frame *frame) {
+    std::atomic_thread_fence(std::memory_order_acquire);
+    return replay->segments[frame->segment].generation.load(std::memory_order_relaxed) == frame->generation;
+}
+
+static const char *muxer_for(const char *path) {
+    const char *ext = strrchr(path, '.');
+
+    if (!ext)
+        return NULL;
+    if (strcasecmp(ext, ".mp4") == 0 || strcasecmp(ext, ".mov") == 0)
+        return "mp4mux";
+    if (strcasecmp(ext, ".mkv") == 0 || strcasecmp(ext, ".webm") == 0)
+        return "matroskamux";
+    return NULL;
+}
+
+// Muxers want the stream parsed, e.g. byte-stream h264 converted to avc
+static const char *parser_for(const GstCaps *caps) {
+    static const char *const parsers[][2] = {
+        {"video/x-h264", "h264parse"},
+        {"video/x-h265", "h265parse"},
+        {"video/x-vp9", "vp9parse"},
+        {"video/x-av1", "av1parse"},
+    };
+    const char *media = gst_structure_get_name(gst_caps_get_structure(caps, 0));
+
+    for (size_t i = 0; i < G_N_ELEMENTS(parsers); i++) {
+        GstElementFactory *factory;
+
+        if (strcmp(media, parsers[i][0]) != 0)
+            continue;
+        factory = gst_element_factory_find(parsers[i][1]);
+        if (!factory)
+            return NULL;
+        gst_object_unref(factory);
+        return parsers[i][1];
+    }
+    return NULL;
+}
+
+// Index position of the keyframe `seconds` before the newest frame
+static uint64_t find_start(const struct replay_frame *frames, uint64_t count, unsigned int seconds) {
+    uint64_t newest = frames[count - 1].pts_ns;
+    uint64_t from = newest > seconds * GST_SECOND ? newest - seconds * GST_SECOND : 0;
+    uint64_t start = count;
+
+    for (uint64_t i = 0; i < count; i++) {
+        if (!(frames[i].flags & REPLAY_FRAME_KEYFRAME) || !frame_valid(&frames[i]))
+            continue;
+        if (start == count || frames[i].pts_ns <= from)
+            start = i;
+        if (frames[i].pts_ns >= from)
+            break;
+    }
+    return start;
+}
+
+static GstBuffer *copy_frame(const struct replay_frame *frame, uint64_t base_ns) {
+    GstBuffer *buf = gst_buffer_new_allocate(NULL, frame->size, NULL);
+
+    gst_buffer_fill(buf, 0, replay->segments[frame->segment].data + frame->offset, frame->size);
+    // Overwritten while copying, the bytes are a mix of two frames
+    if (!frame_valid(frame)) {
+        gst_buffer_unref(buf);
+        return NULL;
+    }
+
+    GST_BUFFER_PTS(buf) = frame->pts_ns - base_ns;
+    if (frame->dts_ns != GST_CLOCK_TIME_NONE)
+        GST_BUFFER_DTS(buf) = frame->dts_ns - base_ns;
+    if (!(frame->flags & REPLAY_FRAME_KEYFRAME))
+        GST_BUFFER_FLAG_SET(buf, GST_BUFFER_FLAG_DELTA_UNIT);
+    return buf;
+}
+
+static GstElement *create_dump_pipeline(const char *path, GstCaps *caps) {
+    const char *muxer = muxer_for(path);
+    const char *parser = parser_for(caps);
+    GstElement *pipeline, *element;
+    GError *err = NULL;
+    gchar *description;
+
+    if (!muxer) {
+        fprintf(stderr, "Replay dumps are .mp4, .mov, .mkv or .webm files: %s\n", path);
+        return NULL;
+    }
+
+    description = g_strdup_printf("appsrc name=src format=time ! %s%s%s ! filesink name=sink",
+                                  parser ? parser : "", parser ? " ! " : "", muxer);
+    pipeline = gst_parse_launch(description, &err);
+    g_free(description);
+    if (!pipeline) {
+        fprintf(stderr, "Failed to create the replay pipeline: %s\n", err ? err->message : "unknown error");
+        g_clear_error(&err);
+        return NULL;
+    }
+
+    element = gst_bin_get_by_name(GST_BIN(pipeline), "src");
+    g_object_set(G_OBJECT(element), "caps", caps, "block", TRUE, "max-bytes", (guint64)REPLAY_DUMP_QUEUE_BYTES,
+                 NULL);
+    gst_object_unref(element);
+    element = gst_bin_get_by_name(GST_BIN(pipeline), "sink");
+    g_object_set(G_OBJECT(element), "location", path, NULL);
+    gst_object_unref(element);
+    return pipeline;
+}
+
+// Pushes frames[start..count) in order, skipping to the next keyframe after any that got overwritten
+static int push_frames(GstAppSrc *appsrc, const struct replay_frame *frames, uint64_t start, uint64_t count,
+                       const uint8_t *header, size_t header_size) {
+    uint64_t base_ns = frames[start].pts_ns;
+    bool need_keyframe = false;
+    int pushed = 0;
+
+    if (frames[start].dts_ns != GST_CLOCK_TIME_NONE && frames[start].dts_ns < base_ns)
+        base_ns = frames[start].dts_ns;
+
+    if (header_size > 0) {
+        GstBuffer *buf = gst_buffer_new_allocate(NULL, header_size, NULL);
+
+        gst_buffer_fill(buf, 0, header, header_size);
+        GST_BUFFER_FLAG_SET(buf, GST_BUFFER_FLAG_HEADER);
+        GST_BUFFER_PTS(buf) = 0;
+        if (gst_app_src_push_buffer(appsrc, buf) != GST_FLOW_OK)
+            return -1;
+    }
+
+    for (uint64_t i = start; i < count; i++) {
+        GstBuffer *buf;
+
+        if (replay->cancel)
+            return -1;
+        if (need_keyframe && !(frames[i].flags & REPLAY_FRAME_KEYFRAME))
+            continue;
+        buf = copy_frame(&frames[i], base_ns);
+        need_keyframe = !buf;
+        if (!buf)
+            continue;
+        if (gst_app_src_push_buffer(appsrc, buf) != GST_FLOW_OK)
+            return -1;
+        pushed++;
+    }
+    return pushed;
+}
+
+int replay_dump(unsigned int seconds, const char *path) {
+    struct replay_frame *frames;
+    uint8_t header[REPLAY_HEADER_MAX];
+    char caps_string[REPLAY_CAPS_MAX];
+    size_t header_size;
+    uint64_t count, start;
+    GstElement *pipeline, *src;
+    GstCaps *caps;
+    GstBus *bus;
+    GstMessage *message;
+    int pushed = -1;
+
+    if (!replay)
+        return -1;
+
+    // Only the index is copied under the lock, the frame data is read from
+    // the segments afterwards and checked against their generation
+    frames = (struct replay_frame *)malloc(sizeof(struct replay_frame) * REPLAY_INDEX_SIZE);
+    if (!frames)
+        return -1;
+    {
+        std::lock_guard<std::mutex> guard(replay->lock);
+        uint64_t first = replay->index_first;
+
+        if (replay->index_next - first > REPLAY_INDEX_SIZE)
+            first = replay->index_next - REPLAY_INDEX_SIZE;
+        count = replay->index_next - first;
+        for (uint64_t i = 0; i < count; i++)
+            frames[i] = replay->index[(first + i) % REPLAY_INDEX_SIZE];
+        strcpy(caps_string, replay->caps);
+        header_size = replay->header_size;
+        memcpy(header, replay->header, header_size);
+    }
+
+    start = count > 0 ? find_start(frames, count, seconds) : count;
+    if (start == count) {
+        fprintf(stderr, "Nothing recorded to replay yet\n");
+        free(frames);
+        return -1;
+    }
+
+    caps = gst_caps_from_string(caps_string);
+    pipeline = caps ? create_dump_pipeline(path, caps) : NULL;
+    if (caps)
+        gst_caps_unref(caps);
+    if (!pipeline) {
+        free(frames);
+        return -1;
+    }
+
+    if (gst_element_set_state(pipeline, GST_STATE_PLAYING) != GST_STATE_CHANGE_FAILURE) {
+        src = gst_bin_get_by_name(GST_BIN(pipeline), "src");
+        pushed = push_frames(GST_APP_SRC(src), frames, start, count, header, header_size);
+        gst_app_src_end_of_stream(GST_APP_SRC(src));
+        gst_object_unref(src);
+
+        bus = gst_element_get_bus(pipeline);
+        message = NULL;
+        for (int waited = 0; pushed >= 0 && !message && waited < REPLAY_DUMP_TIMEOUT_MS && !replay->cancel;
+             waited += REPLAY_DUMP_POLL_MS)
+            message = gst_bus_timed_pop_filtered(bus, REPLAY_DUMP_POLL_MS * GST_MSECOND,
+                                                 (GstMessageType)(GST_MESSAGE_EOS | GST_MESSAGE_ERROR));
+        if (!message || GST_MESSAGE_TYPE(message) != GST_MESSAGE_EOS)
+            pushed = -1;
+        if (message)
+            gst_message_unref(message);
+        gst_object_unref(bus);
+    }
+
+    gst_element_set_state(pipeline, GST_STATE_NULL);
+    gst_object_unref(pipeline);
+    free(frames);
+
+    if (pushed < 0)
+        fprintf(stderr, "Replay dump to %s failed\n", path);
+    else
+        fprintf(stderr, "Replayed %d frames (%u s) into %s\n", pushed, seconds, path);
+    return pushed;
+}
@@ -0,0 +1,415 @@
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <errno.h>
+#include <mutex>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/types.h>
+#include <thread>
+#include <unistd.h>
+
+#include <drm_fourcc.h>
+#include <gst/gst.h>
+#include <gst/video/video.h>
+#include <linux/dma-buf.h>
+
+#include <dmabuf-ref.h>
+#include <metrics.h>
+#include <snapshot.h>
+
+#define SNAPSHOT_ENCODE_TIMEOUT_MS 1000
+
+// One pixel, widened to 64 bit lanes so no box is large enough to overflow
+typedef uint8_t u8x4 __attribute__((vector_size(4)));
+typedef uint64_t u64x4 __attribute__((vector_size(32)));
+
+struct snapshot_frame {
+    struct dmabuf_ref *ref;
+    int width;
+    int height;
+    uint32_t format;
+    uint64_t modifier;
+    uint32_t offset;
+    int stride;
+};
+
+struct snapshot {
+    int width;
+    int interval_ms; // 0 for on request only
+    const char *mime;
+    std::thread thread;
+
+    std::mutex lock;
+    std::condition_variable cond;
+    bool quit;
+    std::atomic<bool> wanted; // the display thread hands the next frame over
+    struct snapshot_frame pending;
+
+    // Latest image, under the lock
+    uint8_t *image;
+    size_t image_size;
+    std::chrono::steady_clock::time_point image_time;
+    uint64_t image_count;
+
+    // Worker only, grown to the largest frame seen and reused
+    uint8_t *pixels;
+    size_t pixels_size;
+    u64x4 *sums;
+    int *edges;
+    int arena_width;
+};
+
+static struct snapshot *snapshot;
+
+static bool grow_arena(struct snapshot *snapshot, int width, int height) {
+    size_t pixels_size = (size_t)width * height * 4;
+
+    if (pixels_size > snapshot->pixels_size) {
+        uint8_t *pixels = (uint8_t *)realloc(snapshot->pixels, pixels_size);
+        if (!pixels)
+            return false;
+        snapshot->pixels = pixels;
+        snapshot->pixels_size = pixels_size;
+    }
+    if (width > snapshot->arena_width) {
+        u64x4 *sums = (u64x4 *)realloc(snapshot->sums, sizeof(u64x4) * width);
+        int *edges = (int *)realloc(snapshot->edges, sizeof(int) * (width + 1));
+        if (sums)
+            snapshot->sums = sums;
+        if (edges)
+            snapshot->edges = edges;
+        if (!sums || !edges)
+            return false;
+        snapshot->arena_width = width;
+    }
+    return true;
+}
+
+/* Averages every source pixel into exactly one destination pixel. Boxes are
+ * at least one pixel, the destination is never larger than the source. */
+static void box_filter(const uint8_t *src, int src_width, int src_height, int stride,
+                       uint8_t *dst, int dst_width, int dst_height, u64x4 *sums, int *edges) {
+    for (int x = 0; x <= dst_width; x++)
+        edges[x] = (int64_t)x * src_width / dst_width;
+
+    for (int y = 0; y < dst_height; y++) {
+        int y0 = (int64_t)y * src_height / dst_height;
+        int y1 = (int64_t)(y + 1) * src_height / dst_height;
+
+        memset(sums, 0, sizeof(u64x4) * dst_width);
+        for (int sy = y0; sy < y1; sy++) {
+            const uint8_t *row = src + (size_t)sy * stride;
+
+            for (int x = 0; x < dst_width; x++) {
+                u64x4 sum = {0, 0, 0, 0};
+
+                for (int sx = edges[x]; sx < edges[x + 1]; sx++) {
+                    u8x4 pixel;
+
+                    memcpy(&pixel, row + sx * 4, 4);
+                    sum += __builtin_convertvector(pixel, u64x4);
+                }
+                sums[x] += sum;
+            }
+        }
+
+        for (int x = 0; x < dst_width; x++) {
+            uint64_t count = (uint64_t)(edges[x + 1] - edges[x]) * (y1 - y0);
+            u8x4 pixel = __builtin_convertvector(sums[x] / count, u8x4);
+
+            memcpy(dst + ((size_t)y * dst_width + x) * 4, &pixel, 4);
+        }
+    }
+}
+
+// The GStreamer name of the byte order, NULL for what cannot be scaled here
+static const char *pixel_format(uint32_t format) {
+    switch (format) {
+    case DRM_FORMAT_XRGB8888:
+        return "BGRx";
+    case DRM_FORMAT_ARGB8888:
+        return "BGRA";
+    case DRM_FORMAT_XBGR8888:
+        return "RGBx";
+    case DRM_FORMAT_ABGR8888:
+        return "RGBA";
+    default:
+        return NULL;
+    }
+}
+
+static void sync_dmabuf(int fd, uint64_t flags) {
+    struct dma_buf_sync sync = {flags | DMA_BUF_SYNC_READ};
+
+    // Plain memfds from CPU producers do not need it and fail with ENOTTY
+    while (ioctl(fd, DMA_BUF_IOCTL_SYNC, &sync) < 0 && (errno == EINTR || errno == EAGAIN))
+        ;
+}
+
+// Scales the frame into the arena, returns the size of the result in *width/*height
+static int scale_frame(struct snapshot *snapshot, struct snapshot_frame *frame, int *width, int *height) {
+    static bool warned;
+    size_t map_size = frame->offset + (size_t)frame->stride * frame->height;
+    void *map;
+
+    if (!pixel_format(frame->format) ||
+        (frame->modifier != DRM_FORMAT_MOD_LINEAR && frame->modifier != DRM_FORMAT_MOD_INVALID)) {
+        if (!warned)
+            fprintf(stderr, "Snapshots need linear 32 bit RGB frames, got format 0x%08x modifier 0x%016llx\n",
+                    frame->format, (unsigned long long)frame->modifier);
+        warned = true;
+        return -1;
+    }
+
+    *width = frame->width < snapshot->width ? frame->width : snapshot->width;
+    *height = (int64_t)frame->height * *width / frame->width;
+    if (*height < 1)
+        *height = 1;
+    if (!grow_arena(snapshot, *width, *height))
+        return -1;
+
+    map = mmap(NULL, map_size, PROT_READ, MAP_SHARED, frame->ref->fd, 0);
+    if (map == MAP_FAILED) {
+        fprintf(stderr, "Failed to map frame for a snapshot: %s\n", strerror(errno));
+        return -1;
+    }
+    sync_dmabuf(frame->ref->fd, DMA_BUF_SYNC_START);
+    box_filter((const uint8_t *)map + frame->offset, frame->width, frame->height, frame->stride,
+               snapshot->pixels, *width, *height, snapshot->sums, snapshot->edges);
+    sync_dmabuf(frame->ref->fd, DMA_BUF_SYNC_END);
+    munmap(map, map_size);
+    return 0;
+}
+
+static int encode_image(struct snapshot *snapshot, const char *format, int width, int height,
+                        uint8_t **image, size_t *image_size) {
+    size_t size = (size_t)width * height * 4;
+    GstBuffer *buf = gst_buffer_new_wrapped_full((GstMemoryFlags)0, snapshot->pixels, size, 0, size, NULL, NULL);
+    GstCaps *caps = gst_caps_new_simple("video/x-raw",
+                                        "format", G_TYPE_STRING, format,
+                                        "width", G_TYPE_INT, width,
+                                        "height", G_TYPE_INT, height,
+                                        "framerate", GST_TYPE_FRACTION, 0, 1,
+                                        NULL);
+    GstCaps *to_caps = gst_caps_new_empty_simple(snapshot->mime);
+    GstSample *sample = gst_sample_new(buf, caps, NULL, NULL);
+    GError *err = NULL;
+    GstSample *encoded;
+    GstMapInfo map;
+    int res = -1;
+
+    // The arena is only borrowed, the conversion is done before this returns
+    encoded = gst_video_convert_sample(sample, to_caps, SNAPSHOT_ENCODE_TIMEOUT_MS * GST_MSECOND, &err);
+    gst_sample_unref(sample);
+    gst_buffer_unref(buf);
+    gst_caps_unref(caps);
+    gst_caps_unref(to_caps);
+    if (!encoded) {
+        fprintf(stderr, "Failed to encode a snapshot: %s\n", err ? err->message : "unknown error");
+        g_clear_error(&err);
+        return -1;
+    }
+
+    buf = gst_sample_get_buffer(encoded);
+    if (buf && gst_buffer_map(buf, &map, GST_MAP_READ)) {
+        *image = (uint8_t *)malloc(map.size);
+        if (*image) {
+            memcpy(*image, map.data, map.size);
+            *image_size = map.size;
+            res = 0;
+        }
+        gst_buffer_unmap(buf, &map);
+    }
+    gst_sample_unref(encoded);
+    return res;
+}
+
+static void process_frame(struct snapshot *snapshot, struct snapshot_frame *frame) {
+    uint8_t *image = NULL;
+    size_t image_size = 0;
+    int width, height;
+
+    if (scale_frame(snapshot, frame, &width, &height) < 0 ||
+        encode_image(snapshot, pixel_format(frame->format), width, height, &image, &image_size) < 0)
+        return;
+    metrics_inc(METRIC_SNAPSHOTS);
+
+    std::lock_guard<std::mutex> guard(snapshot->lock);
+    free(snapshot->image);
+    snapshot->image = image;
+    snapshot->image_size = image_size;
+    snapshot->image_time = std::chrono::steady_clock::now();
+    snapshot->image_count++;
+    snapshot->cond.notify_all();
+}
+
+static void run_snapshot(struct snapshot *snapshot) {
+    auto next = std::chrono::steady_clock::now();
+
+    while (true) {
+        struct snapshot_frame frame;
+        std::unique_lock<std::mutex> guard(snapshot->lock);
+
+        while (!snapshot->quit && !snapshot->pending.ref) {
+            if (!snapshot->interval_ms) {
+                snapshot->cond.wait(guard);
+            } else if (snapshot->cond.wait_until(guard, next) == std::cv_status::timeout) {
+                snapshot->wanted = true;
+                next = std::chrono::steady_clock::now() + std::chrono::milliseconds(snapshot->interval_ms);
+            }
+        }
+        if (snapshot->quit)
+            return;
+
+        frame = snapshot->pending;
+        snapshot->pending.ref = NULL;
+        guard.unlock();
+
+        process_frame(snapshot, &frame);
+        dmabuf_ref_put(frame.ref);
+    }
+}
+
+int snapshot_start(const char *spec) {
+    int width = SNAPSHOT_DEFAULT_WIDTH;
+    int seconds = 0;
+    const char *mime = "image/jpeg";
+    char *copy, *save = NULL;
+    int numbers = 0;
+
+    if (snapshot)
+        return 0;
+
+    copy = strdup(spec);
+    if (!copy)
+        return -1;
+    for (char *token = strtok_r(copy, ":", &save); token; token = strtok_r(NULL, ":", &save)) {
+        char *end;
+        long value;
+
+        if (strcmp(token, "jpeg") == 0) {
+            mime = "image/jpeg";
+            continue;
+        }
+        if (strcmp(token, "webp") == 0) {
+            mime = "image/webp";
+            continue;
+        }
+        value = strtol(token, &end, 10);
+        if (end == token || *end != '\0' || value <= 0 || value > 65535 || numbers == 2) {
+            fprintf(stderr, "Invalid snapshot setting: %s\n", spec);
+            free(copy);
+            return -1;
+        }
+        if (numbers++ == 0)
+            width = value;
+        else
+            seconds = value;
+    }
+    free(copy);
+
+    // Not every GStreamer install has the webp plugin, JPEG always works
+    if (strcmp(mime, "image/webp") == 0) {
+        GstElementFactory *factory = gst_init_check(NULL, NULL, NULL) ? gst_element_factory_find("webpenc") : NULL;
+
+        if (factory) {
+            gst_object_unref(factory);
+        } else {
+            fprintf(stderr, "webpenc is not available, snapshots fall back to JPEG\n");
+            mime = "image/jpeg";
+        }
+    }
+
+    snapshot = new struct snapshot();
+    snapshot->width = width;
+    snapshot->interval_ms = seconds * 1000;
+    snapshot->mime = mime;
+    snapshot->wanted = false;
+    snapshot->thread = std::thread(run_snapshot, snapshot);
+
+    fprintf(stderr, "Snapshots %d px wide as %s%s\n", width, mime, seconds ? ", refreshed periodically" : "");
+    return 0;
+}
+
+void snapshot_stop(void) {
+    if (!snapshot)
+        return;
+
+    {
+        std::lock_guard<std::mutex> guard(snapshot->lock);
+        snapshot->quit = true;
+        snapshot->cond.notify_all();
+    }
+    snapshot->thread.join();
+
+    if (snapshot->pending.ref)
+        dmabuf_ref_put(snapshot->pending.ref);
+    free(snapshot->image);
+    free(snapshot->pixels);
+    free(snapshot->sums);
+    free(snapshot->edges);
+    delete snapshot;
+    snapshot = NULL;
+}
+
+bool snapshot_enabled(void) {
+    return snapshot != NULL;
+}
+
+void snapshot_offer(struct dmabuf_ref *frame, int width, int height, uint32_t format, uint64_t modifier,
+                    uint32_t offset, int stride) {
+    if (!snapshot || !snapshot->wanted.load(std::memory_order_relaxed))
+        return;
+
+    // Never waits on the worker, a later frame does as well
+    std::unique_lock<std::mutex> guard(snapshot->lock, std::try_to_lock);
+    if (!guard.owns_lock() || snapshot->pending.ref)
+        return;
+
+    snapshot->pending = {dmabuf_ref_get(frame), width, height, format, modifier, offset, stride};
+    snapshot->wanted = false;
+    snapshot->cond.notify_all();
+}
+
+bool snapshot_wanted(void) {
+    return snapshot && snapshot->wanted.load(std::memory_order_relaxed);
+}
+
+static bool stale(void) {
+    return !snapshot->image ||
+           std::chrono::steady_clock::now() - snapshot->image_time >= std::chrono::milliseconds(SNAPSHOT_MIN_INTERVAL_MS);
+}
+
+bool snapshot_request(void) {
+    std::lock_guard<std::mutex> guard(snapshot->lock);
+
+    if (stale())
+        snapshot->wanted = true;
+    return snapshot->wanted;
+}
+
+ssize_t snapshot_get(uint8_t **data, const char **mime) {
+    std::unique_lock<std::mutex> guard(snapshot->lock);
+
+    if (stale()) {
+        uint64_t count = snapshot->image_count;
+
+        snapshot->wanted = true;
+        // Without new frames (paused producer) the last image is served
+        snapshot->cond.wait_for(guard, std::chrono::milliseconds(SNAPSHOT_WAIT_MS),
+                                [&] { return snapshot->image_count != count || snapshot->quit; });
+    }
+    if (!snapshot->image)
+        return -1;
+
+    *data = (uint8_t *)malloc(snapshot->image_size);
+    if (!*data)
+        return -1;
+    memcpy(*data, snapshot->image, snapshot->image_size);
+    *mime = snapshot->mime;
+    return snapshot->image_size;
+}
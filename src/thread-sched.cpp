@@ -0,0 +1,309 @@
+#include <atomic>
+#include <errno.h>
+#include <fcntl.h>
+#include <mutex>
+#include <poll.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <thread>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+
+#include <metrics.h>
+#include <thread-sched.h>
+
+#define SCHED_MAX_THREADS 64
+#define SCHED_REPORT_INTERVAL_MS 10000
+
+struct sched_settings {
+    bool configured;
+    bool has_cpus;
+    cpu_set_t cpus;
+    int policy; // SCHED_OTHER keeps the default policy
+    int priority;
+    bool has_nice;
+    int nice;
+    std::atomic<bool> warned; // every thread of the stage may fail at once
+};
+
+struct sched_thread {
+    pid_t tid;
+    enum sched_stage stage;
+    unsigned long long wait_ns;
+    unsigned long long slices;
+};
+
+struct sched_reporter {
+    int wake_fds[2];
+    std::thread thread;
+};
+
+static_assert(METRIC_SCHED_WAIT_ENCODER - METRIC_SCHED_WAIT_DISPLAY == SCHED_STAGE_ENCODER &&
+              METRIC_SCHED_WORST_WAIT_ENCODER - METRIC_SCHED_WORST_WAIT_DISPLAY == SCHED_STAGE_ENCODER,
+              "per stage metrics must follow the SCHED_STAGE_* order");
+
+static const char *STAGE_NAME[SCHED_STAGE_TOTAL] = {
+    "display",
+    "input",
+    "streaming",
+    "encoder",
+};
+
+static struct sched_settings settings[SCHED_STAGE_TOTAL];
+static bool active;
+static std::mutex threads_lock;
+static struct sched_thread threads[SCHED_MAX_THREADS];
+static int threads_count;
+static struct sched_reporter *reporter;
+
+static int parse_cpus(const char *list, cpu_set_t *cpus) {
+    const char *p = list;
+
+    CPU_ZERO(cpus);
+    while (*p) {
+        char *end;
+        long first = strtol(p, &end, 10), last;
+
+        if (end == p || first < 0 || first >= CPU_SETSIZE)
+            return -1;
+        last = first;
+        if (*end == '-') {
+            p = end + 1;
+            last = strtol(p, &end, 10);
+            if (end == p || last < first || last >= CPU_SETSIZE)
+                return -1;
+        }
+        for (long cpu = first; cpu <= last; cpu++)
+            CPU_SET(cpu, cpus);
+        if (*end == ',')
+            end++;
+        else if (*end)
+            return -1;
+        p = end;
+    }
+
+    return CPU_COUNT(cpus) > 0 ? 0 : -1;
+}
+
+static int parse_setting(struct sched_settings *stage, char *setting) {
+    char *value = strchr(setting, '=');
+
+    if (!value)
+        return -1;
+    *value++ = '\0';
+
+    if (strcmp(setting, "cpus") == 0) {
+        stage->has_cpus = true;
+        return parse_cpus(value, &stage->cpus);
+    }
+    if (strcmp(setting, "fifo") == 0 || strcmp(setting, "rr") == 0) {
+        int policy = setting[0] == 'f' ? SCHED_FIFO : SCHED_RR;
+
+        stage->policy = policy;
+        stage->priority = strtol(value, NULL, 10);
+        if (stage->priority < sched_get_priority_min(policy) || stage->priority > sched_get_priority_max(policy))
+            return -1;
+        return 0;
+    }
+    if (strcmp(setting, "nice") == 0) {
+        stage->has_nice = true;
+        stage->nice = strtol(value, NULL, 10);
+        return stage->nice < -20 || stage->nice > 19 ? -1 : 0;
+    }
+
+    return -1;
+}
+
+int sched_parse(const char *spec) {
+    char *copy = strdup(spec), *save = NULL;
+    char *name = strtok_r(copy, ":", &save);
+    struct sched_settings *stage = NULL;
+    int ret = 0;
+
+    for (int i = 0; name && i < SCHED_STAGE_TOTAL; i++)
+        if (strcmp(name, STAGE_NAME[i]) == 0)
+            stage = &settings[i];
+    if (!stage) {
+        fprintf(stderr, "Unknown scheduling stage in %s, expected display, input, streaming or encoder\n", spec);
+        free(copy);
+        return -1;
+    }
+
+    stage->policy = SCHED_OTHER;
+    for (char *setting = strtok_r(NULL, ":", &save); setting; setting = strtok_r(NULL, ":", &save)) {
+        if (parse_setting(stage, setting) < 0) {
+            fprintf(stderr, "Invalid scheduling setting in %s\n", spec);
+            ret = -1;
+            break;
+        }
+    }
+    free(copy);
+
+    stage->configured = ret == 0;
+    active = active || stage->configured;
+    return ret;
+}
+
+bool sched_configured(enum sched_stage stage) {
+    return settings[stage].configured;
+}
+
+static void register_thread(pid_t tid, enum sched_stage stage) {
+    std::lock_guard<std::mutex> guard(threads_lock);
+
+    for (int i = 0; i < threads_count; i++) {
+        if (threads[i].tid == tid) {
+            threads[i].stage = stage;
+            return;
+        }
+    }
+    if (threads_count == SCHED_MAX_THREADS)
+        return;
+    threads[threads_count].tid = tid;
+    threads[threads_count].stage = stage;
+    threads[threads_count].wait_ns = 0;
+    threads[threads_count].slices = 0;
+    threads_count++;
+}
+
+/* Applies the stage's settings to the calling thread. Each thread applies
+ * a stage once, later calls for the same stage are free. A streaming or
+ * encoder thread that happens to deliver input stays where it is. */
+void sched_apply(enum sched_stage stage) {
+    static thread_local int applied = -1;
+    struct sched_settings *config = &settings[stage];
+    pid_t tid;
+    int failed = 0;
+
+    if (!active || applied == stage)
+        return;
+    if (stage == SCHED_STAGE_INPUT && (applied == SCHED_STAGE_STREAMING || applied == SCHED_STAGE_ENCODER))
+        return;
+    applied = stage;
+    tid = syscall(SYS_gettid);
+    register_thread(tid, stage);
+
+    if (!config->configured)
+        return;
+
+    if (config->has_cpus && sched_setaffinity(0, sizeof(config->cpus), &config->cpus) < 0)
+        failed = errno;
+    if (config->policy != SCHED_OTHER) {
+        struct sched_param param;
+
+        param.sched_priority = config->priority;
+        if (sched_setscheduler(0, config->policy | SCHED_RESET_ON_FORK, &param) < 0)
+            failed = errno;
+    }
+    if (config->has_nice && setpriority(PRIO_PROCESS, tid, config->nice) < 0)
+        failed = errno;
+
+    // Only report the first failure per stage, every thread would repeat it
+    if (failed && !config->warned.exchange(true)) {
+        fprintf(stderr, "Failed to apply %s scheduling: %s%s\n", STAGE_NAME[stage], strerror(failed),
+                failed == EPERM ? " (needs CAP_SYS_NICE or an RLIMIT_RTPRIO)" : "");
+    }
+}
+
+static bool read_schedstat(pid_t tid, unsigned long long *wait_ns, unsigned long long *slices) {
+    char path[64];
+    unsigned long long run_ns;
+    FILE *file;
+    int res;
+
+    snprintf(path, sizeof(path), "/proc/self/task/%d/schedstat", tid);
+    file = fopen(path, "r");
+    if (!file)
+        return false;
+    res = fscanf(file, "%llu %llu %llu", &run_ns, wait_ns, slices);
+    fclose(file);
+
+    return res == 3;
+}
+
+/* Average run queue wait per timeslice of each stage since the last report,
+ * and the worst thread of the stage. Logged and kept in the metrics gauges. */
+static void report(void) {
+    unsigned long long wait_ns[SCHED_STAGE_TOTAL] = {0}, slices[SCHED_STAGE_TOTAL] = {0};
+    unsigned long long worst_ns[SCHED_STAGE_TOTAL] = {0};
+    int count[SCHED_STAGE_TOTAL] = {0};
+    std::lock_guard<std::mutex> guard(threads_lock);
+
+    for (int i = 0; i < threads_count; i++) {
+        struct sched_thread *thread = &threads[i];
+        unsigned long long wait, slice;
+
+        if (!read_schedstat(thread->tid, &wait, &slice)) {
+            // The thread exited, forget it
+            threads[i--] = threads[--threads_count];
+            continue;
+        }
+
+        unsigned long long delta_wait = wait - thread->wait_ns, delta_slices = slice - thread->slices;
+        thread->wait_ns = wait;
+        thread->slices = slice;
+
+        wait_ns[thread->stage] += delta_wait;
+        slices[thread->stage] += delta_slices;
+        count[thread->stage]++;
+        if (delta_slices && delta_wait / delta_slices > worst_ns[thread->stage])
+            worst_ns[thread->stage] = delta_wait / delta_slices;
+    }
+
+    for (int i = 0; i < SCHED_STAGE_TOTAL; i++) {
+        unsigned long long avg_ns = slices[i] ? wait_ns[i] / slices[i] : 0;
+
+        metrics_gauge_set((enum metric_gauge)(METRIC_SCHED_WAIT_DISPLAY + i), avg_ns / 1000);
+        metrics_gauge_set((enum metric_gauge)(METRIC_SCHED_WORST_WAIT_DISPLAY + i), worst_ns[i] / 1000);
+        if (!count[i])
+            continue;
+        fprintf(stderr, "Sched %s: %d threads, wait avg %llu us per slice, worst thread %llu us\n",
+                STAGE_NAME[i], count[i], avg_ns / 1000, worst_ns[i] / 1000);
+    }
+}
+
+static void run_reporter(struct sched_reporter *reporter) {
+    struct pollfd pfd = {reporter->wake_fds[0], POLLIN, 0};
+
+    while (true) {
+        int res = poll(&pfd, 1, SCHED_REPORT_INTERVAL_MS);
+
+        if (res < 0 && errno != EINTR)
+            return;
+        if (res > 0)
+            return;
+        report();
+    }
+}
+
+int sched_start(void) {
+    if (!active || reporter)
+        return 0;
+
+    reporter = new sched_reporter();
+    if (pipe2(reporter->wake_fds, O_CLOEXEC) < 0) {
+        delete reporter;
+        reporter = NULL;
+        return -1;
+    }
+    reporter->thread = std::thread(run_reporter, reporter);
+    return 0;
+}
+
+void sched_stop(void) {
+    if (!reporter)
+        return;
+
+    if (write(reporter->wake_fds[1], "q", 1) == 1)
+        reporter->thread.join();
+    else
+        reporter->thread.detach();
+    close(reporter->wake_fds[0]);
+    close(reporter->wake_fds[1]);
+    delete reporter;
+    reporter = NULL;
+}
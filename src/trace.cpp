@@ -0,0 +1,215 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <thread>
+#include <time.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+
+#include <trace.h>
+
+struct trace_span {
+    const char *name;
+    uint64_t start_ns;
+    uint64_t end_ns;
+    uint64_t id;
+    uint32_t tid;
+};
+
+/*
+ * Only the owning thread writes a ring. `head` is published with release
+ * after a span is complete, a dump copies the spans below it and drops the
+ * ones the writer may have overwritten meanwhile. Rings outlive their
+ * threads so a dump still shows what an exited thread did, and are reused
+ * by the next new thread.
+ */
+struct trace_ring {
+    std::atomic<uint64_t> head;
+    std::atomic<bool> in_use;
+    struct trace_ring *next;
+    struct trace_span spans[TRACE_RING_SIZE];
+};
+
+struct trace_dumper {
+    const char *path;
+    int wake_fds[2];
+    std::thread thread;
+};
+
+std::atomic<bool> trace_enabled;
+
+static std::atomic<struct trace_ring *> rings;
+static struct trace_dumper *dumper;
+static int signal_fd = -1;
+
+uint64_t trace_now_ns(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static struct trace_ring *acquire_ring(void) {
+    struct trace_ring *ring;
+
+    for (ring = rings.load(std::memory_order_acquire); ring; ring = ring->next) {
+        bool expected = false;
+        if (ring->in_use.compare_exchange_strong(expected, true))
+            return ring;
+    }
+
+    ring = new trace_ring();
+    ring->in_use = true;
+    ring->next = rings.load(std::memory_order_relaxed);
+    while (!rings.compare_exchange_weak(ring->next, ring, std::memory_order_release))
+        ;
+    return ring;
+}
+
+struct ring_owner {
+    struct trace_ring *ring = acquire_ring();
+    uint32_t tid = syscall(SYS_gettid);
+
+    ~ring_owner() { ring->in_use.store(false, std::memory_order_release); }
+};
+
+void trace_record(const char *name, uint64_t start_ns, uint64_t end_ns, uint64_t id) {
+    static thread_local ring_owner owner;
+    struct trace_ring *ring = owner.ring;
+    uint64_t head = ring->head.load(std::memory_order_relaxed);
+    struct trace_span *span = &ring->spans[head & (TRACE_RING_SIZE - 1)];
+
+    span->name = name;
+    span->start_ns = start_ns;
+    span->end_ns = end_ns;
+    span->id = id;
+    span->tid = owner.tid;
+    ring->head.store(head + 1, std::memory_order_release);
+}
+
+static void write_ring(FILE *out, struct trace_ring *ring, struct trace_span *copy, bool *first) {
+    uint64_t head = ring->head.load(std::memory_order_acquire);
+    uint64_t base = head > TRACE_RING_SIZE ? head - TRACE_RING_SIZE : 0;
+    uint64_t tail = base;
+    pid_t pid = getpid();
+
+    for (uint64_t i = base; i < head; i++)
+        copy[i - base] = ring->spans[i & (TRACE_RING_SIZE - 1)];
+
+    // Skip slots the writer reached while they were copied, including the
+    // one it may be filling right now
+    uint64_t new_head = ring->head.load(std::memory_order_acquire);
+    if (new_head + 1 > base + TRACE_RING_SIZE)
+        tail = new_head + 1 - TRACE_RING_SIZE;
+
+    for (uint64_t i = tail; i < head; i++) {
+        struct trace_span *span = &copy[i - base];
+
+        fprintf(out, "%s\n{\"name\":\"%s\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,\"pid\":%d,\"tid\":%u,\"args\":{\"id\":%" PRIu64 "}}",
+                *first ? "" : ",", span->name, span->start_ns / 1000.0,
+                (span->end_ns - span->start_ns) / 1000.0, pid, span->tid, span->id);
+        *first = false;
+    }
+}
+
+int trace_dump(const char *path) {
+    struct trace_span *copy;
+    bool first = true;
+    FILE *out;
+
+    out = fopen(path, "w");
+    if (!out) {
+        fprintf(stderr, "Failed to open trace %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+
+    copy = (struct trace_span *)malloc(sizeof(*copy) * TRACE_RING_SIZE);
+    fprintf(out, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[");
+    for (struct trace_ring *ring = rings.load(std::memory_order_acquire); ring; ring = ring->next)
+        write_ring(out, ring, copy, &first);
+    fprintf(out, "\n]}\n");
+    free(copy);
+    fclose(out);
+
+    fprintf(stderr, "Wrote trace to %s\n", path);
+    return 0;
+}
+
+static void handle_sigusr1(int) {
+    int saved_errno = errno;
+
+    if (write(signal_fd, "", 1) < 0) {
+        // Nothing to do, a dump is already pending
+    }
+    errno = saved_errno;
+}
+
+// Dumps outside of the signal handler, fopen and friends are not async-signal-safe
+static void run_dumper(struct trace_dumper *dumper) {
+    struct pollfd pfd = {dumper->wake_fds[0], POLLIN, 0};
+    char byte;
+
+    while (true) {
+        if (poll(&pfd, 1, -1) < 0) {
+            if (errno == EINTR)
+                continue;
+            return;
+        }
+        if (read(dumper->wake_fds[0], &byte, 1) != 1 || byte == 'q')
+            return;
+        trace_dump(dumper->path);
+    }
+}
+
+int trace_start(const char *path) {
+    struct sigaction action;
+
+    if (dumper)
+        return 0;
+
+    dumper = new trace_dumper();
+    dumper->path = path;
+    if (pipe2(dumper->wake_fds, O_CLOEXEC | O_NONBLOCK) < 0) {
+        fprintf(stderr, "Failed to create trace pipe: %s\n", strerror(errno));
+        delete dumper;
+        dumper = NULL;
+        return -1;
+    }
+    signal_fd = dumper->wake_fds[1];
+    dumper->thread = std::thread(run_dumper, dumper);
+
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = handle_sigusr1;
+    action.sa_flags = SA_RESTART;
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGUSR1, &action, NULL);
+
+    trace_enabled.store(true, std::memory_order_relaxed);
+    fprintf(stderr, "Tracing enabled, send SIGUSR1 to write %s\n", path);
+    return 0;
+}
+
+void trace_stop(void) {
+    if (!dumper)
+        return;
+
+    trace_enabled.store(false, std::memory_order_relaxed);
+    signal(SIGUSR1, SIG_IGN);
+
+    if (write(dumper->wake_fds[1], "q", 1) == 1)
+        dumper->thread.join();
+    else
+        dumper->thread.detach();
+    trace_dump(dumper->path);
+
+    signal_fd = -1;
+    close(dumper->wake_fds[0]);
+    close(dumper->wake_fds[1]);
+    delete dumper;
+    dumper = NULL;
+}
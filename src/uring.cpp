@@ -0,0 +1,648 @@
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#include <uring.h>
+
+#ifdef HAVE_LIBURING
+
+#include <algorithm>
+#include <deque>
+#include <vector>
+#include <liburing.h>
+
+#define URING_RECV_GROUP 0
+#define URING_DETACH_TIMEOUT_MS 1000
+
+// user_data is the kind, a generation and a slot
+enum {
+    URING_TAG_IGNORE, // cancellations
+    URING_TAG_POLL,
+    URING_TAG_RECV,
+};
+
+static uint64_t uring_tag(uint64_t kind, uint32_t gen, unsigned slot) {
+    return kind << 56 | (uint64_t)gen << 8 | slot;
+}
+
+// An fd arrived with the bytes [begin, end) of the stream
+struct uring_fd {
+    uint64_t begin;
+    uint64_t end;
+    int fd;
+};
+
+struct uring_poll_slot {
+    int fd; // -1 while not armed
+    uint32_t gen;
+    short revents;
+};
+
+struct uring_recv {
+    struct io_uring ring;
+    struct io_uring_buf_ring *buf_ring;
+    char *buffers;
+    struct uring_poll_slot slots[URING_POLL_SLOTS];
+
+    // The multishot receive, its template has to live as long as it does
+    int sock;
+    uint32_t gen;
+    bool armed;
+    struct msghdr msg;
+
+    // Received bytes not yet returned as messages, data[0] is at stream offset `offset`
+    std::vector<char> data;
+    size_t pos;
+    uint64_t offset;
+    std::deque<struct uring_fd> fds;
+    bool received; // anything at all on this socket
+    bool eof;
+    int error;
+    bool unsupported;
+};
+
+static struct io_uring_sqe *get_sqe(struct io_uring *ring) {
+    struct io_uring_sqe *sqe = io_uring_get_sqe(ring);
+
+    // Full, make room. URING_ENTRIES covers a whole wait, this is a fallback.
+    if (!sqe) {
+        io_uring_submit(ring);
+        sqe = io_uring_get_sqe(ring);
+    }
+    return sqe;
+}
+
+static int init_ring(struct io_uring *ring, unsigned cq_entries) {
+    struct io_uring_params params;
+    int ret;
+
+    memset(&params, 0, sizeof(params));
+    params.flags = IORING_SETUP_CQSIZE;
+    params.cq_entries = cq_entries;
+    ret = io_uring_queue_init_params(URING_ENTRIES, ring, &params);
+    if (ret < 0)
+        fprintf(stderr, "io_uring setup failed: %s\n", strerror(-ret));
+    return ret;
+}
+
+struct uring_recv *uring_recv_new(void) {
+    struct uring_recv *recv = new struct uring_recv();
+    int ret;
+
+    // Every buffer may complete before the next wait, plus the polls
+    if (init_ring(&recv->ring, URING_RECV_BUFFERS * 2) < 0) {
+        delete recv;
+        return NULL;
+    }
+
+    recv->buf_ring = io_uring_setup_buf_ring(&recv->ring, URING_RECV_BUFFERS, URING_RECV_GROUP, 0, &ret);
+    recv->buffers = (char *)malloc(URING_RECV_BUFFERS * URING_RECV_BUFFER_SIZE);
+    if (!recv->buf_ring || !recv->buffers) {
+        fprintf(stderr, "io_uring buffer ring setup failed: %s\n", strerror(recv->buf_ring ? ENOMEM : -ret));
+        uring_recv_free(recv);
+        return NULL;
+    }
+    for (int i = 0; i < URING_RECV_BUFFERS; i++) {
+        io_uring_buf_ring_add(recv->buf_ring, recv->buffers + i * URING_RECV_BUFFER_SIZE, URING_RECV_BUFFER_SIZE, i,
+                              io_uring_buf_ring_mask(URING_RECV_BUFFERS), i);
+    }
+    io_uring_buf_ring_advance(recv->buf_ring, URING_RECV_BUFFERS);
+
+    for (int i = 0; i < URING_POLL_SLOTS; i++)
+        recv->slots[i].fd = -1;
+    recv->sock = -1;
+    // Only fds are expected as ancillary data
+    recv->msg.msg_controllen = CMSG_SPACE(sizeof(int) * URING_RECV_MAX_FDS);
+    return recv;
+}
+
+static void drop_received(struct uring_recv *recv) {
+    for (struct uring_fd &entry : recv->fds)
+        close(entry.fd);
+    recv->fds.clear();
+    recv->data.clear();
+    recv->pos = 0;
+    recv->offset = 0;
+    recv->received = false;
+    recv->eof = false;
+    recv->error = 0;
+}
+
+void uring_recv_free(struct uring_recv *recv) {
+    if (!recv)
+        return;
+    drop_received(recv);
+    // Also cancels whatever is still posted
+    if (recv->buf_ring)
+        io_uring_free_buf_ring(&recv->ring, recv->buf_ring, URING_RECV_BUFFERS, URING_RECV_GROUP);
+    io_uring_queue_exit(&recv->ring);
+    free(recv->buffers);
+    delete recv;
+}
+
+// Takes what one completion received off its buffer
+static void take_buffer(struct uring_recv *recv, void *buf, int len) {
+    struct io_uring_recvmsg_out *out = io_uring_recvmsg_validate(buf, len, &recv->msg);
+    uint64_t begin = recv->offset + recv->data.size();
+    unsigned payload_len;
+    char *payload;
+
+    if (!out) {
+        recv->error = EPROTO;
+        return;
+    }
+    payload_len = io_uring_recvmsg_payload_length(out, len, &recv->msg);
+    payload = (char *)io_uring_recvmsg_payload(out, &recv->msg);
+
+    for (struct cmsghdr *cmsg = io_uring_recvmsg_cmsg_firsthdr(out, &recv->msg); cmsg;
+         cmsg = io_uring_recvmsg_cmsg_nexthdr(out, &recv->msg, cmsg)) {
+        size_t count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+
+        if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS)
+            continue;
+        for (size_t i = 0; i < count; i++) {
+            struct uring_fd entry = {begin, begin + payload_len, -1};
+
+            memcpy(&entry.fd, CMSG_DATA(cmsg) + i * sizeof(int), sizeof(int));
+            recv->fds.push_back(entry);
+        }
+    }
+    if (out->flags & MSG_CTRUNC)
+        fprintf(stderr, "More than %d fds in one receive, the rest was closed\n", URING_RECV_MAX_FDS);
+
+    if (payload_len == 0) {
+        recv->eof = true;
+        return;
+    }
+    recv->data.insert(recv->data.end(), payload, payload + payload_len);
+    recv->received = true;
+}
+
+static void recv_completed(struct uring_recv *recv, struct io_uring_cqe *cqe, bool current) {
+    if (cqe->flags & IORING_CQE_F_BUFFER) {
+        unsigned short bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+        char *buf = recv->buffers + bid * URING_RECV_BUFFER_SIZE;
+
+        if (current && cqe->res > 0)
+            take_buffer(recv, buf, cqe->res);
+        // Straight back to the kernel, the bytes were copied out
+        io_uring_buf_ring_add(recv->buf_ring, buf, URING_RECV_BUFFER_SIZE, bid,
+                              io_uring_buf_ring_mask(URING_RECV_BUFFERS), 0);
+        io_uring_buf_ring_advance(recv->buf_ring, 1);
+    } else if (current && cqe->res == 0) {
+        recv->eof = true;
+    }
+
+    // A completion of a socket that was replaced
+    if (!current)
+        return;
+    if (!(cqe->flags & IORING_CQE_F_MORE))
+        recv->armed = false;
+    // Out of buffers or detached, posted again by the next wait
+    if (cqe->res >= 0 || cqe->res == -ENOBUFS || cqe->res == -ECANCELED)
+        return;
+    if (cqe->res == -EINVAL && !recv->received)
+        recv->unsupported = true;
+    else
+        recv->error = -cqe->res;
+}
+
+static void reap(struct uring_recv *recv) {
+    struct io_uring_cqe *cqe;
+    unsigned head, count = 0;
+
+    io_uring_for_each_cqe(&recv->ring, head, cqe) {
+        uint64_t tag = io_uring_cqe_get_data64(cqe);
+        unsigned kind = tag >> 56, slot = tag & 0xff;
+        uint32_t gen = tag >> 8;
+
+        count++;
+        if (kind == URING_TAG_RECV) {
+            recv_completed(recv, cqe, gen == recv->gen);
+        } else if (kind == URING_TAG_POLL && slot < URING_POLL_SLOTS && gen == recv->slots[slot].gen) {
+            // One-shot, posted again by the next wait
+            recv->slots[slot].fd = -1;
+            if (cqe->res != -ECANCELED)
+                recv->slots[slot].revents = cqe->res < 0 ? POLLERR : cqe->res;
+        }
+    }
+    io_uring_cq_advance(&recv->ring, count);
+}
+
+static void cancel(struct uring_recv *recv, uint64_t tag) {
+    struct io_uring_sqe *sqe = get_sqe(&recv->ring);
+
+    io_uring_prep_cancel64(sqe, tag, 0);
+    io_uring_sqe_set_data64(sqe, uring_tag(URING_TAG_IGNORE, 0, 0));
+}
+
+static void arm_recv(struct uring_recv *recv) {
+    struct io_uring_sqe *sqe = get_sqe(&recv->ring);
+
+    io_uring_prep_recvmsg_multishot(sqe, recv->sock, &recv->msg, MSG_CMSG_CLOEXEC);
+    sqe->flags |= IOSQE_BUFFER_SELECT;
+    sqe->buf_group = URING_RECV_GROUP;
+    io_uring_sqe_set_data64(sqe, uring_tag(URING_TAG_RECV, recv->gen, 0));
+    recv->armed = true;
+}
+
+static void set_socket(struct uring_recv *recv, int sock) {
+    // The receive holds the old socket open until it is cancelled
+    if (recv->armed)
+        cancel(recv, uring_tag(URING_TAG_RECV, recv->gen, 0));
+    drop_received(recv);
+    recv->sock = sock;
+    recv->gen++;
+    recv->armed = false;
+}
+
+static void set_poll(struct uring_recv *recv, unsigned slot, int fd, short events) {
+    struct uring_poll_slot *entry = &recv->slots[slot];
+    struct io_uring_sqe *sqe;
+
+    if (entry->fd == fd)
+        return;
+    if (entry->fd >= 0)
+        cancel(recv, uring_tag(URING_TAG_POLL, entry->gen, slot));
+    entry->fd = fd;
+    entry->gen++;
+    entry->revents = 0;
+    if (fd < 0)
+        return;
+
+    sqe = get_sqe(&recv->ring);
+    io_uring_prep_poll_add(sqe, fd, events);
+    io_uring_sqe_set_data64(sqe, uring_tag(URING_TAG_POLL, entry->gen, slot));
+}
+
+static bool have_message(struct uring_recv *recv) {
+    size_t available = recv->data.size() - recv->pos;
+    MessageHeader header;
+
+    if (available < sizeof(header))
+        return false;
+    memcpy(&header, recv->data.data() + recv->pos, sizeof(header));
+    // Too long is reported by uring_recv_message()
+    return header.length > sizeof(MessageData) || available >= sizeof(header) + header.length;
+}
+
+bool uring_recv_pending(struct uring_recv *recv) {
+    return have_message(recv) || recv->eof || recv->error;
+}
+
+int uring_recv_poll(struct uring_recv *recv, struct pollfd *fds, nfds_t nfds, int recv_sock, int timeout_ms) {
+    struct __kernel_timespec ts;
+    struct io_uring_cqe *cqe;
+    int ready = 0, ret;
+
+    if (nfds > URING_POLL_SLOTS) {
+        errno = EINVAL;
+        return -1;
+    }
+    if (recv->unsupported) {
+        errno = EOPNOTSUPP;
+        return -1;
+    }
+
+    if (recv_sock != recv->sock)
+        set_socket(recv, recv_sock);
+    for (nfds_t i = 0; i < URING_POLL_SLOTS; i++) {
+        bool wanted = i < nfds && fds[i].fd >= 0 && fds[i].fd != recv_sock;
+
+        set_poll(recv, i, wanted ? fds[i].fd : -1, wanted ? fds[i].events : 0);
+    }
+    if (recv->sock >= 0 && !recv->armed && !recv->eof && !recv->error)
+        arm_recv(recv);
+
+    ts.tv_sec = timeout_ms / 1000;
+    ts.tv_nsec = (long long)(timeout_ms % 1000) * 1000000;
+    // What was received already is handled first
+    if (uring_recv_pending(recv))
+        ret = io_uring_submit(&recv->ring);
+    else
+        ret = io_uring_submit_and_wait_timeout(&recv->ring, &cqe, 1, timeout_ms >= 0 ? &ts : NULL, NULL);
+    if (ret < 0 && ret != -ETIME) {
+        errno = -ret;
+        return -1;
+    }
+    reap(recv);
+    if (recv->unsupported) {
+        errno = EOPNOTSUPP;
+        return -1;
+    }
+
+    for (nfds_t i = 0; i < nfds; i++) {
+        fds[i].revents = 0;
+        if (fds[i].fd >= 0 && fds[i].fd == recv_sock) {
+            fds[i].revents = uring_recv_pending(recv) ? POLLIN : 0;
+        } else if (i < URING_POLL_SLOTS && recv->slots[i].revents) {
+            fds[i].revents = recv->slots[i].revents;
+            recv->slots[i].revents = 0;
+        }
+        if (fds[i].revents)
+            ready++;
+    }
+    return ready;
+}
+
+// The fd that came with the message at `start`: the last one beginning in its receive
+static int take_fd(struct uring_recv *recv, uint64_t start, uint64_t end) {
+    while (!recv->fds.empty()) {
+        struct uring_fd entry = recv->fds.front();
+
+        if (entry.begin > start || end < entry.end)
+            return -1;
+        recv->fds.pop_front();
+        if (start < entry.end)
+            return entry.fd;
+        // Came with a message that claimed none
+        close(entry.fd);
+    }
+    return -1;
+}
+
+int uring_recv_message(struct uring_recv *recv, int *fd_out, MessageData *buffer, MessageType *out_type) {
+    MessageHeader header;
+    uint64_t start;
+    int fd;
+
+    if (!have_message(recv)) {
+        *out_type = MSG_FAILED;
+        if (recv->error) {
+            fprintf(stderr, "io_uring receive failed: %s\n", strerror(recv->error));
+            return -1;
+        }
+        return 0; // Connection closed
+    }
+
+    memcpy(&header, recv->data.data() + recv->pos, sizeof(header));
+    if (header.length > sizeof(MessageData)) {
+        fprintf(stderr, "recvmsg received data larger than buffer size\n");
+        *out_type = MSG_FAILED;
+        return -1;
+    }
+
+    start = recv->offset + recv->pos;
+    // A payload without display_id is for display 0, see MESSAGE_DATA_BASE_SIZE
+    if (buffer) {
+        memset(buffer, 0, sizeof(*buffer));
+        memcpy(buffer, recv->data.data() + recv->pos + sizeof(header), header.length);
+    }
+    fd = take_fd(recv, start, start + sizeof(header) + header.length);
+    if (header.type == MSG_TYPE_FD && fd_out)
+        *fd_out = fd;
+    else if (fd >= 0)
+        close(fd);
+
+    recv->pos += sizeof(header) + header.length;
+    // Compact once most of the buffer was consumed
+    if (recv->pos * 2 > recv->data.size()) {
+        recv->data.erase(recv->data.begin(), recv->data.begin() + recv->pos);
+        recv->offset += recv->pos;
+        recv->pos = 0;
+    }
+
+    *out_type = (MessageType)header.type;
+    return sizeof(header) + header.length;
+}
+
+/* Blocking read until `want` bytes from data[from] are there, fds recorded
+ * as for the ring. The producer is in the middle of sending them. */
+static int read_rest(struct uring_recv *recv, size_t from, size_t want) {
+    char control[CMSG_SPACE(sizeof(int) * URING_RECV_MAX_FDS)];
+
+    while (recv->data.size() - from < want) {
+        size_t missing = want - (recv->data.size() - from);
+        uint64_t begin = recv->offset + recv->data.size();
+        struct pollfd pfd = {recv->sock, POLLIN, 0};
+        struct msghdr msg;
+        struct iovec io;
+        ssize_t n;
+
+        if (poll(&pfd, 1, URING_DETACH_TIMEOUT_MS) <= 0)
+            return -1;
+
+        recv->data.resize(recv->data.size() + missing);
+        io.iov_base = recv->data.data() + recv->data.size() - missing;
+        io.iov_len = missing;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = &io;
+        msg.msg_iovlen = 1;
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+
+        n = recvmsg(recv->sock, &msg, MSG_CMSG_CLOEXEC);
+        recv->data.resize(recv->data.size() - missing + (n > 0 ? n : 0));
+        if (n <= 0)
+            return -1;
+
+        for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+            size_t count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+
+            if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS)
+                continue;
+            for (size_t i = 0; i < count; i++) {
+                struct uring_fd entry = {begin, begin + n, -1};
+
+                memcpy(&entry.fd, CMSG_DATA(cmsg) + i * sizeof(int), sizeof(int));
+                recv->fds.push_back(entry);
+            }
+        }
+    }
+    return 0;
+}
+
+int uring_recv_detach(struct uring_recv *recv) {
+    struct __kernel_timespec ts = {URING_DETACH_TIMEOUT_MS / 1000, 0};
+    struct io_uring_cqe *cqe;
+    MessageHeader header;
+    size_t pos;
+
+    if (recv->sock < 0)
+        return 0;
+
+    if (recv->armed) {
+        cancel(recv, uring_tag(URING_TAG_RECV, recv->gen, 0));
+        // Whatever completes until the cancellation still counts
+        while (recv->armed) {
+            int ret = io_uring_submit_and_wait_timeout(&recv->ring, &cqe, 1, &ts, NULL);
+
+            if (ret < 0 && ret != -EINTR) {
+                fprintf(stderr, "io_uring cancel failed: %s\n", strerror(-ret));
+                return -1;
+            }
+            reap(recv);
+        }
+    }
+    if (recv->eof || recv->error)
+        return 0;
+
+    // Complete messages stay pending, find the one received in part if any
+    for (pos = recv->pos;; pos += sizeof(header) + header.length) {
+        size_t available = recv->data.size() - pos;
+
+        if (available == 0)
+            return 0;
+        if (available < sizeof(header))
+            break;
+        memcpy(&header, recv->data.data() + pos, sizeof(header));
+        if (header.length > sizeof(MessageData))
+            return 0; // uring_recv_message() reports it
+        if (available < sizeof(header) + header.length)
+            break;
+    }
+
+    if (read_rest(recv, pos, sizeof(header)) < 0)
+        goto err;
+    memcpy(&header, recv->data.data() + pos, sizeof(header));
+    if (header.length <= sizeof(MessageData) && read_rest(recv, pos, sizeof(header) + header.length) < 0)
+        goto err;
+    return 0;
+
+err:
+    fprintf(stderr, "Could not complete a partially received message\n");
+    recv->error = EPROTO;
+    return -1;
+}
+
+struct uring_write_slot {
+    int fd;
+    uint64_t tag;
+    size_t len;
+    char data[URING_WRITE_SLOT_SIZE];
+};
+
+struct uring_writer {
+    struct io_uring ring;
+    unsigned queued;
+    struct uring_write_slot slots[URING_WRITE_SLOTS];
+    // Files that refuse RWF_NOWAIT, named FIFOs on some kernels
+    std::vector<int> direct_fds;
+};
+
+struct uring_writer *uring_writer_new(void) {
+    struct uring_writer *writer = new struct uring_writer();
+
+    if (init_ring(&writer->ring, URING_WRITE_SLOTS * 2) < 0) {
+        delete writer;
+        return NULL;
+    }
+    return writer;
+}
+
+void uring_writer_free(struct uring_writer *writer) {
+    if (!writer)
+        return;
+    io_uring_queue_exit(&writer->ring);
+    delete writer;
+}
+
+int uring_writer_queue(struct uring_writer *writer, int fd, const void *data, size_t len, uint64_t tag) {
+    struct uring_write_slot *slot;
+    struct io_uring_sqe *sqe;
+
+    if (len > URING_WRITE_SLOT_SIZE || writer->queued == URING_WRITE_SLOTS)
+        return -1;
+    if (std::find(writer->direct_fds.begin(), writer->direct_fds.end(), fd) != writer->direct_fds.end())
+        return -1;
+    sqe = io_uring_get_sqe(&writer->ring);
+    if (!sqe)
+        return -1;
+
+    slot = &writer->slots[writer->queued];
+    slot->fd = fd;
+    slot->tag = tag;
+    slot->len = len;
+    memcpy(slot->data, data, len);
+    io_uring_prep_write(sqe, fd, slot->data, len, 0);
+    /* Without it io_uring waits for room in a full pipe even on an O_NONBLOCK
+     * fd. With it a full pipe fails with EAGAIN like write(). */
+    sqe->rw_flags = RWF_NOWAIT;
+    io_uring_sqe_set_data64(sqe, writer->queued);
+    writer->queued++;
+    return 0;
+}
+
+int uring_writer_flush(struct uring_writer *writer, uring_write_done done, void *data) {
+    struct io_uring_cqe *cqe;
+    unsigned head, count = 0;
+    int ret;
+
+    if (writer->queued == 0)
+        return 0;
+
+    ret = io_uring_submit_and_wait(&writer->ring, writer->queued);
+    if (ret < 0)
+        fprintf(stderr, "io_uring write submit failed: %s\n", strerror(-ret));
+
+    io_uring_for_each_cqe(&writer->ring, head, cqe) {
+        struct uring_write_slot *slot = &writer->slots[io_uring_cqe_get_data64(cqe)];
+        ssize_t res = cqe->res;
+
+        // Writes to such a file complete in submission order, directly from now on
+        if (res == -EOPNOTSUPP) {
+            if (std::find(writer->direct_fds.begin(), writer->direct_fds.end(), slot->fd) == writer->direct_fds.end()) {
+                fprintf(stderr, "io_uring cannot write to fd %d without waiting, writing it directly\n", slot->fd);
+                writer->direct_fds.push_back(slot->fd);
+            }
+            res = write(slot->fd, slot->data, slot->len);
+            if (res < 0)
+                res = -errno;
+        }
+        done(data, slot->tag, slot->data, slot->len, res);
+        count++;
+    }
+    io_uring_cq_advance(&writer->ring, count);
+    writer->queued = 0;
+    return ret < 0 ? -1 : 0;
+}
+
+#else
+
+struct uring_recv *uring_recv_new(void) {
+    fprintf(stderr, "Built without io_uring support\n");
+    return NULL;
+}
+
+void uring_recv_free(struct uring_recv *) {
+}
+
+int uring_recv_poll(struct uring_recv *, struct pollfd *, nfds_t, int, int) {
+    errno = EOPNOTSUPP;
+    return -1;
+}
+
+bool uring_recv_pending(struct uring_recv *) {
+    return false;
+}
+
+int uring_recv_message(struct uring_recv *, int *, MessageData *, MessageType *out_type) {
+    *out_type = MSG_FAILED;
+    return -1;
+}
+
+int uring_recv_detach(struct uring_recv *) {
+    return 0;
+}
+
+struct uring_writer *uring_writer_new(void) {
+    fprintf(stderr, "Built without io_uring support\n");
+    return NULL;
+}
+
+void uring_writer_free(struct uring_writer *) {
+}
+
+int uring_writer_queue(struct uring_writer *, int, const void *, size_t, uint64_t) {
+    return -1;
+}
+
+int uring_writer_flush(struct uring_writer *, uring_write_done, void *) {
+    return 0;
+}
+
+#endif
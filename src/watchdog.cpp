@@ -0,0 +1,94 @@
+#include <stdio.h>
+
+#include <gsthelper.h>
+#include <metrics.h>
+#include <watchdog.h>
+
+// Only used from the display thread
+struct watchdog {
+    int stall_ms;
+    gint64 stalled_since; // first detection of the current stall, 0 while healthy
+    gint64 acted_at;      // last restart or rebuild
+    bool rebuilt;         // the last action was a rebuild
+};
+
+static struct watchdog *watchdog;
+
+int watchdog_start(int stall_ms) {
+    if (stall_ms <= 0) {
+        fprintf(stderr, "Invalid watchdog stall time: %d ms\n", stall_ms);
+        return -1;
+    }
+    if (!watchdog)
+        watchdog = new struct watchdog();
+    watchdog->stall_ms = stall_ms;
+    return 0;
+}
+
+void watchdog_stop(void) {
+    delete watchdog;
+    watchdog = NULL;
+}
+
+int watchdog_timeout_ms(void) {
+    return watchdog ? watchdog->stall_ms / WATCHDOG_CHECKS_PER_STALL : -1;
+}
+
+static void recover(struct gsthelper *gsthelper, const char *reason, gint64 now) {
+    gint64 stall_us = (gint64)watchdog->stall_ms * 1000;
+    bool escalate = watchdog->acted_at && now - watchdog->acted_at < stall_us * WATCHDOG_ESCALATE_STALLS;
+    int ret = -1;
+
+    if (!escalate && gsthelper->pipeline) {
+        fprintf(stderr, "Pipeline stalled (%s), restarting it\n", reason);
+        ret = gst_pipeline_restart(gsthelper);
+        metrics_inc(METRIC_PIPELINE_RESTARTS);
+        watchdog->rebuilt = false;
+    }
+    if (ret < 0) {
+        fprintf(stderr, "Pipeline stalled (%s), rebuilding it\n", reason);
+        ret = gst_pipeline_rebuild(gsthelper);
+        metrics_inc(METRIC_PIPELINE_REBUILDS);
+        watchdog->rebuilt = true;
+    }
+    // After the action, which resets the encoder output time itself
+    watchdog->acted_at = g_get_monotonic_time();
+
+    // Viewers can only resume from a keyframe
+    if (ret == 0)
+        gst_pipeline_force_keyframe(gsthelper);
+    else
+        fprintf(stderr, "Pipeline recovery failed, retrying in %d ms\n", watchdog->stall_ms);
+}
+
+void watchdog_check(struct gsthelper *gsthelper) {
+    gint64 now = g_get_monotonic_time();
+    const char *reason;
+
+    if (!watchdog)
+        return;
+
+    // Recovered once the encoder produced something after the last action
+    if (watchdog->stalled_since && gsthelper->pipeline && gsthelper->last_output_us > watchdog->acted_at &&
+        !gst_pipeline_stalled(gsthelper, watchdog->stall_ms)) {
+        gint64 took = gsthelper->last_output_us - watchdog->stalled_since;
+
+        fprintf(stderr, "Pipeline recovered in %lld ms by a %s\n", (long long)(took / 1000),
+                watchdog->rebuilt ? "rebuild" : "restart");
+        metrics_observe_us(METRIC_RECOVERY_DURATION, took);
+        metrics_gauge_set(METRIC_PIPELINE_STALLED, 0);
+        watchdog->stalled_since = 0;
+    }
+
+    reason = gst_pipeline_stalled(gsthelper, watchdog->stall_ms);
+    if (!reason)
+        return;
+    if (!watchdog->stalled_since) {
+        watchdog->stalled_since = now;
+        metrics_gauge_set(METRIC_PIPELINE_STALLED, 1);
+    }
+    // Give the last action a stall period to take effect
+    if (watchdog->acted_at && now - watchdog->acted_at < (gint64)watchdog->stall_ms * 1000)
+        return;
+    recover(gsthelper, reason, now);
+}
@@ -1,71 +1,115 @@
 #include <drm_fourcc.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <inttypes.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/mman.h>
+#include <sys/stat.h>
+#include <poll.h>
 #include <unistd.h>
+#include <algorithm>
 #include <wayland-client.h>
 
 // Include the generated protocol headers
 #include "linux-dmabuf-unstable-v1-client-protocol.h"
 #include "xdg-shell-client-protocol.h"
+#include "presentation-time-client-protocol.h"
 
 #include <socket-protocol.h>
 #include <wayland-window.h>
 
 static void
 buffer_release(void *data, struct wl_buffer *) {
-    struct window_state *app_state = (struct window_state *)data;
+    struct window_buffer *buffer = (struct window_buffer *)data;
 
-    wl_buffer_destroy(app_state->buffer);
+    buffer->busy = false;
 }
 
 static const struct wl_buffer_listener buffer_listener = {
     buffer_release
 };
 
-static void
-create_succeeded(void *data,
-                 struct zwp_linux_buffer_params_v1 *params,
-                 struct wl_buffer *new_buffer) {
-    struct window_state *app_state = (struct window_state *)data;
+static uint32_t format_slot(uint32_t format) {
+    // Fibonacci hashing spreads the fourcc bytes over the table index
+    return ((format * 2654435769u) >> 25) & (WINDOW_FORMAT_TABLE_SIZE - 1);
+}
 
-    wl_buffer_destroy(app_state->buffer);
-    app_state->buffer = new_buffer;
+struct window_format *window_find_format(struct window_state *app_state, uint32_t format) {
+    for (uint32_t i = 0, slot = format_slot(format); i < WINDOW_FORMAT_TABLE_SIZE;
+         i++, slot = (slot + 1) & (WINDOW_FORMAT_TABLE_SIZE - 1)) {
+        struct window_format *entry = &app_state->formats[slot];
 
-    zwp_linux_buffer_params_v1_destroy(params);
-    fprintf(stderr, "Buffer created successfully with format\n");
+        if (entry->format == format)
+            return entry;
+        if (entry->format == 0)
+            return NULL;
+    }
+    return NULL;
 }
 
-static void
-create_failed(void *data, struct zwp_linux_buffer_params_v1 *params) {
-    struct window_state *app_state = (struct window_state *)data;
+static struct window_format *add_format(struct window_state *app_state, uint32_t format) {
+    struct window_format *entry;
+    uint32_t slot;
 
-    app_state->buffer = NULL;
+    entry = window_find_format(app_state, format);
+    if (entry)
+        return entry;
 
-    zwp_linux_buffer_params_v1_destroy(params);
+    if (app_state->formats_count == WINDOW_FORMAT_TABLE_SIZE - 1) {
+        fprintf(stderr, "Too many dmabuf formats, ignoring %.4s\n", (char *)&format);
+        return NULL;
+    }
+
+    slot = format_slot(format);
+    while (app_state->formats[slot].format != 0)
+        slot = (slot + 1) & (WINDOW_FORMAT_TABLE_SIZE - 1);
+
+    entry = &app_state->formats[slot];
+    entry->format = format;
+    app_state->formats_count++;
+    return entry;
 }
 
-static const struct zwp_linux_buffer_params_v1_listener params_listener = {
-    create_succeeded,
-    create_failed
-};
+/* A format without modifier events only supports the implicit modifier,
+ * which is also what producers without modifier support send. */
+bool window_supports(struct window_state *app_state, uint32_t format, uint64_t modifier) {
+    struct window_format *entry = window_find_format(app_state, format);
+
+    if (!entry)
+        return false;
+    if (entry->modifiers_count == 0)
+        return modifier == DRM_FORMAT_MOD_INVALID;
+
+    for (int i = 0; i < entry->modifiers_count; i++) {
+        if (entry->modifiers[i] == modifier)
+            return true;
+    }
+    return false;
+}
 
-static void dmabuf_format(void *, struct zwp_linux_dmabuf_v1 *, uint32_t);
-static void dmabuf_modifiers(void *data, struct zwp_linux_dmabuf_v1 *dmabuf,
+static void dmabuf_modifiers(void *data, struct zwp_linux_dmabuf_v1 *,
                  uint32_t format, uint32_t modifier_hi, uint32_t modifier_lo) {
-    
+    struct window_state *app_state = (struct window_state *)data;
+    struct window_format *entry = add_format(app_state, format);
+    uint64_t modifier = ((uint64_t)modifier_hi << 32) | modifier_lo;
+
+    if (!entry)
+        return;
+
+    if (entry->modifiers_count == entry->modifiers_capacity) {
+        entry->modifiers_capacity = entry->modifiers_capacity ? entry->modifiers_capacity * 2 : 8;
+        entry->modifiers = (uint64_t *)realloc(entry->modifiers,
+                                               entry->modifiers_capacity * sizeof(*entry->modifiers));
+    }
+    entry->modifiers[entry->modifiers_count++] = modifier;
 }
 
 static void dmabuf_format(void *data, struct zwp_linux_dmabuf_v1 *, uint32_t format) {
     struct window_state *app_state = (struct window_state *)data;
 
-    ++app_state->formats_count;
-    app_state->formats = (uint32_t *)realloc(app_state->formats,
-                                             app_state->formats_count * sizeof(*app_state->formats));
-    app_state->formats[app_state->formats_count - 1] = format;
+    add_format(app_state, format);
 }
 
 static const struct zwp_linux_dmabuf_v1_listener dmabuf_listener = {
@@ -108,6 +152,16 @@ static const struct xdg_wm_base_listener xdg_wm_base_listener = {
     .ping = xdg_wm_base_handle_ping,
 };
 
+// --- Presentation Listener ---
+static void presentation_handle_clock_id(void *data, struct wp_presentation *, uint32_t clk_id) {
+    struct window_state *app_state = (struct window_state *) data;
+    app_state->presentation_clock = clk_id;
+}
+
+static const struct wp_presentation_listener presentation_listener = {
+    .clock_id = presentation_handle_clock_id,
+};
+
 // --- Registry Listener ---
 static void registry_handle_global(void *data, struct wl_registry *registry,
                                    uint32_t name, const char *interface, uint32_t version) {
@@ -119,9 +173,13 @@ static void registry_handle_global(void *data, struct wl_registry *registry,
         app_state->xdg_wm_base = (xdg_wm_base *)wl_registry_bind(registry, name, &xdg_wm_base_interface, 1);
         xdg_wm_base_add_listener(app_state->xdg_wm_base, &xdg_wm_base_listener, app_state);
     } else if (strcmp(interface, zwp_linux_dmabuf_v1_interface.name) == 0) {
-        // We bind to version 3, which is common.
-        app_state->linux_dmabuf = (zwp_linux_dmabuf_v1 *)wl_registry_bind(registry, name, &zwp_linux_dmabuf_v1_interface, 3);
+        // We bind to version 3, which is common and sends the modifier events.
+        app_state->linux_dmabuf = (zwp_linux_dmabuf_v1 *)wl_registry_bind(registry, name, &zwp_linux_dmabuf_v1_interface,
+                                                                          version < 3 ? version : 3);
         zwp_linux_dmabuf_v1_add_listener(app_state->linux_dmabuf, &dmabuf_listener, app_state);
+    } else if (strcmp(interface, wp_presentation_interface.name) == 0) {
+        app_state->presentation = (wp_presentation *)wl_registry_bind(registry, name, &wp_presentation_interface, 1);
+        wp_presentation_add_listener(app_state->presentation, &presentation_listener, app_state);
     }
 }
 
@@ -141,6 +199,7 @@ struct window_state *setup_wayland_window() {
     app_state = (struct window_state *)calloc(1, sizeof(struct window_state));
 
     app_state->running = 1;
+    app_state->presentation_clock = CLOCK_MONOTONIC;
 
     // 1. Connect to Wayland display
     app_state->display = wl_display_connect(NULL);
@@ -167,6 +226,7 @@ struct window_state *setup_wayland_window() {
             fprintf(stderr, "Linux DMABUF interface not found.\n");
         }
         wl_display_disconnect(app_state->display);
+        app_state->display = NULL;
         return app_state;
     }
 
@@ -174,6 +234,10 @@ struct window_state *setup_wayland_window() {
 }
 
 void setup_window(struct window_state *app_state) {
+    // Producers say hello on every (re)connect, the surface stays across them
+    if (app_state->surface)
+        return;
+
     // 4. Create window surface
     app_state->surface = wl_compositor_create_surface(app_state->compositor);
     app_state->xdg_surface = xdg_wm_base_get_xdg_surface(app_state->xdg_wm_base, app_state->surface);
@@ -188,14 +252,6 @@ void setup_window(struct window_state *app_state) {
     wl_surface_commit(app_state->surface);
 }
 
-bool isFormatSupported(struct window_state *app_state, uint32_t format) {
-    for (int i = 0; i < app_state->formats_count; i++) {
-        if (format == app_state->formats[i])
-            return true;
-    }
-    return false;
-}
-
 int findFormat(uint32_t hal_format) {
     switch (hal_format) {
     case DRM_FORMAT_BGR888:
@@ -214,59 +270,294 @@ int findFormat(uint32_t hal_format) {
     return DRM_FORMAT_XRGB8888;
 }
 
-int draw_window(struct window_state *app_state, struct MessageData *message, int dmabuf_fd) {
-    app_state->width = message->width;
-    app_state->height = message->height;
-    uint32_t format = DRM_FORMAT_XRGB8888;
-    uint32_t stride = message->stride;
+int window_get_fd(struct window_state *app_state) {
+    if (!app_state || !app_state->display)
+        return -1;
+    return wl_display_get_fd(app_state->display);
+}
+
+// Reads and dispatches whatever the compositor sent, without blocking
+void window_dispatch(struct window_state *app_state) {
+    struct pollfd pfd;
+
+    if (!app_state->display)
+        return;
 
-    if (isFormatSupported(app_state, message->format)) {
-        format = message->format;
-    } else {
-        format = findFormat(message->format);
+    while (wl_display_prepare_read(app_state->display) != 0)
+        wl_display_dispatch_pending(app_state->display);
+    wl_display_flush(app_state->display);
+
+    pfd.fd = wl_display_get_fd(app_state->display);
+    pfd.events = POLLIN;
+    if (poll(&pfd, 1, 0) > 0)
+        wl_display_read_events(app_state->display);
+    else
+        wl_display_cancel_read(app_state->display);
+
+    wl_display_dispatch_pending(app_state->display);
+}
+
+static void destroy_window_buffer(struct window_buffer *buffer) {
+    if (buffer->buffer)
+        wl_buffer_destroy(buffer->buffer);
+    if (buffer->app_state && buffer->app_state->current == buffer)
+        buffer->app_state->current = NULL;
+    if (buffer->app_state && buffer->app_state->pending == buffer)
+        buffer->app_state->pending = NULL;
+    memset(buffer, 0, sizeof(*buffer));
+}
+
+/*
+ * Producers cycle through a small set of dmabufs but every frame arrives as a
+ * fresh fd, so buffers are keyed by the dmabuf inode rather than the fd. A
+ * hit reuses the wl_buffer, a miss imports into a free slot or evicts the
+ * least recently used one that the compositor is not holding.
+ */
+static struct window_buffer *get_window_buffer(struct window_state *app_state, struct MessageData *message,
+                                               int dmabuf_fd, uint32_t format) {
+    struct window_buffer *buffer = NULL;
+    struct stat st;
+
+    if (fstat(dmabuf_fd, &st) < 0) {
+        fprintf(stderr, "Failed to stat dmabuf: %s\n", strerror(errno));
+        return NULL;
+    }
+
+    for (int i = 0; i < WINDOW_BUFFER_CACHE_SIZE; i++) {
+        struct window_buffer *entry = &app_state->buffers[i];
+
+        if (!entry->buffer)
+            continue;
+        if (entry->dev == st.st_dev && entry->ino == st.st_ino &&
+            entry->width == message->width && entry->height == message->height &&
+            entry->format == format && entry->stride == (uint32_t)message->stride &&
+            entry->offset == (uint32_t)message->offset && entry->modifier == message->modifiers)
+            return entry;
+    }
+
+    for (int i = 0; i < WINDOW_BUFFER_CACHE_SIZE; i++) {
+        struct window_buffer *entry = &app_state->buffers[i];
+
+        if (!entry->buffer) {
+            buffer = entry;
+            break;
+        }
+        if (entry->busy || entry->queued)
+            continue;
+        if (!buffer || entry->last_used < buffer->last_used)
+            buffer = entry;
+    }
+    if (!buffer) {
+        fprintf(stderr, "All cached wl_buffers are held by the compositor\n");
+        return NULL;
     }
+    destroy_window_buffer(buffer);
 
     // 3. Create the DMABUF-based wl_buffer
     struct zwp_linux_buffer_params_v1 *params;
     params = zwp_linux_dmabuf_v1_create_params(app_state->linux_dmabuf);
     if (!params) {
         fprintf(stderr, "Failed to create dmabuf params.\n");
-        return EXIT_FAILURE;
+        return NULL;
     }
 
     // Add the file descriptor for the first (and only) plane
     // For multi-planar formats like YUV, you would call this multiple times.
+    // The fd is duplicated into the request, the caller keeps ownership.
     zwp_linux_buffer_params_v1_add(params,
                                    dmabuf_fd,
                                    0,               // plane_idx
                                    message->offset, // offset
-                                   stride,
+                                   message->stride,
                                    message->modifiers >> 32,
                                    message->modifiers & 0xffffffff);
-    zwp_linux_buffer_params_v1_add_listener(params, &params_listener, app_state);
-
-    // Create the wl_buffer. The 'created' event is immediate for this version.
-    app_state->buffer = zwp_linux_buffer_params_v1_create_immed(params,
-                                                                app_state->width,
-                                                                app_state->height,
-                                                                format,
-                                                                0 // flags
+
+    buffer->buffer = zwp_linux_buffer_params_v1_create_immed(params,
+                                                             message->width,
+                                                             message->height,
+                                                             format,
+                                                             0 // flags
     );
     zwp_linux_buffer_params_v1_destroy(params);
-    if (!app_state->buffer) {
+    if (!buffer->buffer) {
         fprintf(stderr, "Failed to create wl_buffer from dmabuf.\n");
-        return EXIT_FAILURE;
+        return NULL;
     }
-    wl_buffer_add_listener(app_state->buffer, &buffer_listener, app_state);
 
-    // The dmabuf fd can be closed after import by the compositor
-    //close(dmabuf_fd);
-    //fprintf(stderr, "Created wl_buffer with format %u, stride %u\n", format, stride);
+    buffer->app_state = app_state;
+    buffer->dev = st.st_dev;
+    buffer->ino = st.st_ino;
+    buffer->width = message->width;
+    buffer->height = message->height;
+    buffer->format = format;
+    buffer->stride = message->stride;
+    buffer->offset = message->offset;
+    buffer->modifier = message->modifiers;
+    wl_buffer_add_listener(buffer->buffer, &buffer_listener, buffer);
+    app_state->import_count++;
+
+    return buffer;
+}
+
+static uint64_t clock_ns(clockid_t clock) {
+    struct timespec ts;
+
+    clock_gettime(clock, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void report_window_stats(struct window_state *app_state) {
+    uint64_t now_ms = clock_ns(CLOCK_MONOTONIC) / 1000000;
+
+    if (now_ms - app_state->last_report_ms < 10000)
+        return;
+    app_state->last_report_ms = now_ms;
+
+    fprintf(stderr, "Window: %" PRIu64 " committed, %" PRIu64 " dropped, %" PRIu64 " imports",
+            app_state->committed_count, app_state->dropped_count, app_state->import_count);
+    if (app_state->presentation && app_state->presented_count) {
+        fprintf(stderr, ", %" PRIu64 " presented, %" PRIu64 " discarded, latency avg %.2f ms max %.2f ms",
+                app_state->presented_count, app_state->discarded_count,
+                app_state->presentation_latency_ns_total / (double)app_state->presented_count / 1000000.0,
+                app_state->presentation_latency_ns_max / 1000000.0);
+    }
+    fprintf(stderr, "\n");
+}
+
+struct presentation_frame {
+    struct window_state *app_state;
+    uint64_t commit_ns;
+};
+
+static void presentation_feedback_sync_output(void *, struct wp_presentation_feedback *, struct wl_output *) {
+}
+
+static void presentation_feedback_presented(void *data, struct wp_presentation_feedback *feedback,
+                                            uint32_t tv_sec_hi, uint32_t tv_sec_lo, uint32_t tv_nsec,
+                                            uint32_t, uint32_t, uint32_t, uint32_t) {
+    struct presentation_frame *frame = (struct presentation_frame *)data;
+    struct window_state *app_state = frame->app_state;
+    uint64_t presented_ns = ((((uint64_t)tv_sec_hi << 32) | tv_sec_lo) * 1000000000) + tv_nsec;
+
+    if (presented_ns > frame->commit_ns) {
+        uint64_t latency_ns = presented_ns - frame->commit_ns;
+
+        app_state->presentation_latency_ns_total += latency_ns;
+        app_state->presentation_latency_ns_max = std::max(app_state->presentation_latency_ns_max, latency_ns);
+    }
+    app_state->presented_count++;
+
+    wp_presentation_feedback_destroy(feedback);
+    free(frame);
+}
+
+static void presentation_feedback_discarded(void *data, struct wp_presentation_feedback *feedback) {
+    struct presentation_frame *frame = (struct presentation_frame *)data;
+
+    frame->app_state->discarded_count++;
+
+    wp_presentation_feedback_destroy(feedback);
+    free(frame);
+}
+
+static const struct wp_presentation_feedback_listener presentation_feedback_listener = {
+    .sync_output = presentation_feedback_sync_output,
+    .presented = presentation_feedback_presented,
+    .discarded = presentation_feedback_discarded,
+};
+
+static void commit_window_buffer(struct window_state *app_state, struct window_buffer *buffer);
+
+static void frame_done(void *data, struct wl_callback *callback, uint32_t) {
+    struct window_state *app_state = (struct window_state *)data;
+    struct window_buffer *pending = app_state->pending;
+
+    wl_callback_destroy(callback);
+    app_state->frame_callback = NULL;
+
+    if (pending) {
+        app_state->pending = NULL;
+        pending->queued = false;
+        commit_window_buffer(app_state, pending);
+    }
+}
+
+static const struct wl_callback_listener frame_listener = {
+    frame_done
+};
+
+static void commit_window_buffer(struct window_state *app_state, struct window_buffer *buffer) {
+    buffer->busy = true;
+    app_state->current = buffer;
+
+    wl_surface_attach(app_state->surface, buffer->buffer, 0, 0);
+    wl_surface_damage(app_state->surface, 0, 0, buffer->width, buffer->height);
+
+    app_state->frame_callback = wl_surface_frame(app_state->surface);
+    wl_callback_add_listener(app_state->frame_callback, &frame_listener, app_state);
+
+    if (app_state->presentation) {
+        struct presentation_frame *frame = (struct presentation_frame *)calloc(1, sizeof(*frame));
+
+        frame->app_state = app_state;
+        frame->commit_ns = clock_ns(app_state->presentation_clock);
+        wp_presentation_feedback_add_listener(wp_presentation_feedback(app_state->presentation, app_state->surface),
+                                              &presentation_feedback_listener, frame);
+    }
 
-    // Initial draw
-    wl_surface_attach(app_state->surface, app_state->buffer, 0, 0);
-    wl_surface_damage(app_state->surface, 0, 0, app_state->width, app_state->height);
     wl_surface_commit(app_state->surface);
+    wl_display_flush(app_state->display);
+    app_state->committed_count++;
+
+    report_window_stats(app_state);
+}
+
+/*
+ * Frames are only committed when the compositor asked for one through the
+ * previous frame callback. In between, the newest frame waits in a one-slot
+ * mailbox and replaces (drops) any frame that was already waiting there.
+ */
+int draw_window(struct window_state *app_state, struct MessageData *message, int dmabuf_fd) {
+    struct window_buffer *buffer;
+    uint32_t format = DRM_FORMAT_XRGB8888;
+
+    app_state->width = message->width;
+    app_state->height = message->height;
+
+    // Import with the producer's exact format and modifier whenever the
+    // compositor advertised that pair, only then try the HAL format mapping.
+    format = message->format;
+    if (!window_supports(app_state, format, message->modifiers)) {
+        uint32_t mapped = findFormat(message->format);
+
+        if (window_supports(app_state, mapped, message->modifiers)) {
+            format = mapped;
+        } else if (!app_state->warned_format) {
+            fprintf(stderr, "Compositor did not advertise format %.4s with modifier 0x%016lx\n",
+                    (char *)&message->format, message->modifiers);
+            app_state->warned_format = true;
+        }
+    }
+
+    // Pick up buffer releases and frame callbacks before choosing a buffer
+    window_dispatch(app_state);
+
+    buffer = get_window_buffer(app_state, message, dmabuf_fd, format);
+    if (!buffer)
+        return EXIT_FAILURE;
+    buffer->last_used = ++app_state->frame_count;
+
+    if (!app_state->frame_callback) {
+        commit_window_buffer(app_state, buffer);
+        return EXIT_SUCCESS;
+    }
+
+    if (app_state->pending) {
+        app_state->pending->queued = false;
+        app_state->dropped_count++;
+    }
+    buffer->queued = true;
+    app_state->pending = buffer;
 
     return EXIT_SUCCESS;
 }
@@ -279,8 +570,12 @@ int destroy_window(struct window_state *app_state) {
 
     // 6. Cleanup
     printf("Cleaning up and exiting.\n");
-    if (app_state->buffer)
-        wl_buffer_destroy(app_state->buffer);
+    if (app_state->frame_callback)
+        wl_callback_destroy(app_state->frame_callback);
+    if (app_state->presentation)
+        wp_presentation_destroy(app_state->presentation);
+    for (int i = 0; i < WINDOW_BUFFER_CACHE_SIZE; i++)
+        destroy_window_buffer(&app_state->buffers[i]);
     if (app_state->xdg_toplevel)
         xdg_toplevel_destroy(app_state->xdg_toplevel);
     if (app_state->xdg_surface)
@@ -289,6 +584,8 @@ int destroy_window(struct window_state *app_state) {
         wl_surface_destroy(app_state->surface);
     if (app_state->linux_dmabuf)
         zwp_linux_dmabuf_v1_destroy(app_state->linux_dmabuf);
+    for (int i = 0; i < WINDOW_FORMAT_TABLE_SIZE; i++)
+        free(app_state->formats[i].modifiers);
     if (app_state->xdg_wm_base)
         xdg_wm_base_destroy(app_state->xdg_wm_base);
     if (app_state->compositor)
@@ -0,0 +1,168 @@
+#pragma once
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <linux/dma-buf.h>
+#include <linux/udmabuf.h>
+
+#define CPU_BUFFER_BPP 4
+
+/*
+ * Linear XRGB8888 buffers without a GPU. The pixels live in a sealed memfd
+ * that is wrapped into a real dmabuf with /dev/udmabuf when available. If
+ * not, the memfd itself is handed out: GStreamer can still map it, but
+ * consumers that import dmabufs (VA, compositors) will reject it.
+ */
+struct cpu_buffer {
+    int fd;     // dmabuf fd, or the memfd when udmabuf is unavailable
+    int memfd;
+    bool dmabuf;
+    void *map;
+    size_t size;
+
+    int width;
+    int height;
+    uint32_t stride;
+};
+
+static int create_udmabuf(int memfd, size_t size) {
+    struct udmabuf_create create;
+    int dev, fd;
+
+    dev = open("/dev/udmabuf", O_RDWR | O_CLOEXEC);
+    if (dev < 0)
+        return -1;
+
+    memset(&create, 0, sizeof(create));
+    create.memfd = memfd;
+    create.flags = UDMABUF_FLAGS_CLOEXEC;
+    create.offset = 0;
+    create.size = size;
+    fd = ioctl(dev, UDMABUF_CREATE, &create);
+    close(dev);
+
+    return fd;
+}
+
+static int create_cpu_buffer(struct cpu_buffer *buffer, int width, int height) {
+    long page_size = sysconf(_SC_PAGESIZE);
+
+    memset(buffer, 0, sizeof(*buffer));
+    buffer->fd = -1;
+    buffer->width = width;
+    buffer->height = height;
+    // 64 byte aligned rows keep every row start aligned for SIMD stores
+    buffer->stride = (width * CPU_BUFFER_BPP + 63) & ~63u;
+    buffer->size = ((size_t)buffer->stride * height + page_size - 1) & ~(size_t)(page_size - 1);
+
+    buffer->memfd = memfd_create("playdroid-cpu-buffer", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+    if (buffer->memfd < 0) {
+        fprintf(stderr, "memfd_create failed: %s\n", strerror(errno));
+        return -1;
+    }
+    if (ftruncate(buffer->memfd, buffer->size) < 0) {
+        fprintf(stderr, "ftruncate failed: %s\n", strerror(errno));
+        goto error;
+    }
+    // udmabuf requires the memfd to be sealed against shrinking
+    fcntl(buffer->memfd, F_ADD_SEALS, F_SEAL_SHRINK);
+
+    buffer->map = mmap(NULL, buffer->size, PROT_READ | PROT_WRITE, MAP_SHARED, buffer->memfd, 0);
+    if (buffer->map == MAP_FAILED) {
+        buffer->map = NULL;
+        fprintf(stderr, "mmap failed: %s\n", strerror(errno));
+        goto error;
+    }
+
+    buffer->fd = create_udmabuf(buffer->memfd, buffer->size);
+    if (buffer->fd >= 0) {
+        buffer->dmabuf = true;
+    } else {
+        buffer->fd = buffer->memfd;
+        buffer->dmabuf = false;
+    }
+
+    return 0;
+
+error:
+    close(buffer->memfd);
+    buffer->memfd = -1;
+    return -1;
+}
+
+static void destroy_cpu_buffer(struct cpu_buffer *buffer) {
+    if (buffer->map)
+        munmap(buffer->map, buffer->size);
+    if (buffer->dmabuf && buffer->fd >= 0)
+        close(buffer->fd);
+    if (buffer->memfd >= 0)
+        close(buffer->memfd);
+    memset(buffer, 0, sizeof(*buffer));
+    buffer->fd = -1;
+    buffer->memfd = -1;
+}
+
+/* Brackets CPU access so caches are flushed for devices reading the dmabuf.
+ * A no-op for the memfd fallback. */
+static void cpu_buffer_sync(struct cpu_buffer *buffer, bool start) {
+    struct dma_buf_sync sync = {0};
+
+    if (!buffer->dmabuf)
+        return;
+    sync.flags = (start ? DMA_BUF_SYNC_START : DMA_BUF_SYNC_END) | DMA_BUF_SYNC_WRITE;
+    while (ioctl(buffer->fd, DMA_BUF_IOCTL_SYNC, &sync) < 0 && (errno == EINTR || errno == EAGAIN))
+        ;
+}
+
+typedef uint32_t cpu_pixels __attribute__((vector_size(32)));
+#define CPU_PIXELS_LANES (sizeof(cpu_pixels) / sizeof(uint32_t))
+
+/*
+ * Fills the buffer with a scrolling gradient and a square moving from the
+ * lower left to the upper right corner, like render() in render.h. Rows are
+ * written 8 pixels at a time with GCC vector extensions, which compile to
+ * SSE2/AVX2/NEON stores depending on the target.
+ */
+static inline void render_cpu_buffer(struct cpu_buffer *buffer, uint64_t time_ms) {
+    const cpu_pixels lanes = {0, 1, 2, 3, 4, 5, 6, 7};
+    uint32_t t = (uint32_t)(time_ms / 8);
+    int size = buffer->height / 2 < buffer->width / 2 ? buffer->height / 2 : buffer->width / 2;
+    // Complete a movement iteration in 5000 ms
+    float progress = (time_ms % 5000) / 5000.0f;
+    int square_x = (int)((buffer->width - size) * progress);
+    int square_y = (int)((buffer->height - size) * (1.0f - progress));
+
+    cpu_buffer_sync(buffer, true);
+
+    for (int y = 0; y < buffer->height; y++) {
+        uint32_t *row = (uint32_t *)((char *)buffer->map + (size_t)y * buffer->stride);
+        uint32_t green = ((y + t) & 0xff) << 8;
+        int x = 0;
+
+        for (; x + (int)CPU_PIXELS_LANES <= buffer->width; x += CPU_PIXELS_LANES) {
+            cpu_pixels xs = lanes + (uint32_t)x;
+            cpu_pixels red = ((xs + t) & 0xff) << 16;
+            cpu_pixels blue = ((xs ^ (uint32_t)y) + 2 * t) & 0xff;
+            cpu_pixels pixels = red | blue | green | 0xff000000;
+
+            memcpy(row + x, &pixels, sizeof(pixels));
+        }
+        for (; x < buffer->width; x++)
+            row[x] = 0xff000000 | ((x + t) & 0xff) << 16 | green | (((x ^ y) + 2 * t) & 0xff);
+
+        if (y >= square_y && y < square_y + size) {
+            uint32_t shade = 0xff000000 | (uint32_t)(0xff * (y - square_y) / size) << 8;
+
+            for (x = square_x; x < square_x + size; x++)
+                row[x] = shade | 0xff0000;
+        }
+    }
+
+    cpu_buffer_sync(buffer, false);
+}
@@ -0,0 +1,232 @@
+#pragma once
+
+#include <errno.h>
+#include <inttypes.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define NSEC_PER_SEC 1000000000ull
+
+enum load_profile {
+    PROFILE_CONSTANT, // one frame every period
+    PROFILE_BURST,    // burst_frames back to back, then idle, same average rate
+    PROFILE_JITTER,   // each deadline moved by up to +-jitter_percent of a period
+    PROFILE_STEP,     // alternate between fps and step_fps every step_seconds
+};
+
+/*
+ * Frame deadlines live on an absolute CLOCK_MONOTONIC grid, so render and
+ * send time never accumulate into the period. Profiles only move where on
+ * the grid a frame is due. Jitter comes from rand_r() with a fixed seed, so
+ * a run can be reproduced exactly.
+ */
+struct frame_schedule {
+    enum load_profile profile;
+    int fps;
+    int burst_frames;
+    int jitter_percent;
+    int step_fps;
+    int step_seconds;
+    unsigned int seed;
+
+    uint64_t start_ns;
+    uint64_t nominal_ns;  // grid slot of the current frame
+    uint64_t deadline_ns; // when the current frame is due
+    uint64_t slot_end_ns; // frames sent after this are late
+    uint64_t frame;
+
+    // Stats of the current one second window
+    uint64_t window_start_ns;
+    uint64_t frames;
+    uint64_t late;
+    uint64_t skipped;
+    uint64_t wakeups;
+    uint64_t wake_ns_total;
+    uint64_t wake_ns_max;
+    uint64_t rtt_ns_total;
+    uint64_t rtt_ns_max;
+    uint64_t rtt_count;
+};
+
+static uint64_t schedule_now_ns(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * NSEC_PER_SEC + ts.tv_nsec;
+}
+
+/* Parses "constant", "burst[:frames]", "jitter[:percent]" or
+ * "step[:fps[:seconds]]". Returns -1 for an unknown profile. */
+static int schedule_parse_profile(struct frame_schedule *schedule, const char *spec) {
+    const char *args = strchr(spec, ':');
+    size_t len = args ? (size_t)(args - spec) : strlen(spec);
+
+    schedule->burst_frames = 10;
+    schedule->jitter_percent = 50;
+    schedule->step_fps = 0;
+    schedule->step_seconds = 5;
+
+    if (len == strlen("constant") && strncmp(spec, "constant", len) == 0) {
+        schedule->profile = PROFILE_CONSTANT;
+    } else if (len == strlen("burst") && strncmp(spec, "burst", len) == 0) {
+        schedule->profile = PROFILE_BURST;
+        if (args)
+            schedule->burst_frames = strtol(args + 1, NULL, 10);
+        if (schedule->burst_frames < 1)
+            return -1;
+    } else if (len == strlen("jitter") && strncmp(spec, "jitter", len) == 0) {
+        schedule->profile = PROFILE_JITTER;
+        if (args)
+            schedule->jitter_percent = strtol(args + 1, NULL, 10);
+        if (schedule->jitter_percent < 0 || schedule->jitter_percent > 100)
+            return -1;
+    } else if (len == strlen("step") && strncmp(spec, "step", len) == 0) {
+        char *end = NULL;
+
+        schedule->profile = PROFILE_STEP;
+        if (args) {
+            schedule->step_fps = strtol(args + 1, &end, 10);
+            if (*end == ':')
+                schedule->step_seconds = strtol(end + 1, NULL, 10);
+        }
+        if (schedule->step_fps < 0 || schedule->step_seconds < 1)
+            return -1;
+    } else {
+        return -1;
+    }
+
+    return 0;
+}
+
+static uint64_t schedule_period_ns(struct frame_schedule *schedule) {
+    int fps = schedule->fps;
+
+    if (schedule->profile == PROFILE_STEP) {
+        uint64_t step = (schedule->nominal_ns - schedule->start_ns) / (schedule->step_seconds * NSEC_PER_SEC);
+        if (step % 2)
+            fps = schedule->step_fps;
+    }
+
+    return NSEC_PER_SEC / (fps > 0 ? fps : 1);
+}
+
+static void schedule_start(struct frame_schedule *schedule, int fps) {
+    schedule->fps = fps;
+    if (schedule->step_fps <= 0)
+        schedule->step_fps = fps / 2 > 0 ? fps / 2 : 1;
+    schedule->start_ns = schedule_now_ns();
+    schedule->nominal_ns = schedule->start_ns;
+    schedule->deadline_ns = schedule->start_ns;
+    schedule->window_start_ns = schedule->start_ns;
+    schedule->frame = 0;
+}
+
+// Sleeps until the current frame is due
+static void schedule_wait(struct frame_schedule *schedule) {
+    uint64_t period_ns = schedule_period_ns(schedule);
+    uint64_t deadline_ns = schedule->nominal_ns;
+    struct timespec ts;
+
+    schedule->slot_end_ns = schedule->nominal_ns + period_ns;
+    switch (schedule->profile) {
+    case PROFILE_BURST: {
+        // Every frame of a burst is due at the slot of its first frame and
+        // only late once the whole burst window has passed
+        uint64_t index = schedule->frame % schedule->burst_frames;
+        deadline_ns -= index * period_ns;
+        schedule->slot_end_ns = deadline_ns + schedule->burst_frames * period_ns;
+        break;
+    }
+    case PROFILE_JITTER: {
+        int64_t range = period_ns * schedule->jitter_percent / 100;
+        int64_t offset = range ? (int64_t)(rand_r(&schedule->seed) % (2 * range + 1)) - range : 0;
+        deadline_ns += offset;
+        break;
+    }
+    default:
+        break;
+    }
+    schedule->deadline_ns = deadline_ns;
+
+    // Wake-up latency is only meaningful when there was something to sleep
+    if (schedule_now_ns() >= deadline_ns)
+        return;
+
+    ts.tv_sec = deadline_ns / NSEC_PER_SEC;
+    ts.tv_nsec = deadline_ns % NSEC_PER_SEC;
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+        ;
+
+    uint64_t now_ns = schedule_now_ns();
+    schedule->wakeups++;
+    if (now_ns > deadline_ns) {
+        uint64_t wake_ns = now_ns - deadline_ns;
+        schedule->wake_ns_total += wake_ns;
+        if (wake_ns > schedule->wake_ns_max)
+            schedule->wake_ns_max = wake_ns;
+    }
+}
+
+/* Called once the frame is sent. A frame is late when it left after the
+ * slot (or burst window) it was due in. When the producer fell behind by
+ * more than a slot the grid skips ahead instead of catching up in a burst. */
+static void schedule_frame_done(struct frame_schedule *schedule) {
+    uint64_t period_ns = schedule_period_ns(schedule);
+    uint64_t now_ns = schedule_now_ns();
+
+    schedule->frames++;
+    if (now_ns > schedule->slot_end_ns)
+        schedule->late++;
+
+    schedule->frame++;
+    schedule->nominal_ns += period_ns;
+    if (schedule->profile != PROFILE_BURST && now_ns > schedule->nominal_ns + period_ns) {
+        uint64_t missed = (now_ns - schedule->nominal_ns) / period_ns;
+        schedule->skipped += missed;
+        schedule->frame += missed;
+        schedule->nominal_ns += missed * period_ns;
+    }
+}
+
+static void schedule_add_rtt(struct frame_schedule *schedule, uint64_t rtt_ns) {
+    schedule->rtt_ns_total += rtt_ns;
+    schedule->rtt_count++;
+    if (rtt_ns > schedule->rtt_ns_max)
+        schedule->rtt_ns_max = rtt_ns;
+}
+
+// Prints and resets the stats once per second
+static void schedule_report(struct frame_schedule *schedule) {
+    uint64_t now_ns = schedule_now_ns();
+    uint64_t elapsed_ns = now_ns - schedule->window_start_ns;
+
+    if (elapsed_ns < NSEC_PER_SEC)
+        return;
+
+    // The target counts the grid slots that passed, skipped ones included
+    printf("fps %.2f (target %.2f) late %" PRIu64 " skipped %" PRIu64 " wake avg %" PRIu64 " us max %" PRIu64 " us",
+           schedule->frames * (double)NSEC_PER_SEC / elapsed_ns,
+           (schedule->frames + schedule->skipped) * (double)NSEC_PER_SEC / elapsed_ns,
+           schedule->late, schedule->skipped,
+           schedule->wakeups ? schedule->wake_ns_total / schedule->wakeups / 1000 : 0,
+           schedule->wake_ns_max / 1000);
+    if (schedule->rtt_count)
+        printf(" rtt avg %" PRIu64 " us max %" PRIu64 " us", schedule->rtt_ns_total / schedule->rtt_count / 1000,
+               schedule->rtt_ns_max / 1000);
+    printf("\n");
+    fflush(stdout);
+
+    schedule->window_start_ns = now_ns;
+    schedule->frames = 0;
+    schedule->late = 0;
+    schedule->skipped = 0;
+    schedule->wakeups = 0;
+    schedule->wake_ns_total = 0;
+    schedule->wake_ns_max = 0;
+    schedule->rtt_ns_total = 0;
+    schedule->rtt_ns_max = 0;
+    schedule->rtt_count = 0;
+}
@@ -0,0 +1,309 @@
+#include <atomic>
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <inttypes.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <thread>
+#include <time.h>
+#include <unistd.h>
+#include <linux/input.h>
+
+#include <input.h>
+#include <input-record.h>
+
+/*
+ * Replays a recording made with `playdroid-streamer -i <file>` through the
+ * regular input handlers, with a local reader draining every FIFO so it can
+ * run without Android attached.
+ */
+
+struct fifo_reader {
+    int input_type;
+    std::atomic<uint64_t> events;
+    std::thread thread;
+};
+
+static std::atomic<bool> readers_running;
+
+static const char *DEVICE_NAME[INPUT_TOTAL] = {
+    "touch",
+    "keyboard",
+    "pointer",
+    "gamepad"
+};
+
+static uint64_t monotonic_us(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void sleep_until_us(uint64_t deadline_us) {
+    struct timespec ts;
+
+    ts.tv_sec = deadline_us / 1000000;
+    ts.tv_nsec = (deadline_us % 1000000) * 1000;
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+        ;
+}
+
+static void run_reader(struct fifo_reader *reader) {
+    struct input_event events[64];
+    struct pollfd pfd;
+    size_t pending = 0;
+
+    pfd.fd = open(input_pipe_name(reader->input_type), O_RDONLY | O_NONBLOCK);
+    if (pfd.fd < 0) {
+        fprintf(stderr, "Failed to open %s: %s\n", input_pipe_name(reader->input_type), strerror(errno));
+        return;
+    }
+    pfd.events = POLLIN;
+
+    while (true) {
+        if (poll(&pfd, 1, 100) <= 0) {
+            if (!readers_running)
+                break;
+            continue;
+        }
+
+        ssize_t res = read(pfd.fd, (char *)events + pending, sizeof(events) - pending);
+        if (res <= 0) {
+            if (!readers_running)
+                break;
+            continue;
+        }
+        size_t total = pending + res;
+        reader->events += total / sizeof(events[0]);
+        pending = total % sizeof(events[0]);
+        memmove(events, (char *)events + (total - pending), pending);
+    }
+
+    close(pfd.fd);
+}
+
+struct replay_state {
+    bool touch_active[MAX_TOUCHPOINTS];
+};
+
+static void replay_touch(struct input *input, struct replay_state *state,
+                         const struct input_record_event *events, unsigned int count) {
+    int slot = -1, tracking_id = 0, x = 0, y = 0, pressure = 0;
+    bool have_tracking_id = false;
+
+    for (unsigned int i = 0; i < count; i++) {
+        if (events[i].type != EV_ABS)
+            continue;
+
+        switch (events[i].code) {
+        case ABS_MT_SLOT:
+            slot = events[i].value;
+            break;
+        case ABS_MT_TRACKING_ID:
+            tracking_id = events[i].value;
+            have_tracking_id = true;
+            break;
+        case ABS_MT_POSITION_X:
+            x = events[i].value;
+            break;
+        case ABS_MT_POSITION_Y:
+            y = events[i].value;
+            break;
+        case ABS_MT_PRESSURE:
+            pressure = events[i].value;
+            break;
+        case ABS_MT_TOOL_TYPE:
+            if (events[i].value == MT_TOOL_PALM) {
+                // touch_handle_cancel() lifts every slot in one call.
+                touch_handle_cancel(input);
+                memset(state->touch_active, 0, sizeof(state->touch_active));
+                return;
+            }
+            break;
+        }
+    }
+
+    if (slot < 0 || slot >= MAX_TOUCHPOINTS || !have_tracking_id)
+        return;
+
+    // Recorded tracking ids are slot indices, so the slot doubles as the id.
+    if (tracking_id == -1) {
+        touch_handle_up(input, slot);
+        state->touch_active[slot] = false;
+    } else if (state->touch_active[slot]) {
+        touch_handle_motion(input, slot, x, y, pressure);
+    } else {
+        touch_handle_down(input, slot, x, y, pressure);
+        state->touch_active[slot] = true;
+    }
+}
+
+static void replay_keyboard(struct input *input, const struct input_record_event *events, unsigned int count) {
+    for (unsigned int i = 0; i < count; i++) {
+        if (events[i].type != EV_KEY)
+            continue;
+        keyboard_handle_key(input, qwerty_lookup_keysym(events[i].code), events[i].value);
+    }
+}
+
+static void replay_pointer(struct input *input, const struct input_record_event *events, unsigned int count) {
+    int x = 0, y = 0;
+    bool moved = false;
+
+    for (unsigned int i = 0; i < count; i++) {
+        if (events[i].type == EV_ABS && events[i].code == ABS_X) {
+            x = events[i].value;
+            moved = true;
+        } else if (events[i].type == EV_ABS && events[i].code == ABS_Y) {
+            y = events[i].value;
+            moved = true;
+        } else if (events[i].type == EV_KEY) {
+            pointer_handle_button(input, mouse_lookup_button(events[i].code), events[i].value);
+        } else if (events[i].type == EV_REL && events[i].code == REL_WHEEL) {
+            // pointer_handle_axis() scales by 1/100 before emitting wheel steps.
+            pointer_handle_axis(input, 0, events[i].value * 100.0);
+        } else if (events[i].type == EV_REL && events[i].code == REL_HWHEEL) {
+            pointer_handle_axis(input, 1, events[i].value * 100.0);
+        }
+    }
+
+    if (moved)
+        pointer_handle_motion(input, x, y);
+}
+
+static void replay_gamepad(struct input *input, const struct input_record_event *events, unsigned int count) {
+    for (unsigned int i = 0; i < count; i++) {
+        if (events[i].type == EV_ABS)
+            gamepad_handle_axis(input, events[i].code, events[i].value);
+        else if (events[i].type == EV_KEY)
+            gamepad_handle_button(input, events[i].code, events[i].value);
+    }
+    gamepad_handle_frame(input);
+}
+
+static void print_usage_and_exit(const char *name) {
+    printf("usage: %s [flags] <recording>\n"
+           "\t'-x,--speed=<>'"
+           "\n\t\treplay speed multiplier or 'max', default is 1\n"
+           "\t'-n,--loops=<>'"
+           "\n\t\tnumber of times to replay the recording, default is 1\n",
+           name);
+    exit(0);
+}
+
+int main(int argc, char **argv) {
+    struct input_record_event events[INPUT_RECORD_MAX_EVENTS];
+    struct input_record_batch batch;
+    struct fifo_reader readers[INPUT_TOTAL];
+    struct input *input;
+    uint64_t recorded[INPUT_TOTAL] = {0};
+    double speed = 1.0;
+    int loops = 1, c, option_index = 0;
+
+    static struct option long_options[] = {
+        {"speed", required_argument, 0, 'x'},
+        {"loops", required_argument, 0, 'n'},
+        {"help", no_argument, 0, 'h'},
+        {0, 0, 0, 0}};
+
+    while ((c = getopt_long(argc, argv, "hx:n:", long_options, &option_index)) != -1) {
+        switch (c) {
+        case 'x':
+            speed = strcmp(optarg, "max") == 0 ? 0.0 : strtod(optarg, NULL);
+            break;
+        case 'n':
+            loops = strtol(optarg, NULL, 10);
+            break;
+        default:
+            print_usage_and_exit(argv[0]);
+        }
+    }
+    if (optind != argc - 1)
+        print_usage_and_exit(argv[0]);
+
+    input = (struct input *)calloc(1, sizeof *input);
+    init_input(input);
+
+    readers_running = true;
+    for (int i = 0; i < INPUT_TOTAL; i++) {
+        readers[i].input_type = i;
+        readers[i].events = 0;
+        readers[i].thread = std::thread(run_reader, &readers[i]);
+    }
+    // Writers open with O_NONBLOCK and fail without a reader, let them settle.
+    usleep(100000);
+
+    uint64_t start_us = monotonic_us();
+
+    for (int loop = 0; loop < loops; loop++) {
+        struct replay_state state;
+        uint64_t first_us = 0, loop_start_us = monotonic_us();
+        int res;
+
+        FILE *file = input_record_open(argv[optind]);
+        if (!file)
+            return 1;
+
+        memset(&state, 0, sizeof(state));
+        while ((res = input_record_read(file, &batch, events)) > 0) {
+            if (batch.device >= INPUT_TOTAL)
+                continue;
+
+            if (first_us == 0)
+                first_us = batch.time_us;
+            if (speed > 0.0)
+                sleep_until_us(loop_start_us + (uint64_t)((batch.time_us - first_us) / speed));
+
+            recorded[batch.device] += batch.count;
+            switch (batch.device) {
+            case INPUT_TOUCH:
+                replay_touch(input, &state, events, batch.count);
+                break;
+            case INPUT_KEYBOARD:
+                replay_keyboard(input, events, batch.count);
+                break;
+            case INPUT_POINTER:
+                replay_pointer(input, events, batch.count);
+                break;
+            case INPUT_GAMEPAD:
+                replay_gamepad(input, events, batch.count);
+                break;
+            }
+        }
+        fclose(file);
+        if (res < 0)
+            break;
+    }
+
+    uint64_t elapsed_us = monotonic_us() - start_us;
+
+    // Give the readers a moment to drain what is still in the FIFOs.
+    usleep(200000);
+    readers_running = false;
+    for (int i = 0; i < INPUT_TOTAL; i++)
+        readers[i].thread.join();
+
+    uint64_t total_written = 0;
+    printf("Replayed %s in %.3f s\n", argv[optind], elapsed_us / 1000000.0);
+    for (int i = 0; i < INPUT_TOTAL; i++) {
+        uint64_t received = readers[i].events;
+
+        total_written += input->stats[i].events;
+        printf("%-9s recorded %8" PRIu64 " written %8" PRIu64 " received %8" PRIu64 " failed writes %6" PRIu64
+               " dropped %8" PRIu64 " write latency avg %" PRIu64 " us max %" PRIu64 " us\n",
+               DEVICE_NAME[i], recorded[i], input->stats[i].events, received,
+               input->stats[i].failed, input->stats[i].events - received,
+               input->stats[i].writes ? input->stats[i].latency_us_total / input->stats[i].writes : 0,
+               input->stats[i].latency_us_max);
+    }
+    printf("Achieved %.0f events/s\n", elapsed_us ? total_written * 1000000.0 / elapsed_us : 0.0);
+
+    deinit_input(input);
+    free(input);
+
+    return 0;
+}
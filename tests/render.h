@@ -484,6 +484,17 @@ static int create_dmabuf_buffer(struct display *display, struct buffer *buffer)
      * buffer through a FBO. */
     int i;
 
+    if (!buffer->bo && display->modifiers_count > 0) {
+        buffer->bo = gbm_bo_create_with_modifiers(display->gbm.device,
+                                                  buffer->width,
+                                                  buffer->height,
+                                                  buffer->format,
+                                                  display->modifiers,
+                                                  display->modifiers_count);
+        if (buffer->bo)
+            buffer->modifier = gbm_bo_get_modifier(buffer->bo);
+    }
+
     if (!buffer->bo) {
         buffer->bo = gbm_bo_create(display->gbm.device,
                                    buffer->width,
@@ -2,92 +2,449 @@
 #include <EGL/eglext.h>
 #include <GLES2/gl2.h>
 #include <drm_fourcc.h>
+#include <getopt.h>
+#include <poll.h>
 #include <stdio.h>
-#include <thread>
+#include <sys/time.h>
+#include <algorithm>
+#include <vector>
 
 #include <playsocket.h>
 
+#include "cpu-buffer.h"
+#include "frame-schedule.h"
 #include "render.h"
 #include <wayland-window.h>
 
 #define DEF_SOCKET_PATH "/tmp/playdroid_socket"
+#define DEF_RENDER_NODE "/dev/dri/renderD128"
+#define MAX_BUFFERS 16
+#define MAX_DISPLAYS 8
+
+static void print_usage_and_exit(const char *name) {
+    printf("usage: %s [flags] [socket path]\n"
+           "\t'-c,--cpu'"
+           "\n\t\trender on the CPU into udmabuf/memfd buffers instead of GBM/EGL,\n"
+           "\t\tused automatically when the render node cannot be opened\n"
+           "\t'-d,--render-node=<>'"
+           "\n\t\tDRM render node for the GPU backend, default is " DEF_RENDER_NODE "\n"
+           "\t'-b,--buffers=<>'"
+           "\n\t\tnumber of buffers to cycle through, default is 3\n"
+           "\t'-w,--width=<>'"
+           "\n\t\tbuffer width, default is the streamer's resolution\n"
+           "\t'-y,--height=<>'"
+           "\n\t\tbuffer height, default is the streamer's resolution\n"
+           "\t'-f,--fps=<>'"
+           "\n\t\tframes per second, default is the streamer's refresh rate\n"
+           "\t'-P,--profile=<>'"
+           "\n\t\tload profile: constant, burst[:frames], jitter[:percent] or\n"
+           "\t\tstep[:fps[:seconds]], default is constant\n"
+           "\t'-S,--seed=<>'"
+           "\n\t\tseed for the jitter profile, default is 1\n"
+           "\t'-p,--ping=<>'"
+           "\n\t\tmilliseconds between send-to-reply latency probes, 0 disables, default is 1000\n"
+           "\t'-D,--no-demand'"
+           "\n\t\trender at full rate even when the streamer has no viewers\n"
+           "\t'-I,--display=<>'"
+           "\n\t\tcomma separated ids of the streamer's displays to render, all over\n"
+           "\t\tthis one connection, default is 0, the primary one\n",
+           name);
+    exit(0);
+}
+
+// What the streamer asked for since MSG_CAN_PAUSE_RENDERING
+struct demand {
+    bool paused;
+    bool resumed; // until the schedule restarted
+    int fps_hint;
+};
+
+static void handle_demand(struct demand *demand, struct MessageData *message) {
+    if (message->type == MSG_PAUSE_RENDERING) {
+        printf("Streamer paused rendering\n");
+        demand->paused = true;
+    } else if (message->type == MSG_RESUME_RENDERING) {
+        printf("Streamer resumed rendering at %dHz\n", message->refresh_rate / 1000);
+        demand->paused = false;
+        demand->resumed = true;
+        demand->fps_hint = message->refresh_rate / 1000;
+    }
+}
+
+// One of the streamer's displays, rendered and sent over the shared connection
+struct producer_output {
+    uint32_t id;
+    struct MessageData message; // resolution, then the description sent with every frame
+    struct buffer *buffers[MAX_BUFFERS];
+    struct cpu_buffer cpu_buffers[MAX_BUFFERS];
+    int current;
+};
+
+// Reads what the streamer sent unprompted, blocks while rendering is paused
+// and `block` says nothing else is left to render. Returns -1 once the
+// streamer is gone.
+static int read_demand(int sock, struct demand *demand, bool block) {
+    struct pollfd pfd = {sock, POLLIN, 0};
+
+    while (poll(&pfd, 1, demand->paused && block ? -1 : 0) > 0) {
+        struct MessageData message;
+        MessageType type;
+
+        if (recv_message(sock, NULL, &message, &type) <= 0)
+            return -1;
+        if (type == MSG_TYPE_DATA)
+            handle_demand(demand, &message);
+    }
+    return 0;
+}
+
+static int parse_displays(const char *arg, struct producer_output *outputs, int *count) {
+    char *copy = strdup(arg), *save = NULL;
+    int ret = 0;
+
+    *count = 0;
+    for (char *token = strtok_r(copy, ",", &save); token && ret == 0; token = strtok_r(NULL, ",", &save)) {
+        char *end;
+        unsigned long id = strtoul(token, &end, 10);
+
+        if (end == token || *end || *count == MAX_DISPLAYS)
+            ret = -1;
+        else
+            outputs[(*count)++].id = id;
+    }
+    free(copy);
+    return ret < 0 || *count == 0 ? -1 : 0;
+}
+
+/* Resolution and formats of one display. Only modifiers the streamer lists
+ * for every display are kept, the buffers come from one allocator. */
+static int ask_display(int sock, struct producer_output *output, std::vector<uint64_t> *modifiers, bool first) {
+    struct MessageData *message = &output->message;
+    struct MessageData format_message;
+    std::vector<uint64_t> listed;
+    MessageType type;
+
+    memset(message, 0, sizeof(*message));
+    message->display_id = output->id;
+    message->type = MSG_ASK_FOR_RESOLUTION;
+    send_message(sock, -1, MSG_TYPE_DATA_NEEDS_REPLY, message);
+
+    recv_message(sock, NULL, message, &type);
+    if (type != MSG_TYPE_DATA_REPLY || message->type != MSG_HAVE_RESOLUTION) {
+        fprintf(stderr, "Expected resolution reply, got type %d, message type %d\n", type, message->type);
+        return -1;
+    }
+    if (message->width <= 0 || message->height <= 0) {
+        fprintf(stderr, "Streamer has no display %u\n", output->id);
+        return -1;
+    }
+    printf("Got resolution for display %u: %dx%d@%dHz\n", output->id, message->width, message->height,
+           message->refresh_rate / 1000);
+
+    memset(&format_message, 0, sizeof(format_message));
+    format_message.display_id = output->id;
+    format_message.type = MSG_ASK_FOR_FORMATS;
+    send_message(sock, -1, MSG_TYPE_DATA_NEEDS_REPLY, &format_message);
+    while (recv_message(sock, NULL, &format_message, &type) > 0 && type == MSG_TYPE_DATA_REPLY &&
+           format_message.type == MSG_HAVE_FORMAT && format_message.format != 0) {
+        if (format_message.format == BUFFER_FORMAT)
+            listed.push_back(format_message.modifiers);
+    }
+
+    // An empty list is no constraint
+    if (first || modifiers->empty()) {
+        *modifiers = listed;
+    } else if (!listed.empty()) {
+        std::vector<uint64_t> common;
+
+        for (uint64_t modifier : *modifiers)
+            if (std::find(listed.begin(), listed.end(), modifier) != listed.end())
+                common.push_back(modifier);
+        *modifiers = common;
+    }
+    return 0;
+}
+
+static uint64_t time_ms(void) {
+    struct timeval tv;
+
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec * 1000 + tv.tv_usec / 1000;
+}
 
 int main(int argc, char **argv) {
-    if(argc > 2) {
+    const char *socket_path = DEF_SOCKET_PATH;
+    const char *render_node = DEF_RENDER_NODE;
+    int num_buffers = 3, width = 0, height = 0, fps = 0;
+    int ping_ms = 1000;
+    struct producer_output outputs[MAX_DISPLAYS];
+    int output_count = 1;
+    bool use_cpu = false;
+    bool follow_demand = true;
+    struct demand demand = {false, false, 0};
+    struct frame_schedule schedule;
+    int c, option_index = 0;
+
+    memset(outputs, 0, sizeof(outputs));
+    memset(&schedule, 0, sizeof(schedule));
+    schedule.seed = 1;
+    schedule_parse_profile(&schedule, "constant");
+
+    static struct option long_options[] = {
+        {"cpu", no_argument, 0, 'c'},
+        {"render-node", required_argument, 0, 'd'},
+        {"buffers", required_argument, 0, 'b'},
+        {"width", required_argument, 0, 'w'},
+        {"height", required_argument, 0, 'y'},
+        {"fps", required_argument, 0, 'f'},
+        {"profile", required_argument, 0, 'P'},
+        {"seed", required_argument, 0, 'S'},
+        {"ping", required_argument, 0, 'p'},
+        {"no-demand", no_argument, 0, 'D'},
+        {"display", required_argument, 0, 'I'},
+        {"help", no_argument, 0, 'h'},
+        {0, 0, 0, 0}};
+
+    while ((c = getopt_long(argc, argv, "hcd:b:w:y:f:P:S:p:DI:", long_options, &option_index)) != -1) {
+        switch (c) {
+        case 'c':
+            use_cpu = true;
+            break;
+        case 'd':
+            render_node = optarg;
+            break;
+        case 'b':
+            num_buffers = strtol(optarg, NULL, 10);
+            break;
+        case 'w':
+            width = strtol(optarg, NULL, 10);
+            break;
+        case 'y':
+            height = strtol(optarg, NULL, 10);
+            break;
+        case 'f':
+            fps = strtol(optarg, NULL, 10);
+            break;
+        case 'P':
+            if (schedule_parse_profile(&schedule, optarg) < 0) {
+                fprintf(stderr, "Invalid load profile %s\n", optarg);
+                return 1;
+            }
+            break;
+        case 'S':
+            schedule.seed = strtoul(optarg, NULL, 10);
+            break;
+        case 'p':
+            ping_ms = strtol(optarg, NULL, 10);
+            break;
+        case 'D':
+            follow_demand = false;
+            break;
+        case 'I':
+            if (parse_displays(optarg, outputs, &output_count) < 0) {
+                fprintf(stderr, "Invalid display ids %s, at most %d\n", optarg, MAX_DISPLAYS);
+                return 1;
+            }
+            break;
+        default:
+            print_usage_and_exit(argv[0]);
+        }
+    }
+    if (argc - optind > 1) {
         printf("%s takes no more than 1 argument.\n", argv[0]);
         return 1;
     }
-
-    const char *socket_path = DEF_SOCKET_PATH;
-    if (argc == 2) {
-        socket_path = argv[1];
+    if (optind < argc)
+        socket_path = argv[optind];
+    if (num_buffers < 1 || num_buffers > MAX_BUFFERS) {
+        fprintf(stderr, "buffers must be between 1 and %d\n", MAX_BUFFERS);
+        return 1;
     }
 
     int sock = connect_socket(socket_path);
+    bool has_primary = false;
 
+    // Session-wide, sent once for all displays
     struct MessageData message;
+    memset(&message, 0, sizeof(message));
     message.type = MSG_HELLO;
     send_message(sock, -1, MSG_TYPE_DATA, &message);
 
-    message.type = MSG_ASK_FOR_RESOLUTION;
-    send_message(sock, -1, MSG_TYPE_DATA_NEEDS_REPLY, &message);
+    std::vector<uint64_t> modifiers;
+    for (int i = 0; i < output_count; ++i) {
+        struct MessageData *resolution = &outputs[i].message;
 
-    MessageType type;
-    recv_message(sock, NULL, &message, &type);
-    if (type != MSG_TYPE_DATA_REPLY || message.type != MSG_HAVE_RESOLUTION) {
-        fprintf(stderr, "Expected resolution reply, got type %d, message type %d\n", type, message.type);
-        return 1;
+        if (ask_display(sock, &outputs[i], &modifiers, i == 0) < 0)
+            return 1;
+        if (width > 0)
+            resolution->width = width;
+        if (height > 0)
+            resolution->height = height;
+        if (fps > 0)
+            resolution->refresh_rate = fps * 1000;
+        if (resolution->refresh_rate <= 0)
+            resolution->refresh_rate = 60000;
+        has_primary |= outputs[i].id == 0;
+    }
+
+    struct display *display = NULL;
+    if (!use_cpu) {
+        display = create_display(render_node);
+        if (!display) {
+            fprintf(stderr, "GPU backend unavailable, falling back to CPU rendering\n");
+            use_cpu = true;
+        }
     }
-    printf("Got resolution: %dx%d@%dHz\n", message.width, message.height, message.refresh_rate / 1000);
 
-    struct display *display = create_display("/dev/dri/renderD128");
+    if (use_cpu) {
+        if (!modifiers.empty() && std::find(modifiers.begin(), modifiers.end(), DRM_FORMAT_MOD_LINEAR) == modifiers.end())
+            fprintf(stderr, "Warning: the streamer did not advertise linear buffers\n");
 
-    const int num_buffers = 3;
-    struct buffer *buffers[num_buffers];
-    for (int i = 0; i < num_buffers; ++i) {
-        buffers[i] = (struct buffer *)calloc(1, sizeof *buffers[i]);
-        buffers[i]->display = display;
-        buffers[i]->width = message.width;
-        buffers[i]->height = message.height;
-        buffers[i]->format = BUFFER_FORMAT;
+        for (int o = 0; o < output_count; ++o) {
+            struct producer_output *output = &outputs[o];
 
-        if (create_dmabuf_buffer(display, buffers[i]) < 0) {
-            fprintf(stderr, "Failed to create dmabuf buffer %d\n", i);
-            return 1;
+            for (int i = 0; i < num_buffers; ++i) {
+                if (create_cpu_buffer(&output->cpu_buffers[i], output->message.width, output->message.height) < 0) {
+                    fprintf(stderr, "Failed to create cpu buffer %d\n", i);
+                    return 1;
+                }
+            }
+            output->message.type = MSG_HAVE_BUFFER;
+            output->message.format = BUFFER_FORMAT;
+            output->message.modifiers = DRM_FORMAT_MOD_LINEAR;
+            output->message.stride = output->cpu_buffers[0].stride;
+            output->message.offset = 0;
         }
-    }
+        printf("Rendering on the CPU into %d %s buffers per display\n", num_buffers,
+               outputs[0].cpu_buffers[0].dmabuf ? "udmabuf" : "memfd");
+    } else {
+        // Only allocate with modifiers both EGL and the streamer's preview can use
+        if (!modifiers.empty()) {
+            int count = 0;
+            for (int i = 0; i < display->modifiers_count; ++i) {
+                if (std::find(modifiers.begin(), modifiers.end(), display->modifiers[i]) != modifiers.end())
+                    display->modifiers[count++] = display->modifiers[i];
+            }
+            display->modifiers_count = count;
+        }
+
+        for (int o = 0; o < output_count; ++o) {
+            struct producer_output *output = &outputs[o];
 
-    window_set_up_gl(display);
+            for (int i = 0; i < num_buffers; ++i) {
+                output->buffers[i] = (struct buffer *)calloc(1, sizeof *output->buffers[i]);
+                output->buffers[i]->display = display;
+                output->buffers[i]->width = output->message.width;
+                output->buffers[i]->height = output->message.height;
+                output->buffers[i]->format = BUFFER_FORMAT;
+
+                if (create_dmabuf_buffer(display, output->buffers[i]) < 0) {
+                    fprintf(stderr, "Failed to create dmabuf buffer %d\n", i);
+                    return 1;
+                }
+            }
+            output->message.type = MSG_HAVE_BUFFER;
+            output->message.format = output->buffers[0]->format;
+            output->message.modifiers = output->buffers[0]->modifier;
+            output->message.stride = output->buffers[0]->strides[0];
+            output->message.offset = output->buffers[0]->offsets[0];
+        }
+
+        window_set_up_gl(display);
+    }
 
     //struct window_state *wayland_state = setup_wayland_window();
     //setup_window(wayland_state);
 
-    message.type = MSG_HAVE_BUFFER;
-    message.format = buffers[0]->format;
-    message.modifiers = buffers[0]->modifier;
-    message.stride = buffers[0]->strides[0];
-    message.offset = buffers[0]->offsets[0];
+    uint64_t next_ping_ns = 0;
+
+    // From here on the streamer may pause and resume us at any time. It only
+    // does so for its primary display, the others keep rendering.
+    if (follow_demand && has_primary) {
+        struct MessageData can_pause;
 
-    int current = 0;
+        memset(&can_pause, 0, sizeof(can_pause));
+        can_pause.type = MSG_CAN_PAUSE_RENDERING;
+        send_message(sock, -1, MSG_TYPE_DATA, &can_pause);
+    }
 
-    while (1) {
-        buffer *buffer = buffers[current];
-        render(display, buffer);
-        glFinish();
+    // Every display gets a frame per tick, at the rate of the first one
+    schedule_start(&schedule, outputs[0].message.refresh_rate / 1000);
 
-        //draw_window(wayland_state, &message, buffer->dmabuf_fds[0]);
+    bool running = true;
+    while (running) {
+        if (follow_demand && read_demand(sock, &demand, output_count == 1) < 0)
+            break;
+        // A fresh grid, the paused time is neither late nor skipped frames
+        if (demand.resumed) {
+            schedule_start(&schedule, fps > 0 ? fps : demand.fps_hint > 0 ? demand.fps_hint : schedule.fps);
+            demand.resumed = false;
+        }
 
-        //fprintf(stderr, "Sending message with fd %d\n", buffer->dmabuf_fds[0]);
-        send_message(sock, buffer->dmabuf_fds[0], MSG_TYPE_FD, &message);
+        schedule_wait(&schedule);
 
-        current = (current + 1) % num_buffers;
+        for (int o = 0; o < output_count && running; ++o) {
+            struct producer_output *output = &outputs[o];
+            int fd;
 
-        std::this_thread::sleep_for(std::chrono::microseconds(1000000 / message.refresh_rate / 1000)); // Convert Hz to microseconds
+            if (output->id == 0 && demand.paused)
+                continue;
+            if (use_cpu) {
+                render_cpu_buffer(&output->cpu_buffers[output->current], time_ms());
+                fd = output->cpu_buffers[output->current].fd;
+            } else {
+                buffer *buffer = output->buffers[output->current];
+                render(display, buffer);
+                glFinish();
+                fd = buffer->dmabuf_fds[0];
+            }
+
+            //draw_window(wayland_state, &output->message, fd);
+
+            //fprintf(stderr, "Sending message with fd %d\n", fd);
+            if (send_message(sock, fd, MSG_TYPE_FD, &output->message) < 0)
+                running = false;
+            output->current = (output->current + 1) % num_buffers;
+        }
+        if (!running)
+            break;
+
+        // The streamer handles messages in order, so the reply to a request
+        // sent right after a frame also covers the time to consume that frame
+        if (ping_ms > 0 && schedule_now_ns() >= next_ping_ns) {
+            struct MessageData ping;
+            MessageType type;
+            uint64_t sent_ns = schedule_now_ns();
+
+            memset(&ping, 0, sizeof(ping));
+            ping.display_id = outputs[0].id;
+            ping.type = MSG_ASK_FOR_RESOLUTION;
+            if (send_message(sock, -1, MSG_TYPE_DATA_NEEDS_REPLY, &ping) < 0)
+                break;
+            // Demand messages may arrive ahead of the reply
+            int received;
+            while ((received = recv_message(sock, NULL, &ping, &type)) > 0 && type == MSG_TYPE_DATA)
+                handle_demand(&demand, &ping);
+            if (received <= 0)
+                break;
+            if (type == MSG_TYPE_DATA_REPLY && ping.type == MSG_HAVE_RESOLUTION)
+                schedule_add_rtt(&schedule, schedule_now_ns() - sent_ns);
+            next_ping_ns = sent_ns + (uint64_t)ping_ms * 1000000;
+        }
+
+        schedule_frame_done(&schedule);
+        schedule_report(&schedule);
     }
 
-    for (int i = 0; i < num_buffers; ++i) {
-        close(buffers[i]->dmabuf_fds[0]);
-        free(buffers[i]);
+    for (int o = 0; o < output_count; ++o) {
+        for (int i = 0; i < num_buffers; ++i) {
+            if (use_cpu) {
+                destroy_cpu_buffer(&outputs[o].cpu_buffers[i]);
+            } else {
+                close(outputs[o].buffers[i]->dmabuf_fds[0]);
+                free(outputs[o].buffers[i]);
+            }
+        }
     }
     close(sock);
 
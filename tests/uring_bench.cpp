@@ -0,0 +1,319 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <inttypes.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <thread>
+#include <time.h>
+#include <unistd.h>
+#include <linux/input.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <playsocket.h>
+#include <uring.h>
+
+/*
+ * Compares the poll()/recvmsg() and write() paths with the io_uring ones.
+ * A sender thread streams frame and data messages over a socketpair, three
+ * out of four carrying an fd from a small pool told apart by size, and the
+ * receiver checks order and fd of every message. The io_uring receiver
+ * detaches halfway and reads the rest with recv_message(), as a handoff
+ * does. Input writes go to a FIFO drained by a reader thread, queued and
+ * flushed in batches the size of one navigation event.
+ * Exits 77 (skipped) when io_uring is not usable.
+ */
+
+#define SKIP_EXIT_CODE 77
+#define BENCH_FD_POOL 4
+#define BENCH_EVENTS_PER_WRITE 6 // a touch down
+#define BENCH_PIPE_SIZE (1 << 20)
+
+static uint64_t monotonic_ns(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void send_all(int sock, int messages, const int *pool) {
+    struct MessageData message;
+
+    for (int i = 0; i < messages; i++) {
+        memset(&message, 0, sizeof(message));
+        message.type = MSG_HAVE_BUFFER;
+        message.width = i;
+        if (i % 4 == 3)
+            send_message(sock, -1, MSG_TYPE_DATA, &message);
+        else
+            send_message(sock, pool[i % BENCH_FD_POOL], MSG_TYPE_FD, &message);
+    }
+    close(sock);
+}
+
+// Closes the fd, returns -1 when the message is not the i-th one sent
+static int check_message(int i, MessageType type, const MessageData *message, int fd) {
+    bool want_fd = i % 4 != 3;
+    struct stat st;
+    int ret = 0;
+
+    if (message->width != i || type != (want_fd ? MSG_TYPE_FD : MSG_TYPE_DATA)) {
+        fprintf(stderr, "FAIL: message %d arrived as %d of type %d\n", i, message->width, type);
+        ret = -1;
+    } else if (want_fd && (fd < 0 || fstat(fd, &st) < 0 || st.st_size != (i % BENCH_FD_POOL + 1) * 4096)) {
+        fprintf(stderr, "FAIL: message %d came with the wrong fd\n", i);
+        ret = -1;
+    }
+    if (want_fd && fd >= 0)
+        close(fd);
+    return ret;
+}
+
+static int receive_poll(int sock, int *count) {
+    struct pollfd pfd = {sock, POLLIN, 0};
+    struct MessageData message;
+    MessageType type;
+    int fd;
+
+    while (poll(&pfd, 1, -1) > 0) {
+        fd = -1;
+        if (recv_message(sock, &fd, &message, &type) <= 0)
+            return 0;
+        if (check_message((*count)++, type, &message, fd) < 0)
+            return -1;
+    }
+    return -1;
+}
+
+static int receive_uring(struct uring_recv *recv, int sock, int detach_at, int *count, int *wakeups) {
+    struct pollfd pfd = {sock, POLLIN, 0};
+    struct MessageData message;
+    MessageType type;
+    int fd, received;
+
+    while (*count < detach_at) {
+        if (uring_recv_poll(recv, &pfd, 1, sock, -1) < 0) {
+            fprintf(stderr, "uring_recv_poll failed: %s\n", strerror(errno));
+            return -1;
+        }
+        (*wakeups)++;
+        while (uring_recv_pending(recv)) {
+            fd = -1;
+            received = uring_recv_message(recv, &fd, &message, &type);
+            if (received <= 0)
+                return received;
+            if (check_message((*count)++, type, &message, fd) < 0)
+                return -1;
+        }
+    }
+
+    // What was taken off the socket is still ours, the rest starts at a message
+    if (uring_recv_detach(recv) < 0)
+        return -1;
+    while (uring_recv_pending(recv)) {
+        fd = -1;
+        received = uring_recv_message(recv, &fd, &message, &type);
+        if (received <= 0)
+            return received;
+        if (check_message((*count)++, type, &message, fd) < 0)
+            return -1;
+    }
+    return receive_poll(sock, count);
+}
+
+static int bench_receive(struct uring_recv *recv, int messages, const int *pool) {
+    const char *name = recv ? "io_uring" : "poll";
+    int sv[2], count = 0, wakeups = 0, ret;
+    uint64_t start_ns, elapsed_ns;
+
+    if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sv) < 0) {
+        fprintf(stderr, "socketpair failed: %s\n", strerror(errno));
+        return -1;
+    }
+
+    start_ns = monotonic_ns();
+    std::thread sender(send_all, sv[1], messages, pool);
+    if (recv)
+        ret = receive_uring(recv, sv[0], messages / 2, &count, &wakeups);
+    else
+        ret = receive_poll(sv[0], &count);
+    sender.join();
+    elapsed_ns = monotonic_ns() - start_ns;
+    close(sv[0]);
+    // Disconnects the receiver from the socket before its number is reused
+    if (recv)
+        uring_recv_poll(recv, NULL, 0, -1, 0);
+
+    printf("%-8s receive: %d messages in %.3f s, %.2f us each", name, count, elapsed_ns / 1e9,
+           count ? elapsed_ns / 1e3 / count : 0.0);
+    if (recv)
+        printf(", %.1f per wakeup until detached", wakeups ? (double)(messages / 2) / wakeups : 0.0);
+    printf("\n");
+
+    if (ret == 0 && count != messages) {
+        fprintf(stderr, "FAIL: %s received %d of %d messages\n", name, count, messages);
+        ret = -1;
+    }
+    return ret;
+}
+
+static void drain(int fd, size_t *total) {
+    char buf[65536];
+    ssize_t n;
+
+    while ((n = read(fd, buf, sizeof(buf))) > 0)
+        *total += n;
+}
+
+struct write_count {
+    size_t bytes;
+    uint64_t failed;
+};
+
+static void write_done(void *data, uint64_t, const void *, size_t len, ssize_t res) {
+    struct write_count *count = (struct write_count *)data;
+
+    if (res == (ssize_t)len)
+        count->bytes += len;
+    else
+        count->failed++;
+}
+
+static int bench_writes(struct uring_writer *writer, int writes, int batch) {
+    const char *name = writer ? "io_uring" : "write";
+    struct input_event event[BENCH_EVENTS_PER_WRITE];
+    struct write_count count = {0, 0};
+    int direct = 0;
+    size_t drained = 0;
+    uint64_t start_ns, elapsed_ns;
+    char path[64];
+    int fds[2];
+
+    // A named FIFO like the input pipes, some kernels treat it unlike pipe2()
+    snprintf(path, sizeof(path), "/tmp/uring-bench-%d", getpid());
+    unlink(path);
+    if (mkfifo(path, 0600) < 0 || (fds[0] = open(path, O_RDONLY | O_NONBLOCK | O_CLOEXEC)) < 0) {
+        fprintf(stderr, "FIFO %s failed: %s\n", path, strerror(errno));
+        return -1;
+    }
+    // Like the input FIFOs, a full pipe fails the write rather than blocking
+    fds[1] = open(path, O_WRONLY | O_NONBLOCK | O_CLOEXEC);
+    unlink(path);
+    fcntl(fds[0], F_SETFL, 0);
+    fcntl(fds[1], F_SETPIPE_SZ, BENCH_PIPE_SIZE);
+    memset(event, 0, sizeof(event));
+
+    std::thread reader(drain, fds[0], &drained);
+    start_ns = monotonic_ns();
+    for (int i = 0; i < writes; i++) {
+        if (writer && uring_writer_queue(writer, fds[1], event, sizeof(event), 0) == 0) {
+            if ((i + 1) % batch == 0 || i == writes - 1)
+                uring_writer_flush(writer, write_done, &count);
+        } else {
+            // As input.cpp does once the writer refuses the fd
+            if (writer) {
+                uring_writer_flush(writer, write_done, &count);
+                direct++;
+            }
+            write_done(&count, 0, event, sizeof(event), write(fds[1], event, sizeof(event)));
+        }
+    }
+    elapsed_ns = monotonic_ns() - start_ns;
+    close(fds[1]);
+    reader.join();
+    close(fds[0]);
+
+    printf("%-8s writes: %d of %zu bytes in %.3f s, %.2f us each, batches of %d, %" PRIu64 " failed\n", name, writes,
+           sizeof(event), elapsed_ns / 1e9, elapsed_ns / 1e3 / writes, writer ? batch : 1, count.failed);
+    if (direct)
+        printf("%-8s writes: %d written directly, the FIFO refuses RWF_NOWAIT\n", name, direct);
+    if (drained != count.bytes || count.bytes + count.failed * sizeof(event) != (size_t)writes * sizeof(event)) {
+        fprintf(stderr, "FAIL: %s wrote %zu bytes, %zu arrived\n", name, count.bytes, drained);
+        return -1;
+    }
+    return 0;
+}
+
+static void print_usage_and_exit(const char *name) {
+    printf("usage: %s [flags]\n"
+           "\t'-n,--messages=<>'"
+           "\n\t\tmessages to send per backend, default is 100000\n"
+           "\t'-w,--writes=<>'"
+           "\n\t\tinput writes per backend, default is 100000\n"
+           "\t'-b,--batch=<>'"
+           "\n\t\twrites per io_uring flush, default is 2 (a scroll on both axes)\n",
+           name);
+    exit(0);
+}
+
+int main(int argc, char **argv) {
+    int messages = 100000, writes = 100000, batch = 2;
+    int pool[BENCH_FD_POOL];
+    struct uring_recv *recv;
+    struct uring_writer *writer;
+    int c, option_index = 0, ret = 0;
+
+    static struct option long_options[] = {
+        {"messages", required_argument, 0, 'n'},
+        {"writes", required_argument, 0, 'w'},
+        {"batch", required_argument, 0, 'b'},
+        {"help", no_argument, 0, 'h'},
+        {0, 0, 0, 0}};
+
+    while ((c = getopt_long(argc, argv, "hn:w:b:", long_options, &option_index)) != -1) {
+        switch (c) {
+        case 'n':
+            messages = strtol(optarg, NULL, 10);
+            break;
+        case 'w':
+            writes = strtol(optarg, NULL, 10);
+            break;
+        case 'b':
+            batch = strtol(optarg, NULL, 10);
+            break;
+        default:
+            print_usage_and_exit(argv[0]);
+        }
+    }
+    if (messages < 2 || writes < 1 || batch < 1 || batch > URING_WRITE_SLOTS) {
+        fprintf(stderr, "Need 2 messages, 1 write and a batch of 1 to %d\n", URING_WRITE_SLOTS);
+        return 1;
+    }
+
+    recv = uring_recv_new();
+    writer = uring_writer_new();
+    if (!recv || !writer) {
+        fprintf(stderr, "io_uring is not usable, skipping\n");
+        uring_recv_free(recv);
+        uring_writer_free(writer);
+        return SKIP_EXIT_CODE;
+    }
+
+    for (int i = 0; i < BENCH_FD_POOL; i++) {
+        pool[i] = memfd_create("uring-bench", MFD_CLOEXEC);
+        if (pool[i] < 0 || ftruncate(pool[i], (i + 1) * 4096) < 0) {
+            fprintf(stderr, "memfd failed: %s\n", strerror(errno));
+            return 1;
+        }
+    }
+
+    if (bench_receive(NULL, messages, pool) < 0 || bench_receive(recv, messages, pool) < 0)
+        ret = 1;
+    if (bench_writes(NULL, writes, batch) < 0 || bench_writes(writer, writes, batch) < 0)
+        ret = 1;
+
+    // Kernels without multishot receives fail on the first wait
+    if (ret && errno == EOPNOTSUPP) {
+        fprintf(stderr, "io_uring cannot receive on sockets, skipping\n");
+        ret = SKIP_EXIT_CODE;
+    }
+
+    for (int i = 0; i < BENCH_FD_POOL; i++)
+        close(pool[i]);
+    uring_recv_free(recv);
+    uring_writer_free(writer);
+    return ret;
+}
@@ -0,0 +1,291 @@
+#include <errno.h>
+#include <getopt.h>
+#include <inttypes.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <drm_fourcc.h>
+#include <wayland-client.h>
+
+#include <socket-protocol.h>
+#include <wayland-window.h>
+
+#include "cpu-buffer.h"
+
+/*
+ * Drives draw_window() against a headless compositor with udmabuf buffers,
+ * so the preview path can be measured and checked for leaks without a GPU.
+ * Exits 77 (skipped) when no compositor or udmabuf is available.
+ */
+
+#define SKIP_EXIT_CODE 77
+#define BENCH_SOCKET "playdroid-window-bench"
+
+static uint64_t monotonic_ns(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static long rss_kb(pid_t pid) {
+    char path[64], line[256];
+    long kb = -1;
+    FILE *file;
+
+    snprintf(path, sizeof(path), "/proc/%d/status", pid);
+    file = fopen(path, "r");
+    if (!file)
+        return -1;
+    while (fgets(line, sizeof(line), file)) {
+        if (sscanf(line, "VmRSS: %ld kB", &kb) == 1)
+            break;
+    }
+    fclose(file);
+    return kb;
+}
+
+static pid_t spawn_compositor(const char *weston, const char *backend) {
+    char socket_path[512], backend_arg[128];
+    const char *runtime_dir = getenv("XDG_RUNTIME_DIR");
+    struct stat st;
+    pid_t pid;
+
+    if (!runtime_dir) {
+        fprintf(stderr, "XDG_RUNTIME_DIR is not set\n");
+        return -1;
+    }
+    snprintf(socket_path, sizeof(socket_path), "%s/%s", runtime_dir, BENCH_SOCKET);
+    snprintf(backend_arg, sizeof(backend_arg), "--backend=%s", backend);
+    unlink(socket_path);
+
+    pid = fork();
+    if (pid == 0) {
+        execlp(weston, weston, backend_arg, "--socket=" BENCH_SOCKET, "--idle-time=0", (char *)NULL);
+        fprintf(stderr, "Failed to start %s: %s\n", weston, strerror(errno));
+        _exit(127);
+    }
+    if (pid < 0)
+        return -1;
+
+    for (int i = 0; i < 100; i++) {
+        if (stat(socket_path, &st) == 0) {
+            setenv("WAYLAND_DISPLAY", BENCH_SOCKET, 1);
+            return pid;
+        }
+        if (waitpid(pid, NULL, WNOHANG) == pid)
+            return -1;
+        usleep(50000);
+    }
+
+    kill(pid, SIGTERM);
+    waitpid(pid, NULL, 0);
+    return -1;
+}
+
+static void fill_buffer(struct cpu_buffer *buffer, uint32_t color) {
+    for (int y = 0; y < buffer->height; y++) {
+        uint32_t *row = (uint32_t *)((char *)buffer->map + (size_t)y * buffer->stride);
+        for (int x = 0; x < buffer->width; x++)
+            row[x] = color;
+    }
+}
+
+static void print_usage_and_exit(const char *name) {
+    printf("usage: %s [flags]\n"
+           "\t'-n,--frames=<>'"
+           "\n\t\tframes to submit, default is 10000\n"
+           "\t'-b,--buffers=<>'"
+           "\n\t\tproducer buffers to cycle through, default is 3\n"
+           "\t'-w,--width=<>'"
+           "\n\t\twidth of the buffers, default is 1280\n"
+           "\t'-y,--height=<>'"
+           "\n\t\theight of the buffers, default is 720\n"
+           "\t'-c,--compositor=<>'"
+           "\n\t\tweston binary to spawn, default is weston\n"
+           "\t'-k,--backend=<>'"
+           "\n\t\tweston backend, default is headless\n"
+           "\t'-e,--existing'"
+           "\n\t\tuse the compositor in WAYLAND_DISPLAY instead of spawning one\n"
+           "\t'-m,--max-growth=<>'"
+           "\n\t\tfail when compositor memory grows by more kB, default is 32768\n",
+           name);
+    exit(0);
+}
+
+int main(int argc, char **argv) {
+    const char *weston = "weston", *backend = "headless";
+    int frames = 10000, num_buffers = 3, width = 1280, height = 720;
+    long max_growth_kb = 32768;
+    bool existing = false;
+    pid_t compositor = -1;
+    int c, option_index = 0, ret = 0;
+
+    static struct option long_options[] = {
+        {"frames", required_argument, 0, 'n'},
+        {"buffers", required_argument, 0, 'b'},
+        {"width", required_argument, 0, 'w'},
+        {"height", required_argument, 0, 'y'},
+        {"compositor", required_argument, 0, 'c'},
+        {"backend", required_argument, 0, 'k'},
+        {"existing", no_argument, 0, 'e'},
+        {"max-growth", required_argument, 0, 'm'},
+        {"help", no_argument, 0, 'h'},
+        {0, 0, 0, 0}};
+
+    while ((c = getopt_long(argc, argv, "hn:b:w:y:c:k:em:", long_options, &option_index)) != -1) {
+        switch (c) {
+        case 'n':
+            frames = strtol(optarg, NULL, 10);
+            break;
+        case 'b':
+            num_buffers = strtol(optarg, NULL, 10);
+            break;
+        case 'w':
+            width = strtol(optarg, NULL, 10);
+            break;
+        case 'y':
+            height = strtol(optarg, NULL, 10);
+            break;
+        case 'c':
+            weston = optarg;
+            break;
+        case 'k':
+            backend = optarg;
+            break;
+        case 'e':
+            existing = true;
+            break;
+        case 'm':
+            max_growth_kb = strtol(optarg, NULL, 10);
+            break;
+        default:
+            print_usage_and_exit(argv[0]);
+        }
+    }
+    if (num_buffers < 1 || num_buffers > WINDOW_BUFFER_CACHE_SIZE) {
+        fprintf(stderr, "buffers must be between 1 and %d\n", WINDOW_BUFFER_CACHE_SIZE);
+        return 1;
+    }
+
+    if (!existing) {
+        compositor = spawn_compositor(weston, backend);
+        if (compositor < 0) {
+            fprintf(stderr, "No headless compositor, skipping\n");
+            return SKIP_EXIT_CODE;
+        }
+    }
+
+    // Only the first `created` entries hold fds, the rest are zeroed
+    struct cpu_buffer *buffers = (struct cpu_buffer *)calloc(num_buffers, sizeof(*buffers));
+    int created = 0;
+    for (int i = 0; i < num_buffers; i++) {
+        int res = create_cpu_buffer(&buffers[i], width, height);
+
+        if (res == 0)
+            created++;
+        if (res < 0 || !buffers[i].dmabuf) {
+            fprintf(stderr, "udmabuf is not available, skipping\n");
+            ret = SKIP_EXIT_CODE;
+            goto out;
+        }
+        fill_buffer(&buffers[i], 0xff000000 | (0x40 * (i + 1)) << (8 * (i % 3)));
+    }
+
+    {
+        struct window_state *app_state = setup_wayland_window();
+        if (!app_state->display) {
+            free(app_state);
+            ret = SKIP_EXIT_CODE;
+            goto out;
+        }
+        setup_window(app_state);
+        wl_display_roundtrip(app_state->display);
+
+        struct MessageData message;
+        memset(&message, 0, sizeof(message));
+        message.type = MSG_HAVE_BUFFER;
+        message.width = width;
+        message.height = height;
+        message.format = DRM_FORMAT_XRGB8888;
+        message.modifiers = DRM_FORMAT_MOD_LINEAR;
+        message.stride = buffers[0].stride;
+        message.offset = 0;
+
+        long rss_start = compositor > 0 ? rss_kb(compositor) : -1;
+        uint64_t import_ns = 0, import_max_ns = 0, failures = 0;
+        uint64_t start_ns = monotonic_ns();
+
+        for (int frame = 0; frame < frames && app_state->running; frame++) {
+            struct pollfd pfd = { window_get_fd(app_state), POLLIN, 0 };
+            uint64_t imports = app_state->import_count;
+            uint64_t before_ns = monotonic_ns();
+
+            // Every frame arrives as a fresh fd, like from the producer socket
+            int fd = dup(buffers[frame % num_buffers].fd);
+            if (draw_window(app_state, &message, fd) != EXIT_SUCCESS)
+                failures++;
+            close(fd);
+
+            if (app_state->import_count != imports) {
+                uint64_t cost_ns = monotonic_ns() - before_ns;
+                import_ns += cost_ns;
+                if (cost_ns > import_max_ns)
+                    import_max_ns = cost_ns;
+            }
+
+            if (poll(&pfd, 1, 0) > 0)
+                window_dispatch(app_state);
+        }
+
+        // Let the last frame callbacks and releases arrive before measuring
+        wl_display_roundtrip(app_state->display);
+        window_dispatch(app_state);
+
+        double elapsed_s = (monotonic_ns() - start_ns) / 1000000000.0;
+        long rss_end = compositor > 0 ? rss_kb(compositor) : -1;
+
+        printf("Submitted %d frames of %dx%d in %.3f s (%d buffers)\n", frames, width, height, elapsed_s, num_buffers);
+        printf("Committed %" PRIu64 " frames, %.1f commits/s, %" PRIu64 " dropped by the mailbox, %" PRIu64 " failed\n",
+               app_state->committed_count, app_state->committed_count / elapsed_s,
+               app_state->dropped_count, failures);
+        printf("Imports %" PRIu64 ", avg %.1f us, max %.1f us\n", app_state->import_count,
+               app_state->import_count ? import_ns / 1000.0 / app_state->import_count : 0.0,
+               import_max_ns / 1000.0);
+        if (rss_start >= 0 && rss_end >= 0)
+            printf("Compositor RSS %ld kB -> %ld kB (%+ld kB)\n", rss_start, rss_end, rss_end - rss_start);
+
+        if (failures) {
+            fprintf(stderr, "FAIL: %" PRIu64 " frames failed to draw\n", failures);
+            ret = 1;
+        }
+        if (app_state->import_count > (uint64_t)num_buffers) {
+            fprintf(stderr, "FAIL: %" PRIu64 " imports for %d buffers, wl_buffers are not reused\n",
+                    app_state->import_count, num_buffers);
+            ret = 1;
+        }
+        if (rss_start >= 0 && rss_end >= 0 && rss_end - rss_start > max_growth_kb) {
+            fprintf(stderr, "FAIL: compositor memory grew by %ld kB\n", rss_end - rss_start);
+            ret = 1;
+        }
+
+        destroy_window(app_state);
+        free(app_state);
+    }
+
+out:
+    for (int i = 0; i < created; i++)
+        destroy_cpu_buffer(&buffers[i]);
+    free(buffers);
+    if (compositor > 0) {
+        kill(compositor, SIGTERM);
+        waitpid(compositor, NULL, 0);
+    }
+    return ret;
+}